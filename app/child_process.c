@@ -0,0 +1,49 @@
+#include "child_process.h"
+#include "log.h"
+#include <signal.h>
+
+struct stopping_child {
+    char* name;
+    GPid pid;
+    guint kill_id;
+    child_process_stopped_t stopped;
+    void* user_data;
+};
+
+static gboolean kill_after_timeout(gpointer child_void_ptr) {
+    struct stopping_child* child = child_void_ptr;
+    child->kill_id = 0;
+    log_warning("%s (%d) did not exit, killing it", child->name, child->pid);
+    kill(child->pid, SIGKILL);
+    return G_SOURCE_REMOVE;
+}
+
+static void child_exited(GPid pid, gint, gpointer child_void_ptr) {
+    struct stopping_child* child = child_void_ptr;
+    g_spawn_close_pid(pid);
+    if (child->kill_id)
+        g_source_remove(child->kill_id);
+    log_debug("%s (%d) has stopped", child->name, pid);
+    if (child->stopped)
+        child->stopped(child->user_data);
+    g_free(child->name);
+    g_free(child);
+}
+
+void child_process_stop(const char* name,
+                        GPid pid,
+                        guint watch_id,
+                        guint timeout_ms,
+                        child_process_stopped_t stopped,
+                        void* user_data) {
+    if (watch_id)
+        g_source_remove(watch_id);
+    struct stopping_child* child = g_new0(struct stopping_child, 1);
+    child->name = g_strdup(name);
+    child->pid = pid;
+    child->stopped = stopped;
+    child->user_data = user_data;
+    kill(pid, SIGTERM);
+    child->kill_id = g_timeout_add(timeout_ms, kill_after_timeout, child);
+    g_child_watch_add(pid, child_exited, child);
+}
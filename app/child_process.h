@@ -0,0 +1,16 @@
+#pragma once
+#include <glib.h>
+
+// Called from the main loop when a child process that has been asked to stop has exited.
+typedef void (*child_process_stopped_t)(void* user_data);
+
+// Stop a child process that was spawned with G_SPAWN_DO_NOT_REAP_CHILD, without blocking the main
+// loop. The child watch of the owner, watch_id, is removed, since the exit is expected. SIGTERM is
+// sent at once, and SIGKILL if the process is still running after timeout_ms. The process is then
+// reaped, and stopped is called unless it is NULL, so user_data must outlive the process.
+void child_process_stop(const char* name,
+                        GPid pid,
+                        guint watch_id,
+                        guint timeout_ms,
+                        child_process_stopped_t stopped,
+                        void* user_data);
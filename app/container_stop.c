@@ -0,0 +1,122 @@
+#include "container_stop.h"
+#include "docker_api.h"
+#include "log.h"
+#include <glib.h>
+#include <jansson.h>
+
+// Timeout for listing containers. Stop requests get the container's timeout added to this.
+#define REQUEST_TIMEOUT_MS 5000
+
+// Stopping a container mostly waits for the container, but every request holds a connection and a
+// thread, so a device with many containers should not get one of each per container.
+#define STOP_THREADS 8
+
+struct container_stop {
+    char* id;
+    int timeout_s;
+    bool skipped;
+    bool success;
+};
+
+// dockerd remembers that a container was stopped through the API, and then does not start it
+// again when dockerd starts if its restart policy is unless-stopped. Containers with a restart
+// policy that brings them back after dockerd restarts are therefore left for dockerd to stop on
+// SIGTERM.
+static bool restarted_with_dockerd(const char* id) {
+    g_autofree char* path = g_strdup_printf("/containers/%s/json", id);
+    int status_code = 0;
+    g_autofree char* body = docker_api_request("GET", path, REQUEST_TIMEOUT_MS, &status_code);
+    json_t* container = body && status_code == 200 ? json_loads(body, 0, NULL) : NULL;
+    if (!container)
+        return true;  // Leave it to dockerd when in doubt
+    const char* policy = json_string_value(
+        json_object_get(json_object_get(json_object_get(container, "HostConfig"), "RestartPolicy"),
+                        "Name"));
+    const bool restarted =
+        g_strcmp0(policy, "always") == 0 || g_strcmp0(policy, "unless-stopped") == 0;
+    json_decref(container);
+    return restarted;
+}
+
+// With live-restore, dockerd leaves containers running when it exits, so none should be stopped.
+static bool live_restore_enabled(void) {
+    int status_code = 0;
+    g_autofree char* body = docker_api_request("GET", "/info", REQUEST_TIMEOUT_MS, &status_code);
+    json_t* info = body && status_code == 200 ? json_loads(body, 0, NULL) : NULL;
+    const bool enabled = json_is_true(json_object_get(info, "LiveRestoreEnabled"));
+    json_decref(info);
+    return enabled;
+}
+
+static GPtrArray* list_running_containers(void) {
+    int status_code = 0;
+    g_autofree char* body =
+        docker_api_request("GET", "/containers/json", REQUEST_TIMEOUT_MS, &status_code);
+    if (!body || status_code != 200) {
+        log_debug("Could not list containers (status %d)", status_code);
+        return NULL;
+    }
+
+    json_t* containers = json_loads(body, 0, NULL);
+    GPtrArray* ids = g_ptr_array_new_with_free_func(g_free);
+    size_t i;
+    json_t* container;
+    json_array_foreach(containers, i, container) {
+        const char* id = json_string_value(json_object_get(container, "Id"));
+        if (id)
+            g_ptr_array_add(ids, g_strdup(id));
+    }
+    json_decref(containers);
+    return ids;
+}
+
+static void stop_container(gpointer stop_void_ptr, gpointer) {
+    struct container_stop* stop = stop_void_ptr;
+    if (restarted_with_dockerd(stop->id)) {
+        stop->skipped = true;
+        stop->success = true;
+        return;
+    }
+    g_autofree char* path = g_strdup_printf("/containers/%s/stop?t=%d", stop->id, stop->timeout_s);
+    const int timeout_ms = stop->timeout_s * 1000 + REQUEST_TIMEOUT_MS;
+    int status_code = 0;
+    g_autofree char* body = docker_api_request("POST", path, timeout_ms, &status_code);
+
+    // 304 means that the container had already stopped and 404 that it has been removed.
+    stop->success = body && (status_code == 204 || status_code == 304 || status_code == 404);
+    if (!stop->success)
+        log_warning("Failed to stop container %.12s (status %d)", stop->id, status_code);
+}
+
+bool container_stop_all(int timeout_s) {
+    g_autoptr(GPtrArray) ids = list_running_containers();
+    if (!ids)
+        return false;
+    if (ids->len == 0)
+        return true;
+    if (live_restore_enabled()) {
+        log_info("Leaving %u containers running, since live-restore is enabled", ids->len);
+        return true;
+    }
+
+    struct container_stop* stops = g_new0(struct container_stop, ids->len);
+    GThreadPool* pool = g_thread_pool_new(stop_container, NULL, STOP_THREADS, false, NULL);
+    for (guint i = 0; i < ids->len; ++i) {
+        stops[i] = (struct container_stop){.id = g_ptr_array_index(ids, i), .timeout_s = timeout_s};
+        g_thread_pool_push(pool, &stops[i], NULL);
+    }
+    g_thread_pool_free(pool, false, true);
+
+    bool success = true;
+    guint skipped = 0;
+    for (guint i = 0; i < ids->len; ++i) {
+        success = success && stops[i].success;
+        skipped += stops[i].skipped;
+    }
+    log_info("Stopped %u containers, and left %u with restart policy always or unless-stopped to "
+             "dockerd",
+             ids->len - skipped,
+             skipped);
+    g_free(stops);
+    return success;
+}
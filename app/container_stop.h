@@ -0,0 +1,10 @@
+#pragma once
+#include <stdbool.h>
+
+// Ask dockerd to stop the running containers in parallel, giving each container timeout_s seconds
+// to exit after SIGTERM before it is killed. Containers that dockerd starts again when it restarts,
+// those with restart policy always or unless-stopped, are left for dockerd to stop on SIGTERM, so
+// that stopping them through the API does not keep them stopped. No containers are stopped when
+// live-restore is enabled. Block until dockerd has answered every stop request. Return false if the
+// containers could not be listed or if any of them failed to stop.
+bool container_stop_all(int timeout_s);
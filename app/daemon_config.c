@@ -0,0 +1,209 @@
+#include "daemon_config.h"
+#include "app_paths.h"
+#include "log.h"
+#include "network_profile.h"
+#include <errno.h>
+#include <jansson.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define USER_DAEMON_JSON APP_LOCALDATA "/" DAEMON_JSON
+
+char* daemon_config_path(void) {
+    // The runtime directory is on tmpfs, so regenerating the file does not wear the flash.
+    return g_strdup_printf("/var/run/user/%d/%s", getuid(), DAEMON_JSON);
+}
+
+static json_t* read_user_config(void) {
+    if (access(USER_DAEMON_JSON, F_OK) != 0)
+        return json_object();
+
+    json_error_t error;
+    json_t* config = json_load_file(USER_DAEMON_JSON, 0, &error);
+    if (!config) {
+        log_error("Failed to parse %s at line %d: %s", USER_DAEMON_JSON, error.line, error.text);
+        return NULL;
+    }
+    if (!json_is_object(config)) {
+        log_error("%s does not contain a JSON object", USER_DAEMON_JSON);
+        json_decref(config);
+        return NULL;
+    }
+    return config;
+}
+
+bool daemon_config_user_sets(const char* key) {
+    json_t* config = read_user_config();
+    const bool found = json_object_get(config, key);
+    json_decref(config);
+    return found;
+}
+
+static void set_managed_key(json_t* config, const char* key, json_t* value) {
+    json_t* user_value = json_object_get(config, key);
+    if (user_value && !json_equal(user_value, value))
+        log_warning("Ignoring \"%s\" in %s, since it is managed by application parameters",
+                    key,
+                    USER_DAEMON_JSON);
+    json_object_set_new(config, key, value);
+}
+
+// Zero leaves the option to the user's daemon.json, or to the default of dockerd.
+static void set_tuning_option(json_t* config, const char* key, int value) {
+    if (value > 0)
+        set_managed_key(config, key, json_integer(value));
+}
+
+static void set_list_option(json_t* config, const char* key, json_t* value) {
+    if (json_is_array(value) ? json_array_size(value) : json_object_size(value))
+        set_managed_key(config, key, value);
+    else
+        json_decref(value);
+}
+
+static json_t* registry_mirrors(const char* list) {
+    json_t* mirrors = json_array();
+    char** items = g_strsplit(list, ",", -1);
+    for (char** item = items; *item; ++item)
+        if (*g_strstrip(*item))
+            json_array_append_new(mirrors, json_string(*item));
+    g_strfreev(items);
+    return mirrors;
+}
+
+// The mirror of the application goes first, ahead of the mirrors of the RegistryMirrors parameter,
+// or of the user's daemon.json if the parameter is empty. dockerd falls back to the next mirror,
+// and last to the registry itself, while the mirror does not answer.
+static void set_registry_mirrors(json_t* config, const char* list, const char* mirror) {
+    json_t* mirrors = registry_mirrors(list);
+    if (!mirror) {
+        set_list_option(config, "registry-mirrors", mirrors);
+        return;
+    }
+    if (!json_array_size(mirrors))
+        json_array_extend(mirrors, json_object_get(config, "registry-mirrors"));
+    json_array_insert_new(mirrors, 0, json_string(mirror));
+    json_object_set_new(config, "registry-mirrors", mirrors);
+}
+
+static bool parse_limit(const char* text, char** end, json_int_t* limit) {
+    errno = 0;
+    *limit = strtoll(text, end, 10);
+    return errno == 0 && *end != text;
+}
+
+// Parse <name>=<soft>[:<hard>] items, as in the --default-ulimit option of dockerd. Invalid items
+// are logged and left out.
+static json_t* default_ulimits(const char* list) {
+    json_t* ulimits = json_object();
+    char** items = g_strsplit(list, ",", -1);
+    for (char** item = items; *item; ++item) {
+        if (!*g_strstrip(*item))
+            continue;
+        char* equals = strchr(*item, '=');
+        char* end = NULL;
+        json_int_t soft;
+        json_int_t hard;
+        bool valid = equals && equals != *item && parse_limit(equals + 1, &end, &soft);
+        hard = valid ? soft : 0;
+        if (valid && *end == ':')
+            valid = parse_limit(end + 1, &end, &hard);
+        if (!valid || *end) {
+            log_warning("Ignoring \"%s\" in %s, expected <name>=<soft>[:<hard>]",
+                        *item,
+                        PARAM_DEFAULT_ULIMITS);
+            continue;
+        }
+        *equals = '\0';
+        json_object_set_new(ulimits,
+                            *item,
+                            json_pack("{s:s, s:I, s:I}", "Name", *item, "Soft", soft, "Hard", hard));
+    }
+    g_strfreev(items);
+    return ulimits;
+}
+
+// Size of the ring buffer in RAM that non-blocking logging keeps per container.
+#define LOG_BUFFER_SIZE "1m"
+
+// By default, dockerd writes container logs with the json-file driver, which appends every line
+// to an unbounded file on the data root. The policies cap the files with the local driver and
+// optionally decouple the containers from the writes with a ring buffer in RAM, or send the logs
+// to syslog so that nothing is written to the data root at all. The policy is the default for
+// new containers; containers can still choose their own log driver. A log driver in the user's
+// daemon.json is kept, as if the policy was unmanaged.
+static void set_log_policy(json_t* config, const struct parameter_values* values) {
+    const char* policy = values->container_log_policy;
+    if (strcmp(policy, "unmanaged") == 0)
+        return;
+    if (json_object_get(config, "log-driver")) {
+        log_info("Leaving the log configuration to %s, since it sets \"log-driver\"",
+                 USER_DAEMON_JSON);
+        return;
+    }
+
+    json_t* options = json_object();
+    if (strcmp(policy, "syslog") == 0) {
+        set_managed_key(config, "log-driver", json_string("syslog"));
+        json_object_set_new(options, "tag", json_string("{{.Name}}"));
+        json_object_set_new(options, "syslog-format", json_string("rfc5424micro"));
+    } else {
+        g_autofree char* max_size = g_strdup_printf("%dm", values->container_log_max_size);
+        g_autofree char* max_file = g_strdup_printf("%d", values->container_log_max_files);
+        set_managed_key(config, "log-driver", json_string("local"));
+        json_object_set_new(options, "max-size", json_string(max_size));
+        json_object_set_new(options, "max-file", json_string(max_file));
+        // Compressing a rotated file writes it once more.
+        json_object_set_new(options, "compress", json_string("false"));
+    }
+    // The ring buffer lets lines be written in bursts while a container keeps running, at the cost
+    // of dropping lines when it is full.
+    if (strcmp(policy, "local") != 0) {
+        json_object_set_new(options, "mode", json_string("non-blocking"));
+        json_object_set_new(options, "max-buffer-size", json_string(LOG_BUFFER_SIZE));
+    }
+    set_managed_key(config, "log-opts", options);
+}
+
+bool daemon_config_write(const struct parameter_values* values,
+                         const struct daemon_runtime_options* runtime) {
+    json_t* config = read_user_config();
+    if (!config)
+        return false;
+
+    // The log level itself is passed on the command line, but only the debug option can be
+    // changed by a reload.
+    set_managed_key(config, "debug", json_boolean(strcmp(values->dockerd_log_level, "debug") == 0));
+
+    // The bridge must carry the larger packets too, or containers gain nothing from the MTU of
+    // rootlesskit.
+    const struct network_profile* profile = network_profile_find(values->network_profile);
+    if (profile->bridge_mtu)
+        set_managed_key(config, "mtu", json_integer(profile->bridge_mtu));
+
+    if (runtime->seccomp_profile)
+        set_managed_key(config, "seccomp-profile", json_string(runtime->seccomp_profile));
+
+    if (runtime->storage_driver && !json_object_get(config, "storage-driver"))
+        json_object_set_new(config, "storage-driver", json_string(runtime->storage_driver));
+
+    set_tuning_option(config, "max-concurrent-downloads", values->max_concurrent_downloads);
+    set_tuning_option(config, "max-concurrent-uploads", values->max_concurrent_uploads);
+    set_tuning_option(config, "max-download-attempts", values->max_download_attempts);
+    set_registry_mirrors(config, values->registry_mirrors, runtime->registry_mirror);
+    set_list_option(config, "default-ulimits", default_ulimits(values->default_ulimits));
+    set_log_policy(config, values);
+
+    g_autofree char* path = daemon_config_path();
+    g_autofree char* contents = json_dumps(config, JSON_INDENT(4) | JSON_SORT_KEYS);
+    json_decref(config);
+
+    GError* error = NULL;
+    if (!contents || !g_file_set_contents(path, contents, -1, &error)) {
+        log_error("Failed to write %s: %s", path, error ? error->message : "out of memory");
+        g_clear_error(&error);
+        return false;
+    }
+    log_debug("Wrote %s", path);
+    return true;
+}
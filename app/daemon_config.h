@@ -0,0 +1,24 @@
+#pragma once
+#include "parameters.h"
+#include <stdbool.h>
+
+// Return the path of the configuration file that dockerd is started with. Free with g_free().
+char* daemon_config_path(void);
+
+// Settings that are decided when dockerd is started, rather than read from parameters.
+struct daemon_runtime_options {
+    const char* seccomp_profile;  // For containers, NULL for the default profile of dockerd
+    const char* storage_driver;   // NULL to let dockerd choose
+    const char* registry_mirror;  // Tried before the other mirrors, NULL for none
+};
+
+// Return whether the user's daemon.json in localdata sets key.
+bool daemon_config_user_sets(const char* key);
+
+// Generate the configuration file that dockerd is started with, by merging the user's
+// daemon.json in localdata with the keys managed by the application. Managed keys take
+// precedence, except that a storage driver chosen by the user is kept. Since dockerd rereads the
+// file on SIGHUP, this is also how reloadable settings are changed without a restart. Return false
+// on error.
+bool daemon_config_write(const struct parameter_values* values,
+                         const struct daemon_runtime_options* runtime);
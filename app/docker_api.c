@@ -0,0 +1,197 @@
+#include "docker_api.h"
+#include "log.h"
+#include <glib.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define API_SOCKET_NAME APP_NAME "-api.sock"
+
+char* docker_api_socket_path(void) {
+    return g_strdup_printf("/var/run/user/%d/%s", getuid(), API_SOCKET_NAME);
+}
+
+static bool set_timeout(int fd, int option, int timeout_ms) {
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    return setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv)) == 0;
+}
+
+static bool connect_to_socket(int fd, const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+    return connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+}
+
+bool docker_api_listening(void) {
+    g_autofree char* path = docker_api_socket_path();
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const bool listening = fd != -1 && connect_to_socket(fd, path);
+    if (fd != -1)
+        close(fd);
+    return listening;
+}
+
+int docker_api_connect(int timeout_ms) {
+    g_autofree char* path = docker_api_socket_path();
+    return docker_api_connect_to(path, timeout_ms);
+}
+
+static int new_socket(int domain, int timeout_ms) {
+    int fd = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_error("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    if (timeout_ms > 0 &&
+        (!set_timeout(fd, SO_RCVTIMEO, timeout_ms) || !set_timeout(fd, SO_SNDTIMEO, timeout_ms))) {
+        log_error("Failed to set socket timeout: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int docker_api_connect_to(const char* path, int timeout_ms) {
+    int fd = new_socket(AF_UNIX, timeout_ms);
+    if (fd == -1)
+        return -1;
+    if (!connect_to_socket(fd, path)) {
+        // Expected while dockerd is not running, so let the caller decide how to report it.
+        log_debug("Failed to connect to %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int docker_api_connect_loopback(int port, int timeout_ms) {
+    int fd = new_socket(AF_INET, timeout_ms);
+    if (fd == -1)
+        return -1;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        log_debug("Failed to connect to port %d: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const void* data, size_t len) {
+    const char* ptr = data;
+    while (len > 0) {
+        const ssize_t sent = send(fd, ptr, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            const int error = errno;  // Kept for the caller, e.g. to tell a timeout apart
+            log_error("Failed to send request: %s", strerror(error));
+            errno = error;
+            return false;
+        }
+        ptr += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+bool docker_api_send_request(int fd,
+                             const char* method,
+                             const char* path,
+                             const char* content_type,
+                             bool chunked) {
+    g_autofree char* header = g_strdup_printf(
+        "%s %s HTTP/1.1\r\n"
+        "Host: docker\r\n"
+        "Connection: close\r\n"
+        "%s%s%s"
+        "%s\r\n",
+        method,
+        path,
+        content_type ? "Content-Type: " : "",
+        content_type ? content_type : "",
+        content_type ? "\r\n" : "",
+        chunked ? "Transfer-Encoding: chunked\r\n" : "");
+    return send_all(fd, header, strlen(header));
+}
+
+bool docker_api_send_chunk(int fd, const void* data, size_t len) {
+    char size_line[32];
+    g_snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+    return send_all(fd, size_line, strlen(size_line)) && send_all(fd, data, len) &&
+           send_all(fd, "\r\n", 2);
+}
+
+// Decode a chunked body in place. Return false if it is malformed.
+static bool dechunk(GString* body) {
+    const char* src = body->str;
+    const char* end = body->str + body->len;
+    char* dst = body->str;
+    while (src < end) {
+        char* size_end = NULL;
+        const guint64 size = g_ascii_strtoull(src, &size_end, 16);
+        const char* data = strstr(size_end, "\r\n");
+        if (size_end == src || !data || (guint64)(end - data - 2) < size)
+            return false;
+        if (size == 0)
+            break;
+        data += 2;
+        memmove(dst, data, size);
+        dst += size;
+        src = data + size + 2;  // Skip CRLF after the chunk data
+    }
+    g_string_truncate(body, dst - body->str);
+    return true;
+}
+
+char* docker_api_read_response(int fd, int* status_code) {
+    GString* response = g_string_sized_new(4096);
+    char buffer[4096];
+    ssize_t received;
+    while ((received = recv(fd, buffer, sizeof(buffer), 0)) != 0) {
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            const int error = errno;  // Kept for the caller, e.g. to tell a timeout apart
+            log_error("Failed to receive response: %s", strerror(error));
+            g_string_free(response, true);
+            errno = error;
+            return NULL;
+        }
+        g_string_append_len(response, buffer, received);
+    }
+
+    const char* headers_end = strstr(response->str, "\r\n\r\n");
+    if (!headers_end || sscanf(response->str, "HTTP/1.%*d %d", status_code) != 1) {
+        log_error("Malformed HTTP response");
+        g_string_free(response, true);
+        return NULL;
+    }
+    g_autofree char* headers = g_ascii_strdown(response->str, headers_end - response->str);
+    const bool chunked = strstr(headers, "\r\ntransfer-encoding: chunked");
+    g_string_erase(response, 0, headers_end + 4 - response->str);
+
+    if (chunked && !dechunk(response)) {
+        log_error("Malformed chunked HTTP response");
+        g_string_free(response, true);
+        return NULL;
+    }
+    return g_string_free(response, false);
+}
+
+char* docker_api_request(const char* method, const char* path, int timeout_ms, int* status_code) {
+    int fd = docker_api_connect(timeout_ms);
+    if (fd == -1)
+        return NULL;
+    char* body = NULL;
+    if (docker_api_send_request(fd, method, path, NULL, false))
+        body = docker_api_read_response(fd, status_code);
+    close(fd);
+    return body;
+}
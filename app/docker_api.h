@@ -0,0 +1,42 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// Minimal HTTP/1.1 client for the Docker Engine API on the unix socket that dockerd always
+// listens on for the application's own use, regardless of the IPCSocket setting.
+
+// Return the path of that socket. Free the result with g_free().
+char* docker_api_socket_path(void);
+
+// Return true if dockerd accepts connections on the socket, without logging anything. This does not
+// mean that dockerd is ready to answer requests.
+bool docker_api_listening(void);
+
+// Connect to dockerd. A timeout_ms of zero means that reads and writes never time out. Return a
+// socket file descriptor, or -1 after having logged the error.
+int docker_api_connect(int timeout_ms);
+
+// Connect to another HTTP API on a unix socket, such as the port API of rootlesskit, which the
+// functions below can then be used with as well.
+int docker_api_connect_to(const char* path, int timeout_ms);
+
+// Connect to an HTTP API on port of the loopback address.
+int docker_api_connect_loopback(int port, int timeout_ms);
+
+// Send the request line and headers. If chunked is true, the body is then sent with
+// docker_api_send_chunk(), and finished by sending an empty chunk.
+bool docker_api_send_request(int fd,
+                             const char* method,
+                             const char* path,
+                             const char* content_type,
+                             bool chunked);
+
+bool docker_api_send_chunk(int fd, const void* data, size_t len);
+
+// Read the response until dockerd closes the connection. Return the body, with any chunked
+// transfer encoding removed, and set *status_code. Return NULL on error.
+char* docker_api_read_response(int fd, int* status_code);
+
+// Convenience function for requests without a body. Return the response body and set
+// *status_code, or return NULL on error.
+char* docker_api_request(const char* method, const char* path, int timeout_ms, int* status_code);
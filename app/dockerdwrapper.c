@@ -16,32 +16,115 @@
 
 #define _GNU_SOURCE  // For sigabbrev_np()
 #include "app_paths.h"
+#include "container_stop.h"
+#include "daemon_config.h"
+#include "docker_api.h"
 #include "fcgi_server.h"
+#include "fcgi_write_file_from_stream.h"
+#include "filesystem_info.h"
+#include "health_monitor.h"
 #include "http_request.h"
+#include "image_preload.h"
 #include "log.h"
+#include "metrics.h"
+#include "network_acceleration.h"
+#include "network_profile.h"
+#include "ownership_repair.h"
+#include "parameters.h"
+#include "port_forwarder.h"
+#include "readiness_probe.h"
+#include "reconfigure.h"
+#include "registry_cache.h"
+#include "resource_sampler.h"
+#include "restart_scheduler.h"
 #include "sd_disk_storage.h"
+#include "startup_timing.h"
+#include "storage_probe.h"
+#include "supervisor.h"
 #include "tls.h"
-#include <arpa/inet.h>
-#include <axsdk/axparameter.h>
 #include <errno.h>
 #include <glib-unix.h>
 #include <glib.h>
-#include <mntent.h>
-#include <netdb.h>
+#include <jansson.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <sysexits.h>
 #include <unistd.h>
 
-#define PARAM_APPLICATION_LOG_LEVEL "ApplicationLogLevel"
-#define PARAM_DOCKERD_LOG_LEVEL     "DockerdLogLevel"
-#define PARAM_IPC_SOCKET            "IPCSocket"
-#define PARAM_SD_CARD_SUPPORT       "SDCardSupport"
-#define PARAM_TCP_SOCKET            "TCPSocket"
-#define PARAM_USE_TLS               "UseTLS"
-#define PARAM_STATUS                "Status"
+// Number of FCGI worker threads and length of the FCGI socket's listen queue. Several workers
+// allow a slow upload to proceed without blocking other requests.
+#define FCGI_NUM_WORKERS 4
+#define FCGI_BACKLOG     16
+
+// Restart requests are merged until no new request has arrived for RESTART_DEBOUNCE_MS, but the
+// restart is never delayed more than RESTART_MAX_LATENCY_MS after the first request. The debounce
+// time must be at least one second, see restart_dockerd_when_parameter_changed().
+#define RESTART_DEBOUNCE_MS    1000
+#define RESTART_MAX_LATENCY_MS 5000
+
+// Part of the DockerdStopTimeout grace period that is left for dockerd to exit after SIGTERM, and
+// the time that dockerd is given to kill a container that has not stopped within its timeout. The
+// containers are given the rest of the grace period.
+#define DOCKERD_EXIT_RESERVE_S 2
+#define CONTAINER_KILL_S       1
+
+// When dockerd exits without being asked to, it is restarted after a delay that starts at
+// SUPERVISOR_INITIAL_BACKOFF_MS and is doubled per restart, up to SUPERVISOR_MAX_BACKOFF_MS. At
+// most SUPERVISOR_RESTART_BUDGET restarts are made within SUPERVISOR_BUDGET_WINDOW_S, after which
+// the status is set to DOCKERD RUNTIME ERROR. A run longer than SUPERVISOR_STABLE_AFTER_S restarts
+// the backoff.
+#define SUPERVISOR_INITIAL_BACKOFF_MS 1000
+#define SUPERVISOR_MAX_BACKOFF_MS     60000
+#define SUPERVISOR_RESTART_BUDGET     5
+#define SUPERVISOR_BUDGET_WINDOW_S    600
+#define SUPERVISOR_STABLE_AFTER_S     300
+
+// Read-only routes that report the supervisor and restart counters, the time spent in each phase
+// of the last STARTUP_HISTORY_LENGTH starts of dockerd, and the health monitor latencies.
+#define SUPERVISOR_ROUTE       "supervisor"
+#define STARTUP_ROUTE          "startup"
+#define HEALTH_ROUTE           "health"
+#define STARTUP_HISTORY_LENGTH 16
+
+// After dockerd has been spawned, it is pinged until it answers, with a delay between failed pings
+// that starts at READINESS_INITIAL_INTERVAL_MS and is doubled up to READINESS_MAX_INTERVAL_MS.
+#define READINESS_INITIAL_INTERVAL_MS 50
+#define READINESS_MAX_INTERVAL_MS     1000
+
+// A dockerd that has not answered READINESS_DEADLINE_MS after it was spawned is considered hung in
+// its initialization. Restoring many containers from an SD card can take minutes.
+#define READINESS_DEADLINE_MS (5 * 60 * 1000)
+
+// While dockerd is running, it is pinged every HEALTH_INTERVAL_MS, and every HEALTH_INFO_INTERVAL
+// probe also requests /info. If HEALTH_HANG_THRESHOLD probes in a row fail or take longer than
+// HEALTH_TIMEOUT_MS, dockerd is restarted. On an idle device a ping takes a few milliseconds of CPU
+// time, so this costs next to nothing.
+#define HEALTH_INTERVAL_MS    30000
+#define HEALTH_TIMEOUT_MS     10000
+#define HEALTH_INFO_INTERVAL  10
+#define HEALTH_HANG_THRESHOLD 3
+
+// Read-only route that reports the resource usage of the processes below rootlesskit.
+#define RESOURCES_ROUTE "resources"
+#define NETWORK_ROUTE   "network"
+#define PORTS_ROUTE     "ports"
+#define PRELOAD_ROUTE   "preload"
+#define CACHE_ROUTE     "cache"
+#define STORAGE_ROUTE   "storage"
+
+// Directory below localdata or the SD card area that image archives are preloaded from.
+#define IMAGE_PRELOAD_DIRECTORY "images"
+
+// Directory below the SD card area that the registry cache is stored in.
+#define REGISTRY_CACHE_DIRECTORY "registry-cache"
+
+// Records the progress of the SD card ownership repair in the SD card area, so that an
+// interrupted repair resumes where it stopped, and a completed one is only verified on later
+// installs.
+#define OWNERSHIP_REPAIR_CHECKPOINT ".ownership_repair"
 
 typedef enum {
     STATUS_NOT_STARTED = 0,  // Index in the array, not the actual status code
@@ -53,6 +136,7 @@ typedef enum {
     STATUS_NO_SD_CARD,
     STATUS_SD_CARD_WRONG_FS,
     STATUS_SD_CARD_WRONG_PERMISSION,
+    STATUS_STARTING,
     STATUS_CODE_COUNT,
 } status_code_t;
 
@@ -64,7 +148,8 @@ static const char* const status_code_strs[STATUS_CODE_COUNT] = {"-1 NOT STARTED"
                                                                 "4 NO SOCKET",
                                                                 "5 NO SD CARD",
                                                                 "6 SD CARD WRONG FS",
-                                                                "7 SD CARD WRONG PERMISSION"};
+                                                                "7 SD CARD WRONG PERMISSION",
+                                                                "8 STARTING"};
 
 struct settings {
     char* data_root;
@@ -75,8 +160,32 @@ struct settings {
 
 struct app_state {
     volatile int allow_dockerd_to_start_atomic;
+    volatile int restart_required_atomic;  // Set by triggers that are not parameter changes
     char* sd_card_area;
-    AXParameter* param_handle;
+    guint sd_card_wait_id;      // Deadline timer while waiting for the SD card, otherwise 0
+    gint64 sd_card_wait_start;  // Monotonic time
+    bool sd_card_wait_expired;  // Until the next SD card event
+    struct parameters* parameters;
+    struct parameter_values running_values;  // The values that dockerd is currently running with
+    struct restart_scheduler* restart_scheduler;
+    struct supervisor* supervisor;
+    bool dockerd_stop_requested;  // Tells the child watch that rootlesskit is exiting on request
+    struct startup_timing* startup_timing;
+    gint64 dockerd_spawned_at;  // Monotonic time
+    struct readiness_probe* readiness_probe;    // Until dockerd has answered its first request
+    struct health_monitor* health_monitor;      // Runs from then until dockerd is stopped
+    struct resource_sampler* resource_sampler;  // Runs while rootlesskit is running
+    struct network_acceleration* network_acceleration;
+    struct port_forwarder* port_forwarder;  // Runs while rootlesskit is running with a TCP socket
+    struct storage_probe* storage_probe;
+    gint64 storage_probe_start;  // Monotonic time while dockerd waits for the probe, otherwise 0
+    struct image_preload* image_preload;  // Runs in the background once dockerd is ready
+    char* data_root;                      // Of the last start of dockerd
+    struct registry_cache* registry_cache;            // Runs once dockerd is ready, if enabled
+    struct port_forwarder* registry_cache_forwarder;  // Shares the cache with other devices
+    char* registry_cache_mirror;                      // Referred to by daemon_runtime
+    struct daemon_runtime_options daemon_runtime;     // Decided when dockerd is started
+    volatile int reconfigurations_atomic[RECONFIGURE_STRATEGY_COUNT];  // Read by /supervisor
 };
 
 static bool dockerd_allowed_to_start(const struct app_state* app_state) {
@@ -103,14 +212,6 @@ static int application_exit_code = EX_KEEP_RUNNING;
 
 static pid_t rootlesskit_pid = 0;
 
-static const char* params_that_restart_dockerd[] = {PARAM_APPLICATION_LOG_LEVEL,
-                                                    PARAM_DOCKERD_LOG_LEVEL,
-                                                    PARAM_IPC_SOCKET,
-                                                    PARAM_SD_CARD_SUPPORT,
-                                                    PARAM_TCP_SOCKET,
-                                                    PARAM_USE_TLS,
-                                                    NULL};
-
 #define main_loop_run()                                        \
     do {                                                       \
         log_debug("g_main_loop_run called by %s", __func__);   \
@@ -194,137 +295,55 @@ static void init_signals(void) {
     g_unix_signal_add(SIGTERM, handle_signals, GINT_TO_POINTER(SIGTERM));
 }
 
-/**
- * @brief Checks if the given process is alive.
- *
- * @return True if alive. False if dead or exited.
- */
-static bool is_process_alive(int pid) {
-    int status;
-    pid_t return_pid = waitpid(pid, &status, WNOHANG);
-    if (return_pid == -1) {
-        // Report errors as dead.
-        return false;
-    } else if (return_pid == rootlesskit_pid) {
-        // Child is already exited, so not alive.
-        return false;
-    }
-    return true;
-}
-
-static bool
-set_parameter_value(AXParameter* param_handle, const char* parameter_name, const char* value) {
-    log_debug("About to set %s to %s", parameter_name, value);
-    GError* error = NULL;
-    bool res = ax_parameter_set(param_handle, parameter_name, value, true, &error);
-    if (!res) {
-        log_error("Failed to write parameter value of %s to %s. Error: %s",
-                  parameter_name,
-                  value,
-                  error->message);
-    }
-    g_clear_error(&error);
-    return res;
-}
-
-static void set_status_parameter(AXParameter* param_handle, status_code_t status) {
-    set_parameter_value(param_handle, PARAM_STATUS, status_code_strs[status]);
-}
-
-/**
- * @brief Fetch the value of the parameter as a string
- *
- * @return The value of the parameter as string if successful, NULL otherwise
- */
-static char* get_parameter_value(AXParameter* param_handle, const char* parameter_name) {
-    GError* error = NULL;
-    char* parameter_value = NULL;
-
-    if (!ax_parameter_get(param_handle, parameter_name, &parameter_value, &error)) {
-        log_error("Failed to fetch parameter value of %s. Error: %s",
-                  parameter_name,
-                  error->message);
-
-        free(parameter_value);
-        parameter_value = NULL;
-    }
-
-    g_clear_error(&error);
-    return parameter_value;
-}
-
-/**
- * @brief Retrieve the file system type of the device containing this path.
- *
- * @return The file system type as a string (ext4/ext3/vfat etc...) if
- * successful, NULL otherwise.
- */
-static char* get_filesystem_of_path(const char* path) {
-    char buf[PATH_MAX];
-    struct stat sd_card_stat;
-    int stat_result = stat(path, &sd_card_stat);
-    if (stat_result != 0) {
-        log_error("Cannot store data on the SD card, no storage exists at %s", path);
-        return NULL;
-    }
-
-    FILE* fp;
-    dev_t dev;
-
-    dev = sd_card_stat.st_dev;
-
-    if ((fp = setmntent("/proc/mounts", "r")) == NULL) {
-        return NULL;
-    }
-
-    struct mntent mnt;
-    while (getmntent_r(fp, &mnt, buf, PATH_MAX)) {
-        if (stat(mnt.mnt_dir, &sd_card_stat) != 0) {
-            continue;
-        }
-
-        if (sd_card_stat.st_dev == dev) {
-            endmntent(fp);
-            char* return_value = strdup(mnt.mnt_type);
-            return return_value;
-        }
-    }
-
-    endmntent(fp);
-
-    // Should never reach here.
-    errno = EINVAL;
-    return NULL;
+static void set_status_parameter(struct parameters* parameters, status_code_t status) {
+    parameters_set_status(parameters, status_code_strs[status]);
 }
 
 // Set up the SD card. Call set_status_parameter() and return false on error.
-static bool setup_sdcard(AXParameter* param_handle, const char* data_root) {
-    g_autofree char* sd_file_system = NULL;
-    g_autofree char* create_droot_command = g_strdup_printf("mkdir -p %s", data_root);
-
-    int res = system(create_droot_command);
+static bool setup_sdcard(struct parameters* parameters,
+                         const char* data_root,
+                         struct startup_timing* timing) {
+    struct filesystem_info sd_file_system;
+
+    gint64 phase_start = g_get_monotonic_time();
+    const int res = g_mkdir_with_parents(data_root, 0755);
+    startup_timing_record(timing, STARTUP_PHASE_DATA_ROOT, phase_start);
     if (res != 0) {
-        log_error("Failed to create data_root folder at: %s. Error code: %d", data_root, res);
-        set_status_parameter(param_handle, STATUS_SD_CARD_WRONG_PERMISSION);
+        log_error("Failed to create data_root folder at: %s: %s", data_root, strerror(errno));
+        set_status_parameter(parameters, STATUS_SD_CARD_WRONG_PERMISSION);
         return false;
     }
 
     // Confirm that the SD card is usable
-    sd_file_system = get_filesystem_of_path(data_root);
-    if (sd_file_system == NULL) {
+    phase_start = g_get_monotonic_time();
+    const bool identified = filesystem_info_of_path(data_root, &sd_file_system);
+    startup_timing_record(timing, STARTUP_PHASE_FILESYSTEM_CHECK, phase_start);
+    if (!identified) {
         log_error("Couldn't identify the file system of the SD card at %s", data_root);
-        set_status_parameter(param_handle, STATUS_NO_SD_CARD);
+        set_status_parameter(parameters, STATUS_NO_SD_CARD);
         return false;
     }
 
-    if (strcmp(sd_file_system, "vfat") == 0 || strcmp(sd_file_system, "exfat") == 0) {
+    g_autofree char* mount_options = filesystem_info_options(&sd_file_system);
+    log_info("The SD card at %s uses file system %s (%s)",
+             data_root,
+             sd_file_system.type,
+             mount_options);
+    if (sd_file_system.sync)
+        log_warning("The SD card is mounted with sync, which makes image pulls and container "
+                    "writes much slower");
+    else if (!sd_file_system.noatime && !sd_file_system.relatime)
+        log_warning("The SD card is mounted without noatime or relatime, so every read of an "
+                    "image layer also writes to the card");
+
+    if (strcmp(sd_file_system.type, "vfat") == 0 || strcmp(sd_file_system.type, "exfat") == 0) {
         log_error(
             "The SD card at %s uses file system %s which does not support "
             "Unix file permissions. Please reformat to a file system that "
             "support Unix file permissions, such as ext4 or xfs.",
             data_root,
-            sd_file_system);
-        set_status_parameter(param_handle, STATUS_SD_CARD_WRONG_FS);
+            sd_file_system.type);
+        set_status_parameter(parameters, STATUS_SD_CARD_WRONG_FS);
         return false;
     }
 
@@ -334,27 +353,32 @@ static bool setup_sdcard(AXParameter* param_handle, const char* data_root) {
             "card directory at %s. Please change the directory permissions or "
             "remove the directory.",
             data_root);
-        set_status_parameter(param_handle, STATUS_SD_CARD_WRONG_PERMISSION);
+        set_status_parameter(parameters, STATUS_SD_CARD_WRONG_PERMISSION);
         return false;
     }
 
     return true;
 }
 
-static bool
-is_parameter_equal_to(AXParameter* param_handle, const char* name, const char* value_to_equal) {
-    g_autofree char* value = get_parameter_value(param_handle, name);
-    return value && strcmp(value, value_to_equal) == 0;
-}
-
-// A parameter of type "bool:no,yes" is guaranteed to contain one of those
-// strings, but user code is still needed to interpret it as a Boolean type.
-static bool is_parameter_yes(AXParameter* param_handle, const char* name) {
-    return is_parameter_equal_to(param_handle, name, "yes");
+// The ACAP framework does not handle ownership on the SD card, which causes problems when the user
+// ID of the application changes. Give the SD card area the owner of localdata. This is run by
+// postinstallscript.sh, since only root may change the owner of files.
+static bool repair_sd_card_ownership(const char* sd_card_area) {
+    struct stat localdata_stat;
+    if (stat(APP_LOCALDATA, &localdata_stat) != 0) {
+        log_error("Failed to stat %s: %s", APP_LOCALDATA, strerror(errno));
+        return false;
+    }
+    g_autofree char* checkpoint_path =
+        g_strdup_printf("%s/%s", sd_card_area, OWNERSHIP_REPAIR_CHECKPOINT);
+    return ownership_repair(sd_card_area,
+                            localdata_stat.st_uid,
+                            localdata_stat.st_gid,
+                            checkpoint_path);
 }
 
-static bool is_app_log_level_debug(AXParameter* param_handle) {
-    return is_parameter_equal_to(param_handle, PARAM_APPLICATION_LOG_LEVEL, "debug");
+static bool is_app_log_level_debug(const struct parameters* parameters) {
+    return strcmp(parameters->values.application_log_level, "debug") == 0;
 }
 
 // Return data root matching the current SDCardSupport selection.
@@ -362,15 +386,17 @@ static bool is_app_log_level_debug(AXParameter* param_handle) {
 //
 // If SDCardSupport is "yes", data root will be located on the proved SD card
 // area. Passing NULL as SD card area signals that the SD card is not available.
-static char* prepare_data_root(AXParameter* param_handle, const char* sd_card_area) {
-    if (is_parameter_yes(param_handle, PARAM_SD_CARD_SUPPORT)) {
+static char* prepare_data_root(struct parameters* parameters,
+                               const char* sd_card_area,
+                               struct startup_timing* timing) {
+    if (parameters->values.sd_card_support) {
         if (!sd_card_area) {
             log_warning("SD card was requested, but no SD card is available at the moment.");
-            set_status_parameter(param_handle, STATUS_NO_SD_CARD);
+            set_status_parameter(parameters, STATUS_NO_SD_CARD);
             return NULL;
         }
         char* data_root = g_strdup_printf("%s/data", sd_card_area);
-        if (!setup_sdcard(param_handle, data_root)) {
+        if (!setup_sdcard(parameters, data_root, timing)) {
             free(data_root);
             return NULL;
         }
@@ -382,12 +408,12 @@ static char* prepare_data_root(AXParameter* param_handle, const char* sd_card_ar
 
 // Read UseTLS parameter and verify that TLS files are present. Call set_status_parameter() and
 // return false on error.
-static gboolean get_and_verify_tls_selection(AXParameter* param_handle, bool* use_tls_ret) {
-    const bool use_tls = is_parameter_yes(param_handle, PARAM_USE_TLS);
+static gboolean get_and_verify_tls_selection(struct parameters* parameters, bool* use_tls_ret) {
+    const bool use_tls = parameters->values.use_tls;
 
     if (use_tls && tls_missing_certs()) {
         tls_log_missing_cert_warnings();
-        set_status_parameter(param_handle, STATUS_TLS_CERT_MISSING);
+        set_status_parameter(parameters, STATUS_TLS_CERT_MISSING);
         return false;
     }
 
@@ -395,33 +421,66 @@ static gboolean get_and_verify_tls_selection(AXParameter* param_handle, bool* us
     return true;
 }
 
-// Meant to be used as a one-shot call from g_timeout_add_seconds()
-static gboolean quit_main_loop(void*) {
-    main_loop_quit();
-    return FALSE;
+// Meant to be used as a one-shot call from g_timeout_add_seconds(). Give up waiting for the SD card
+// and let main() try to start dockerd again, which sets the status to NO SD CARD.
+static gboolean sd_card_wait_expired(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    log_warning("No SD card became available within %d s",
+                app_state->parameters->values.sd_card_wait_timeout);
+    startup_timing_record(app_state->startup_timing,
+                          STARTUP_PHASE_SD_CARD_WAIT,
+                          app_state->sd_card_wait_start);
+    app_state->sd_card_wait_id = 0;
+    app_state->sd_card_wait_expired = true;
+    main_loop_quit();  // Trigger a start of dockerd from main()
+    return G_SOURCE_REMOVE;
+}
+
+// It takes a few seconds from sd_disk_storage_init() until sd_card_callback(), which is when
+// app_state->sd_card_area is set. Return true if dockerd should wait for that, rather than fail
+// in prepare_data_root(). sd_card_callback() or the deadline ends the wait.
+static bool wait_for_sd_card(struct app_state* app_state) {
+    if (!app_state->parameters->values.sd_card_support || app_state->sd_card_area ||
+        app_state->sd_card_wait_expired) {
+        // SDCardSupport may have been deselected during the wait.
+        if (app_state->sd_card_wait_id) {
+            g_source_remove(app_state->sd_card_wait_id);
+            app_state->sd_card_wait_id = 0;
+        }
+        return false;
+    }
+
+    if (!app_state->sd_card_wait_id) {
+        const int timeout_s = app_state->parameters->values.sd_card_wait_timeout;
+        log_info("Waiting up to %d s for the SD card to become available", timeout_s);
+        app_state->sd_card_wait_start = g_get_monotonic_time();
+        app_state->sd_card_wait_id =
+            g_timeout_add_seconds(timeout_s, sd_card_wait_expired, app_state);
+    }
+    return true;
 }
 
 // Read and verify consistency of settings. Call set_status_parameter() or quit_program() and return
 // false on error.
-static bool read_settings(struct settings* settings, const struct app_state* app_state) {
-    AXParameter* param_handle = app_state->param_handle;
-    settings->use_tcp_socket = is_parameter_yes(param_handle, PARAM_TCP_SOCKET);
+static bool read_settings(struct settings* settings, struct app_state* app_state) {
+    struct parameters* parameters = app_state->parameters;
+    settings->use_tcp_socket = parameters->values.tcp_socket;
 
     if (!settings->use_tcp_socket)
         // Even if the user has selected UseTLS we do not need to check the certs
         // when TCP won't be used. If the setting is changed we will loop through
         // this function again.
         settings->use_tls = false;
-    else if (!get_and_verify_tls_selection(param_handle, &settings->use_tls))
+    else if (!get_and_verify_tls_selection(parameters, &settings->use_tls))
         return false;
 
-    settings->use_ipc_socket = is_parameter_yes(param_handle, PARAM_IPC_SOCKET);
+    settings->use_ipc_socket = parameters->values.ipc_socket;
 
     if (!settings->use_ipc_socket && !settings->use_tcp_socket) {
         log_error(
             "At least one of IPC socket or TCP socket must be set to \"yes\". "
             "dockerd will not be started.");
-        set_status_parameter(param_handle, STATUS_NO_SOCKET);
+        set_status_parameter(parameters, STATUS_NO_SOCKET);
         return false;
     }
 
@@ -430,16 +489,12 @@ static bool read_settings(struct settings* settings, const struct app_state* app
         return false;
     }
 
-    // It takes a few seconds from sd_disk_storage_init() until sd_card_callback(), which is when
-    // app_state->sd_card_area is set. Waiting here means we may avoid failure in the call to
-    // prepare_data_root() below.
-    if (is_parameter_yes(param_handle, PARAM_SD_CARD_SUPPORT) && !app_state->sd_card_area) {
-        int id = g_timeout_add_seconds(5, quit_main_loop, NULL);
-        g_main_loop_run(loop);  // Wait until the timer or sd_card_callback() calls main_loop_quit()
-        g_source_remove(id);    // If it was sd_card_callback(), the timer must not restart dockerd.
-    }
+    if (wait_for_sd_card(app_state))
+        return false;
 
-    if (!(settings->data_root = prepare_data_root(param_handle, app_state->sd_card_area)))
+    settings->data_root =
+        prepare_data_root(parameters, app_state->sd_card_area, app_state->startup_timing);
+    if (!settings->data_root)
         return false;
 
     return true;
@@ -475,11 +530,13 @@ static void log_child_process_exit_cause(const char* name, GPid pid, int status)
     log_debug("%s", msg);
 }
 
-static bool child_process_exited_with_error(int status) {
-    GError* error = NULL;
-    struct exit_cause exit_cause = child_process_exit_cause(status, &error);
-    g_clear_error(&error);
-    return exit_cause.code > 0;
+// dockerd has failed, and is no longer running. Let the supervisor start it again after a delay,
+// unless it has already been restarted too many times.
+static void restart_dockerd_after_failure(struct app_state* app_state) {
+    allow_dockerd_to_start(app_state, false);
+    const bool restart_scheduled = supervisor_exited(app_state->supervisor);
+    set_status_parameter(app_state->parameters,
+                         restart_scheduled ? STATUS_DOCKERD_STOPPED : STATUS_DOCKERD_RUNTIME_ERROR);
 }
 
 static void
@@ -488,11 +545,6 @@ check_child_process_exit_code_and_clean_up(GPid pid, gint status, gpointer app_s
 
     struct app_state* app_state = app_state_void_ptr;
 
-    bool runtime_error = child_process_exited_with_error(status);
-    allow_dockerd_to_start(app_state, !runtime_error);
-    status_code_t s = runtime_error ? STATUS_DOCKERD_RUNTIME_ERROR : STATUS_DOCKERD_STOPPED;
-    set_status_parameter(app_state->param_handle, s);
-
     rootlesskit_pid = 0;
     g_spawn_close_pid(pid);
 
@@ -500,14 +552,59 @@ check_child_process_exit_code_and_clean_up(GPid pid, gint status, gpointer app_s
 
     prevent_others_from_using_our_ipc_socket();
 
-    main_loop_quit();  // Trigger a restart of dockerd from main()
+    health_monitor_stop(app_state->health_monitor);
+    resource_sampler_stop(app_state->resource_sampler);
+    port_forwarder_stop(app_state->port_forwarder);
+    image_preload_stop(app_state->image_preload);  // Quick, since dockerd is gone
+    registry_cache_stop(app_state->registry_cache);
+    port_forwarder_stop(app_state->registry_cache_forwarder);
+    network_acceleration_stop(app_state->network_acceleration);
+    app_state->daemon_runtime.seccomp_profile = NULL;
+    metrics_dockerd_exited();
+    if (app_state->readiness_probe) {
+        g_clear_pointer(&app_state->readiness_probe, readiness_probe_cancel);
+        startup_timing_end(app_state->startup_timing, "exited");
+    }
+
+    if (app_state->dockerd_stop_requested) {
+        app_state->dockerd_stop_requested = false;
+        metrics_count(METRICS_DOCKERD_STOPS);
+        set_status_parameter(app_state->parameters, STATUS_DOCKERD_STOPPED);
+        main_loop_quit();  // Release stop_dockerd() from its main loop
+        return;
+    }
+
+    // dockerd exited on its own, whether it crashed or not.
+    metrics_count(METRICS_DOCKERD_CRASHES);
+    restart_dockerd_after_failure(app_state);
+}
+
+// Meant to be used as a storage_probe_new() callback
+static void start_dockerd_after_storage_probe(void*) {
+    main_loop_quit();  // Trigger a start of dockerd from main()
+}
+
+// Meant to be used as a supervisor_new() callback
+static void start_dockerd_after_backoff(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    allow_dockerd_to_start(app_state, true);
+    main_loop_quit();  // Trigger a start of dockerd from main()
+}
+
+// Append a formatted argument to args.
+static void add_arg(GPtrArray* args, const char* format, ...) G_GNUC_PRINTF(2, 3);
+static void add_arg(GPtrArray* args, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    g_ptr_array_add(args, g_strdup_vprintf(format, ap));
+    va_end(ap);
 }
 
-// Return a command line with space-delimited argument based on the current settings.
-static const char* build_daemon_args(const struct settings* settings, AXParameter* param_handle) {
-    static gchar args[1024];  // Pointer to args returned to caller on success.
-    const char* args_end = args + sizeof(args);
-    char* args_wr = args;  // Points to location of next write
+// Return the argument vector of rootlesskit and dockerd based on the current settings, NULL
+// terminated. Free with g_ptr_array_unref().
+static GPtrArray* build_daemon_args(const struct settings* settings,
+                                    const struct parameters* parameters) {
+    GPtrArray* args = g_ptr_array_new_with_free_func(g_free);
 
     const char* data_root = settings->data_root;
     const bool use_tls = settings->use_tls;
@@ -517,56 +614,53 @@ static const char* build_daemon_args(const struct settings* settings, AXParamete
     gsize msg_len = 256;
     gchar msg[msg_len];
 
-    g_autofree char* log_level = get_parameter_value(param_handle, PARAM_DOCKERD_LOG_LEVEL);
-
-    // get host ip
-    char host_buffer[256];
-    char* IPbuffer;
-    struct hostent* host_entry;
-    gethostname(host_buffer, sizeof(host_buffer));
-    host_entry = gethostbyname(host_buffer);
-    IPbuffer = inet_ntoa(*((struct in_addr*)host_entry->h_addr_list[0]));
+    const char* log_level = parameters->values.dockerd_log_level;
 
     // construct the rootlesskit command
-    args_wr += g_snprintf(args_wr,
-                          args_end - args_wr,
-                          "%s %s %s %s %s %s %s %s %s",
-                          "rootlesskit",
-                          "--subid-source=static",
-                          "--net=slirp4netns",
-                          "--disable-host-loopback",
-                          "--copy-up=/etc",
-                          "--copy-up=/run",
-                          "--propagation=rslave",
-                          "--port-driver slirp4netns",
-                          /* don't use same range as company proxy */
-                          "--cidr=10.0.3.0/24");
+    const struct network_profile* network_profile =
+        network_profile_find(parameters->values.network_profile);
+    add_arg(args, "rootlesskit");
+    add_arg(args, "--subid-source=static");
+    char** network_args = g_strsplit(network_profile->rootlesskit_args, " ", -1);
+    for (char** network_arg = network_args; *network_arg; ++network_arg)
+        add_arg(args, "%s", *network_arg);
+    g_strfreev(network_args);
+    add_arg(args, "--copy-up=/etc");
+    add_arg(args, "--copy-up=/run");
+    add_arg(args, "--propagation=rslave");
+    // The TCP socket is forwarded through the API of rootlesskit, which is in the state directory.
+    add_arg(args, "--state-dir");
+    g_ptr_array_add(args, port_forwarder_state_directory());
 
     if (strcmp(log_level, "debug") == 0) {
-        args_wr += g_snprintf(args_wr, args_end - args_wr, " %s", "--debug");
+        add_arg(args, "--debug");
     }
 
-    const uint port = use_tls ? 2376 : 2375;
-    args_wr += g_snprintf(args_wr, args_end - args_wr, " -p %s:%d:%d/tcp", IPbuffer, port, port);
-
     // add dockerd command
-    args_wr += g_snprintf(args_wr,
-                          args_end - args_wr,
-                          " dockerd %s",
-                          "--config-file " APP_LOCALDATA "/" DAEMON_JSON);
+    add_arg(args, "dockerd");
+    add_arg(args, "--config-file");
+    g_ptr_array_add(args, daemon_config_path());
 
     g_strlcpy(msg, "Starting dockerd", msg_len);
 
-    args_wr += g_snprintf(args_wr, args_end - args_wr, " --log-level=%s", log_level);
+    add_arg(args, "--log-level=%s", log_level);
+
+    // The sockets should reside in the user directory and have same group as user.
+    // If omitted, dockerd will log a warning about the 'docker' group not being find.
+    // However, rootlesskit maps the user's primary group to the root group, so "--group 0"
+    // means the sockets will belong to the user's primary group.
+    // The API socket is always created, since the application itself uses the Docker API.
+    g_autofree char* api_socket = docker_api_socket_path();
+    add_arg(args, "--group");
+    add_arg(args, "0");
+    add_arg(args, "-H");
+    add_arg(args, "unix://%s", api_socket);
 
     if (use_ipc_socket) {
         g_strlcat(msg, " with IPC socket and", msg_len);
-        // The socket should reside in the user directory and have same group as user.
-        // If omitted, dockerd will log a warning about the 'docker' group not being find.
-        // However, rootlesskit maps the user's primary group to the root group, so "--group 0"
-        // means the socket will belong to the user's primary group.
         g_autofree char* ipc_socket = xdg_runtime_file("docker.sock");
-        args_wr += g_snprintf(args_wr, args_end - args_wr, " --group 0 -H unix://%s", ipc_socket);
+        add_arg(args, "-H");
+        add_arg(args, "unix://%s", ipc_socket);
     } else {
         g_strlcat(msg, " without IPC socket and", msg_len);
     }
@@ -575,37 +669,177 @@ static const char* build_daemon_args(const struct settings* settings, AXParamete
         g_strlcat(msg, " with TCP socket", msg_len);
         g_strlcat(msg, use_tls ? " in TLS mode" : " in unsecured mode", msg_len);
         const uint port = use_tls ? 2376 : 2375;
-        args_wr += g_snprintf(args_wr, args_end - args_wr, " -H tcp://0.0.0.0:%d", port);
-        const char* tls_arg = use_tls ? "--tlsverify=true" : "--tls=false";
-        args_wr += g_snprintf(args_wr, args_end - args_wr, " %s", tls_arg);
+        add_arg(args, "-H");
+        add_arg(args, "tcp://0.0.0.0:%d", port);
+        add_arg(args, "%s", use_tls ? "--tlsverify=true" : "--tls=false");
         if (use_tls)
-            args_wr += g_snprintf(args_wr, args_end - args_wr, " %s", tls_file_dockerd_args());
+            tls_file_dockerd_args(args);
     } else {
         g_strlcat(msg, " without TCP socket", msg_len);
     }
 
     g_autofree char* data_root_msg = g_strdup_printf(" using %s as storage.", data_root);
     g_strlcat(msg, data_root_msg, msg_len);
-    args_wr += g_snprintf(args_wr, args_end - args_wr, " --data-root %s", data_root);
+    add_arg(args, "--data-root");
+    add_arg(args, "%s", data_root);
 
     log_info("%s", msg);
+    g_ptr_array_add(args, NULL);
     return args;
 }
 
-// Start dockerd. On success, call set_status_parameter(STATUS_RUNNING) and on error,
+// Preload the image archives in the directory selected by the ImagePreload parameter, if dockerd
+// is ready.
+static void start_image_preload(struct app_state* app_state) {
+    const char* source = app_state->parameters->values.image_preload;
+    if (!rootlesskit_pid || app_state->readiness_probe)
+        return;
+    g_autofree char* directory = NULL;
+    if (strcmp(source, "localdata") == 0)
+        directory = g_build_filename(APP_LOCALDATA, IMAGE_PRELOAD_DIRECTORY, NULL);
+    else if (strcmp(source, "sdcard") == 0 && app_state->sd_card_area)
+        directory = g_build_filename(app_state->sd_card_area, IMAGE_PRELOAD_DIRECTORY, NULL);
+    if (directory)
+        image_preload_start(app_state->image_preload, directory, app_state->data_root);
+}
+
+// Start the registry cache on the SD card, if it is enabled and dockerd is ready, since it runs in
+// the namespaces of rootlesskit. Without an SD card, the cache is stopped and reported inactive.
+static void start_registry_cache(struct app_state* app_state) {
+    const struct parameter_values* values = &app_state->parameters->values;
+    if (!values->registry_cache || !rootlesskit_pid || app_state->readiness_probe)
+        return;
+    const pid_t namespace_pid = port_forwarder_child_pid();
+    if (!namespace_pid) {
+        log_error("Found no namespace of rootlesskit to start the registry cache in");
+        return;
+    }
+    g_autofree char* directory = NULL;
+    if (app_state->sd_card_area) {
+        directory = g_build_filename(app_state->sd_card_area, REGISTRY_CACHE_DIRECTORY, NULL);
+        // Without the forward, only the statistics of the cache are unavailable.
+        port_forwarder_forward_loopback(REGISTRY_CACHE_DEBUG_PORT(values->registry_cache_port));
+    }
+    registry_cache_start(app_state->registry_cache,
+                         directory,
+                         values->registry_cache_upstream,
+                         values->registry_cache_port,
+                         values->registry_cache_max_size,
+                         namespace_pid);
+    if (directory && values->registry_cache_shared)
+        port_forwarder_start(app_state->registry_cache_forwarder,
+                             values->registry_cache_port,
+                             network_profile_find(values->network_profile)->forwards_ipv6);
+    else
+        port_forwarder_stop(app_state->registry_cache_forwarder);
+}
+
+// Meant to be used as a readiness_probe_start() callback. The child watch cancels the probe if
+// rootlesskit exits before dockerd is ready.
+static void dockerd_ready(gint64 listening_at, void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    app_state->readiness_probe = NULL;
+
+    const gint64 spawned_at = app_state->dockerd_spawned_at;
+    startup_timing_record(app_state->startup_timing, STARTUP_PHASE_DOCKERD_SOCKET, spawned_at);
+    startup_timing_record(app_state->startup_timing, STARTUP_PHASE_DOCKERD_INIT, listening_at);
+    startup_timing_end(app_state->startup_timing, "ready");
+
+    const gint64 spawn_to_ready_us = g_get_monotonic_time() - spawned_at;
+    log_info("dockerd is ready %" G_GINT64_FORMAT " ms after it was spawned",
+             spawn_to_ready_us / 1000);
+    metrics_dockerd_ready(spawn_to_ready_us);
+    set_status_parameter(app_state->parameters, STATUS_RUNNING);
+    health_monitor_start(app_state->health_monitor);
+    start_image_preload(app_state);
+    start_registry_cache(app_state);
+}
+
+static void stop_dockerd(struct app_state* app_state);
+
+// Meant to be used as a readiness_probe_start() callback. A dockerd that hangs during its
+// initialization counts as a failure, so stop it and leave the restart to the supervisor, as for a
+// dockerd that hangs later.
+static void restart_dockerd_after_startup_timeout(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    app_state->readiness_probe = NULL;
+    log_error("dockerd did not answer within %d s after it was spawned, stopping it",
+              READINESS_DEADLINE_MS / 1000);
+    startup_timing_end(app_state->startup_timing, "timed out");
+    stop_dockerd(app_state);
+    restart_dockerd_after_failure(app_state);
+}
+
+// Meant to be used as a health_monitor_new() callback. A hung dockerd counts as a failure, so stop
+// it, which kills it if it does not stop within the grace period, and leave the restart to the
+// supervisor, which stops restarting a dockerd that keeps hanging.
+static void restart_hung_dockerd(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    stop_dockerd(app_state);
+    restart_dockerd_after_failure(app_state);
+}
+
+// Meant to be used as a network_acceleration_new() callback. Containers can no longer make socket
+// calls, so stop dockerd and leave the restart to the supervisor, so that a bypass4netns that keeps
+// exiting does not restart dockerd without bounds. The restart starts bypass4netns again, or falls
+// back to slirp4netns if bypass4netns failed to start.
+static void restart_dockerd_after_bypass4netns_exit(void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    if (!rootlesskit_pid)
+        return;
+    stop_dockerd(app_state);
+    restart_dockerd_after_failure(app_state);
+}
+
+// Start dockerd. On success, call set_status_parameter(STATUS_STARTING), and later
+// set_status_parameter(STATUS_RUNNING) when dockerd is ready. On error,
 // call set_status_parameter(STATUS_NOT_STARTED).
 static bool start_dockerd(const struct settings* settings, struct app_state* app_state) {
-    AXParameter* param_handle = app_state->param_handle;
+    struct parameters* parameters = app_state->parameters;
     GError* error = NULL;
     bool result = false;
     bool return_value = false;
 
-    const char* args = build_daemon_args(settings, param_handle);
+    if (!app_state->storage_probe_start)
+        app_state->storage_probe_start = g_get_monotonic_time();
+    if (!storage_probe_select(app_state->storage_probe,
+                              settings->data_root,
+                              &app_state->daemon_runtime.storage_driver)) {
+        log_info("dockerd will be started when the storage drivers have been probed");
+        return false;  // start_dockerd_after_storage_probe() triggers the next attempt
+    }
+    startup_timing_record(app_state->startup_timing,
+                          STARTUP_PHASE_STORAGE_PROBE,
+                          app_state->storage_probe_start);
+    app_state->storage_probe_start = 0;
+
+    gint64 phase_start = g_get_monotonic_time();
+    app_state->daemon_runtime.seccomp_profile =
+        network_acceleration_start(app_state->network_acceleration,
+                                   parameters->values.network_acceleration,
+                                   daemon_config_user_sets("seccomp-profile"));
+    // dockerd falls back to the other mirrors while the cache is not running.
+    g_free(app_state->registry_cache_mirror);
+    app_state->registry_cache_mirror =
+        parameters->values.registry_cache
+            ? registry_cache_mirror(parameters->values.registry_cache_port)
+            : NULL;
+    app_state->daemon_runtime.registry_mirror = app_state->registry_cache_mirror;
+    if (!daemon_config_write(&parameters->values, &app_state->daemon_runtime)) {
+        network_acceleration_stop(app_state->network_acceleration);
+        app_state->daemon_runtime.seccomp_profile = NULL;
+        set_status_parameter(parameters, STATUS_NOT_STARTED);
+        return false;
+    }
+    startup_timing_record(app_state->startup_timing, STARTUP_PHASE_DAEMON_CONFIG, phase_start);
+
+    GPtrArray* args = build_daemon_args(settings, parameters);
 
-    log_debug("Sending daemon start command: %s", args);
-    char** args_split = g_strsplit(args, " ", 0);
+    g_autofree char* command_line = g_strjoinv(" ", (char**)args->pdata);
+    log_debug("Sending daemon start command: %s", command_line);
+    phase_start = g_get_monotonic_time();
     result = g_spawn_async(NULL,
-                           args_split,
+                           (char**)args->pdata,
                            NULL,
                            G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH,
                            NULL,
@@ -614,18 +848,40 @@ static bool start_dockerd(const struct settings* settings, struct app_state* app
                            &error);
     if (!result) {
         log_error("Starting dockerd failed: execv returned: %d, error: %s", result, error->message);
-        set_status_parameter(param_handle, STATUS_NOT_STARTED);
+        network_acceleration_stop(app_state->network_acceleration);
+        app_state->daemon_runtime.seccomp_profile = NULL;
+        set_status_parameter(parameters, STATUS_NOT_STARTED);
         goto end;
     }
     log_debug("Child process rootlesskit (%d) was started.", rootlesskit_pid);
+    g_free(app_state->data_root);
+    app_state->data_root = g_strdup(settings->data_root);
+    startup_timing_record(app_state->startup_timing, STARTUP_PHASE_SPAWN, phase_start);
+    supervisor_started(app_state->supervisor);
+    metrics_count(METRICS_DOCKERD_STARTS);
+    resource_sampler_start(app_state->resource_sampler, rootlesskit_pid);
+    if (settings->use_tcp_socket)
+        port_forwarder_start(
+            app_state->port_forwarder,
+            settings->use_tls ? 2376 : 2375,
+            network_profile_find(parameters->values.network_profile)->forwards_ipv6);
+
+    app_state->dockerd_spawned_at = g_get_monotonic_time();
+    app_state->readiness_probe = readiness_probe_start(READINESS_INITIAL_INTERVAL_MS,
+                                                       READINESS_MAX_INTERVAL_MS,
+                                                       READINESS_DEADLINE_MS,
+                                                       dockerd_ready,
+                                                       restart_dockerd_after_startup_timeout,
+                                                       app_state);
 
     g_child_watch_add(rootlesskit_pid, check_child_process_exit_code_and_clean_up, app_state);
+    parameter_values_copy(&app_state->running_values, &parameters->values);
 
-    set_status_parameter(param_handle, STATUS_RUNNING);
+    set_status_parameter(parameters, STATUS_STARTING);
     return_value = true;
 
 end:
-    g_strfreev(args_split);
+    g_ptr_array_unref(args);
     g_clear_error(&error);
     return return_value;
 }
@@ -633,8 +889,12 @@ end:
 static void read_settings_and_start_dockerd(struct app_state* app_state) {
     struct settings settings = {0};
 
-    if (read_settings(&settings, app_state))
-        start_dockerd(&settings, app_state);
+    startup_timing_begin(app_state->startup_timing);
+    if (!read_settings(&settings, app_state) || !start_dockerd(&settings, app_state)) {
+        // While waiting for the SD card or the storage probe, the start is still in progress.
+        if (!app_state->sd_card_wait_id && !app_state->storage_probe_start)
+            startup_timing_end(app_state->startup_timing, "failed");
+    }
 
     free(settings.data_root);
 }
@@ -648,125 +908,350 @@ static bool send_signal(const char* name, GPid pid, int sig) {
     return TRUE;
 }
 
-// Check if dockerd is still running. Launch this function using g_timeout_add_seconds() and pass a
-// pointer to a counter starting at 1. When dockerd has terminated, the counter will be set to zero.
-// Otherwise, it will be increased, and SIGTERM will be sent on the 20th call.
-static gboolean monitor_dockerd_termination(void* time_since_sigterm_void_ptr) {
-    // dockerd usually sends SIGTERM to containers after 10 seconds and systemd forcefully shutdown
-    // the process approximately at 14-15 seconds, so we must wait slightly longer than 10 seconds
-    // but not more than 15 seconds.
-    const int time_to_wait_before_sigkill = 13;
-    int* time_since_sigterm = (int*)time_since_sigterm_void_ptr;
-    if (!rootlesskit_pid) {
-        log_debug("rootlesskit exited after %d s", *time_since_sigterm);
-        *time_since_sigterm = 0;  // Tell caller that timer has ended.
-        g_main_loop_quit(loop);   // Release caller from its main loop.
-        return FALSE;             // Tell GLib that timer shall end.
-    } else {
-        log_debug("rootlesskit (%d) still running %d s after SIGTERM",
-                  rootlesskit_pid,
-                  *time_since_sigterm);
-        (*time_since_sigterm)++;
-        if (*time_since_sigterm > time_to_wait_before_sigkill)
-            // Send SIGKILL but still wait for the process exit callback to clear the pid variable.
-            send_signal("rootlesskit", rootlesskit_pid, SIGKILL);
-        return TRUE;  // Tell GLib to call timer again.
+enum stop_phase { STOP_PHASE_CONTAINERS, STOP_PHASE_SIGTERM, STOP_PHASE_SIGKILL, STOP_PHASE_COUNT };
+
+struct container_stop_job {
+    int timeout_s;
+    volatile int done_atomic;
+    GSource* wake_up;  // Attached by the job when done, destroyed by stop_dockerd()
+};
+
+static gboolean quit_stop_dockerd_wait(void*) {
+    main_loop_quit();
+    return G_SOURCE_REMOVE;
+}
+
+// Run the main loop until rootlesskit has exited, *done is set or the monotonic time deadline_us
+// has passed. Any source that quits the main loop makes this function check the conditions again.
+// The child watch is one such source, so this returns as soon as rootlesskit has exited.
+static void wait_for_rootlesskit_exit(gint64 deadline_us, const volatile int* done) {
+    GSource* timer = NULL;
+    if (deadline_us != G_MAXINT64) {
+        const gint64 remaining_us = MAX(deadline_us - g_get_monotonic_time(), 0);
+        timer = g_timeout_source_new((remaining_us + 999) / 1000);
+        g_source_set_callback(timer, quit_stop_dockerd_wait, NULL, NULL);
+        g_source_attach(timer, NULL);
+    }
+    while (rootlesskit_pid && g_get_monotonic_time() < deadline_us &&
+           !(done && g_atomic_int_get(done)))
+        main_loop_run();
+    if (timer) {
+        g_source_destroy(timer);
+        g_source_unref(timer);
     }
 }
 
-// Send SIGTERM to dockerd, wait for it to terminate.
-// Send SIGKILL if that fails, but still wait for it to terminate.
-static void stop_dockerd(void) {
-    if (!is_process_alive(rootlesskit_pid))
+// Stop all containers through the Docker API. Run in a separate thread so that the main loop keeps
+// running, and wake up wait_for_rootlesskit_exit() when done.
+static void* stop_containers_thread(void* job_void_ptr) {
+    struct container_stop_job* job = job_void_ptr;
+    container_stop_all(job->timeout_s);
+    g_atomic_int_set(&job->done_atomic, true);
+    job->wake_up = g_idle_source_new();
+    g_source_set_callback(job->wake_up, quit_stop_dockerd_wait, NULL, NULL);
+    g_source_attach(job->wake_up, NULL);
+    return NULL;
+}
+
+// Stop dockerd within the grace period given by the DockerdStopTimeout parameter. First stop the
+// containers that dockerd would not restart in parallel, then send SIGTERM to rootlesskit, and send
+// SIGKILL if it is still running when the grace period has passed. Each phase ends as soon as
+// rootlesskit has exited, and the time spent in each phase is logged.
+static void stop_dockerd(struct app_state* app_state) {
+    if (!rootlesskit_pid)
         return;
+    app_state->dockerd_stop_requested = true;
+    health_monitor_stop(app_state->health_monitor);
+
+    const int grace_period_s = app_state->parameters->values.dockerd_stop_timeout;
+    const gint64 start = g_get_monotonic_time();
+    gint64 phase_start = start;
+    gint64 phase_us[STOP_PHASE_COUNT] = {0};
+
+    // Leave dockerd DOCKERD_EXIT_RESERVE_S to exit after SIGTERM, and the containers
+    // CONTAINER_KILL_S after their stop timeout to be killed.
+    const int containers_s = MAX(grace_period_s - DOCKERD_EXIT_RESERVE_S, 0);
+    struct container_stop_job job = {.timeout_s = MAX(containers_s - CONTAINER_KILL_S, 0)};
+    GThread* thread = g_thread_new("stop_containers", stop_containers_thread, &job);
+    wait_for_rootlesskit_exit(start + containers_s * G_USEC_PER_SEC, &job.done_atomic);
+    phase_us[STOP_PHASE_CONTAINERS] = g_get_monotonic_time() - phase_start;
+
+    if (rootlesskit_pid) {
+        phase_start = g_get_monotonic_time();
+        send_signal("rootlesskit", rootlesskit_pid, SIGTERM);
+        wait_for_rootlesskit_exit(start + grace_period_s * G_USEC_PER_SEC, NULL);
+        phase_us[STOP_PHASE_SIGTERM] = g_get_monotonic_time() - phase_start;
+    }
 
-    send_signal("rootlesskit", rootlesskit_pid, SIGTERM);
+    if (rootlesskit_pid) {
+        phase_start = g_get_monotonic_time();
+        log_warning("rootlesskit (%d) still running %d s after stop was requested",
+                    rootlesskit_pid,
+                    grace_period_s);
+        // Still wait for the child watch to clear the pid variable.
+        send_signal("rootlesskit", rootlesskit_pid, SIGKILL);
+        wait_for_rootlesskit_exit(G_MAXINT64, NULL);
+        phase_us[STOP_PHASE_SIGKILL] = g_get_monotonic_time() - phase_start;
+    }
 
-    int time_since_sigterm = 1;
-    g_timeout_add_seconds(1, monitor_dockerd_termination, &time_since_sigterm);
-    while (time_since_sigterm != 0) {  // Loop until the timer callback has stopped running
-        g_main_loop_run(loop);
+    // Any stop requests still in progress fail now that dockerd is gone, so this is quick.
+    g_thread_join(thread);
+    if (job.wake_up) {
+        g_source_destroy(job.wake_up);
+        g_source_unref(job.wake_up);
     }
-    log_info("Stopped dockerd.");
-}
 
-// Meant to be used as an AXParameter callback
-static void restart_dockerd_when_parameter_changed(const gchar* name,
-                                                   const gchar* value,
-                                                   gpointer app_state_void_ptr) {
-    const gchar* parname = name += strlen("root." APP_NAME ".");
+    log_info("Stopped dockerd in %" G_GINT64_FORMAT " ms (containers %" G_GINT64_FORMAT
+             " ms, SIGTERM %" G_GINT64_FORMAT " ms, SIGKILL %" G_GINT64_FORMAT " ms)",
+             (g_get_monotonic_time() - start) / 1000,
+             phase_us[STOP_PHASE_CONTAINERS] / 1000,
+             phase_us[STOP_PHASE_SIGTERM] / 1000,
+             phase_us[STOP_PHASE_SIGKILL] / 1000);
+}
 
-    log_info("%s changed to %s", parname, value);
+// Meant to be used as a parameters_new() callback
+static void restart_dockerd_when_parameter_changed(const char* name,
+                                                   const char* value,
+                                                   void* app_state_void_ptr) {
+    log_info("%s changed to %s", name, value);
 
     struct app_state* app_state = app_state_void_ptr;
 
     // If dockerd has failed before, this parameter change may have resolved the problem.
+    supervisor_reset(app_state->supervisor);
     allow_dockerd_to_start(app_state, true);
 
-    // Trigger a restart of dockerd from main(), but delay it 1 second.
+    // Trigger a restart of dockerd from main(), but delay it at least 1 second.
     // When there are multiple AXParameter callbacks in a queue, such as
     // during the first parameter change after installation, any parameter
     // usage, even outside a callback, will cause a 20 second deadlock per
     // queued callback.
-    g_timeout_add_seconds(1, quit_main_loop, NULL);
+    g_autofree char* reason = g_strdup_printf("parameter %s", name);
+    restart_scheduler_request(app_state->restart_scheduler, reason);
 }
 
-static AXParameter* setup_axparameter(struct app_state* app_state) {
-    bool success = false;
-    GError* error = NULL;
-    AXParameter* ax_parameter = ax_parameter_new(APP_NAME, &error);
-    if (ax_parameter == NULL) {
-        log_error("Error when creating AXParameter: %s", error->message);
-        goto end;
+static void sd_card_callback(const char* sd_card_area, void* app_state_void_ptr) {
+    struct app_state* app_state = app_state_void_ptr;
+    const bool using_sd_card = app_state->parameters->values.sd_card_support;
+    if (using_sd_card && !sd_card_area) {
+        stop_dockerd(app_state);  // Block here until dockerd has stopped using the SD card.
+        set_status_parameter(app_state->parameters, STATUS_NO_SD_CARD);
+    }
+    filesystem_info_invalidate();  // A different card may be mounted on the same device
+    free(app_state->sd_card_area);
+    app_state->sd_card_area = sd_card_area ? strdup(sd_card_area) : NULL;
+    app_state->sd_card_wait_expired = false;
+
+    if (sd_card_area && app_state->sd_card_wait_id) {
+        // dockerd is waiting for this, so start it right away rather than through a restart.
+        g_source_remove(app_state->sd_card_wait_id);
+        app_state->sd_card_wait_id = 0;
+        startup_timing_record(app_state->startup_timing,
+                              STARTUP_PHASE_SD_CARD_WAIT,
+                              app_state->sd_card_wait_start);
+        main_loop_quit();  // Trigger a start of dockerd from main()
+    } else if (using_sd_card) {
+        g_atomic_int_set(&app_state->restart_required_atomic, true);
+        restart_scheduler_request(app_state->restart_scheduler,
+                                  sd_card_area ? "SD card available" : "SD card unavailable");
     }
 
-    for (const char** param = params_that_restart_dockerd; *param; param++) {
-        if (!ax_parameter_register_callback(ax_parameter,
-                                            *param,
-                                            restart_dockerd_when_parameter_changed,
-                                            app_state,
-                                            &error)) {
-            log_error("Could not register %s callback. Error: %s", *param, error->message);
-            goto end;
-        }
+    // When dockerd is not restarted for the card, the archives on it are preloaded right away,
+    // and the registry cache follows the card.
+    if (strcmp(app_state->parameters->values.image_preload, "sdcard") == 0) {
+        if (!sd_card_area)
+            image_preload_stop(app_state->image_preload);
+        else if (!using_sd_card)
+            start_image_preload(app_state);
     }
+    if (!using_sd_card)
+        start_registry_cache(app_state);
+}
 
-    success = true;
+// Called from an FCGI worker thread.
+static void restart_dockerd_after_file_upload(struct app_state* app_state) {
+    // If dockerd has failed before, this file upload may have resolved the problem.
+    supervisor_reset(app_state->supervisor);
+    allow_dockerd_to_start(app_state, true);
 
-end:
-    g_clear_error(&error);
-    if (!success && ax_parameter != NULL) {
-        ax_parameter_free(ax_parameter);
-        ax_parameter = NULL;
+    g_atomic_int_set(&app_state->restart_required_atomic, true);
+    restart_scheduler_request(app_state->restart_scheduler, "file upload");
+}
+
+// Let dockerd reread its configuration file, which is regenerated first.
+static bool reload_dockerd(const struct parameter_values* values,
+                           const struct daemon_runtime_options* runtime) {
+    g_autofree char* pid_path = xdg_runtime_file("docker.pid");
+    g_autofree char* pid_str = NULL;
+    gint64 pid = 0;
+    // A pid of zero would signal the whole process group, the application included.
+    if (!daemon_config_write(values, runtime) ||
+        !g_file_get_contents(pid_path, &pid_str, NULL, NULL) ||
+        !g_ascii_string_to_signed(g_strstrip(pid_str), 10, 1, G_MAXINT, &pid, NULL)) {
+        log_warning("Could not reload dockerd");
+        return false;
     }
-    return ax_parameter;
+    return send_signal("dockerd", (GPid)pid, SIGHUP);
 }
 
-static void sd_card_callback(const char* sd_card_area, void* app_state_void_ptr) {
+// Meant to be used as a restart_scheduler_new() callback. Apply the merged changes in the least
+// disruptive way, and only restart dockerd if some change requires it.
+static void reconfigure_dockerd(const char* reasons, void* app_state_void_ptr) {
     struct app_state* app_state = app_state_void_ptr;
-    const bool using_sd_card = is_parameter_yes(app_state->param_handle, PARAM_SD_CARD_SUPPORT);
-    if (using_sd_card && !sd_card_area) {
-        stop_dockerd();  // Block here until dockerd has stopped using the SD card.
-        set_status_parameter(app_state->param_handle, STATUS_NO_SD_CARD);
-    }
-    app_state->sd_card_area = sd_card_area ? strdup(sd_card_area) : NULL;
-    if (using_sd_card)
+    const struct parameter_values* wanted = &app_state->parameters->values;
+
+    // Sampling does not depend on how dockerd is reconfigured.
+    resource_sampler_configure(app_state->resource_sampler,
+                               wanted->resource_sample_interval,
+                               wanted->resource_sample_retention);
+
+    enum reconfigure_strategy strategy = RECONFIGURE_RESTART;
+    if (rootlesskit_pid && !g_atomic_int_get(&app_state->restart_required_atomic))
+        strategy = reconfigure_strategy(&app_state->running_values, wanted);
+
+    if (strategy == RECONFIGURE_RELOAD && !reload_dockerd(wanted, &app_state->daemon_runtime))
+        strategy = RECONFIGURE_RESTART;
+
+    g_atomic_int_inc(&app_state->reconfigurations_atomic[strategy]);
+    log_info("Applying %s using strategy %s (%d times so far)",
+             reasons,
+             reconfigure_strategy_name(strategy),
+             g_atomic_int_get(&app_state->reconfigurations_atomic[strategy]));
+
+    if (strategy == RECONFIGURE_RESTART) {
+        g_atomic_int_set(&app_state->restart_required_atomic, false);
         main_loop_quit();  // Trigger a restart of dockerd from main()
+        return;
+    }
+    log_debug_set(is_app_log_level_debug(app_state->parameters));
+    const struct parameter_values* running = &app_state->running_values;
+    const bool preload_changed = strcmp(running->image_preload, wanted->image_preload) != 0;
+    const bool upstream_changed =
+        strcmp(running->registry_cache_upstream, wanted->registry_cache_upstream) != 0;
+    const bool cache_size_changed =
+        running->registry_cache_max_size != wanted->registry_cache_max_size;
+    parameter_values_copy(&app_state->running_values, wanted);
+    if (preload_changed) {
+        image_preload_stop(app_state->image_preload);
+        start_image_preload(app_state);
+    }
+    if (upstream_changed)
+        start_registry_cache(app_state);
+    else if (cache_size_changed)
+        registry_cache_set_max_size(app_state->registry_cache, wanted->registry_cache_max_size);
 }
 
-static void restart_dockerd_after_file_upload(struct app_state* app_state) {
-    // If dockerd has failed before, this file upload may have resolved the problem.
-    allow_dockerd_to_start(app_state, true);
+static json_t* supervisor_report(struct app_state* app_state) {
+    struct supervisor_stats stats;
+    struct restart_scheduler_stats scheduler_stats;
+    supervisor_get_stats(app_state->supervisor, &stats);
+    restart_scheduler_get_stats(app_state->restart_scheduler, &scheduler_stats);
+    json_t* reconfigurations = json_object();
+    for (int strategy = 0; strategy < RECONFIGURE_STRATEGY_COUNT; strategy++)
+        json_object_set_new(reconfigurations,
+                            reconfigure_strategy_name(strategy),
+                            json_integer(g_atomic_int_get(
+                                &app_state->reconfigurations_atomic[strategy])));
+    return json_pack("{s:I, s:I, s:I, s:I, s:i, s:i, s:b, s:I, s:I, s:o}",
+                     "starts",
+                     (json_int_t)stats.starts,
+                     "unexpected_exits",
+                     (json_int_t)stats.unexpected_exits,
+                     "automatic_restarts",
+                     (json_int_t)stats.restarts,
+                     "circuit_opens",
+                     (json_int_t)stats.circuit_opens,
+                     "consecutive_failures",
+                     (int)stats.consecutive_failures,
+                     "last_backoff_ms",
+                     (int)stats.last_backoff_ms,
+                     "circuit_open",
+                     stats.circuit_open,
+                     "restart_requests",
+                     (json_int_t)scheduler_stats.requests,
+                     "merged_restarts",
+                     (json_int_t)scheduler_stats.restarts,
+                     "reconfigurations",
+                     reconfigurations);
+}
 
-    main_loop_quit();
+static json_t* startup_report(struct app_state* app_state) {
+    return startup_timing_json(app_state->startup_timing);
 }
 
+static json_t* health_report(struct app_state* app_state) {
+    return health_monitor_json(app_state->health_monitor);
+}
+
+static json_t* resources_report(struct app_state* app_state) {
+    return resource_sampler_json(app_state->resource_sampler);
+}
+
+static json_t* network_report(struct app_state* app_state) {
+    return network_acceleration_json(app_state->network_acceleration);
+}
+
+static json_t* ports_report(struct app_state* app_state) {
+    return port_forwarder_json(app_state->port_forwarder);
+}
+
+static json_t* preload_report(struct app_state* app_state) {
+    return image_preload_json(app_state->image_preload);
+}
+
+static json_t* cache_report(struct app_state* app_state) {
+    json_t* report = registry_cache_json(app_state->registry_cache);
+    json_object_set_new(report, "shared", port_forwarder_json(app_state->registry_cache_forwarder));
+    return report;
+}
+
+static json_t* storage_report(struct app_state* app_state) {
+    return storage_probe_json(app_state->storage_probe);
+}
+
+static const struct json_route json_routes[] = {
+    {SUPERVISOR_ROUTE, supervisor_report},
+    {STARTUP_ROUTE, startup_report},
+    {HEALTH_ROUTE, health_report},
+    {RESOURCES_ROUTE, resources_report},
+    {NETWORK_ROUTE, network_report},
+    {PORTS_ROUTE, ports_report},
+    {PRELOAD_ROUTE, preload_report},
+    {CACHE_ROUTE, cache_report},
+    {STORAGE_ROUTE, storage_report},
+    {NULL, NULL},
+};
+
 // Stop the application and start it from an SSH prompt with
 // $ ./dockerdwrapper --stdout
 // in order to get log messages written to console rather than to syslog.
-static void parse_command_line(int argc, char** argv, struct log_settings* log_settings) {
+//
+// postinstallscript.sh runs
+// $ ./dockerdwrapper --repair-ownership <SD card area>
+// to repair the ownership of the SD card area and exit, and then *repair_area is set.
+//
+// storage_probe_select() runs
+// $ rootlesskit ./dockerdwrapper --probe-storage <data root>
+// to measure the storage drivers and print the result, and then *probe_directory is set.
+static void parse_command_line(int argc,
+                               char** argv,
+                               struct log_settings* log_settings,
+                               const char** repair_area,
+                               const char** probe_directory) {
     log_settings->destination =
         (argc == 2 && strcmp(argv[1], "--stdout") == 0) ? log_dest_stdout : log_dest_syslog;
+    *repair_area = (argc == 3 && strcmp(argv[1], "--repair-ownership") == 0) ? argv[2] : NULL;
+    *probe_directory = (argc == 3 && strcmp(argv[1], "--probe-storage") == 0) ? argv[2] : NULL;
+}
+
+// Print the measurements of the storage drivers in directory for storage_probe_select().
+static int probe_storage(const char* directory) {
+    json_t* results = storage_probe_measure(directory);
+    if (!results)
+        return EX_SOFTWARE;
+    json_dumpf(results, stdout, JSON_COMPACT);
+    json_decref(results);
+    return EX_OK;
 }
 
 static bool set_env_variable(const char* env_var, const char* value) {
@@ -796,26 +1281,78 @@ int main(int argc, char** argv) {
 
     loop = g_main_loop_new(NULL, FALSE);
 
-    parse_command_line(argc, argv, &log_settings);
+    const char* repair_area;
+    const char* probe_directory;
+    parse_command_line(argc, argv, &log_settings, &repair_area, &probe_directory);
     log_init(&log_settings);
+    if (repair_area)
+        return repair_sd_card_ownership(repair_area) ? EX_OK : EX_SOFTWARE;
+    if (probe_directory)
+        return probe_storage(probe_directory);
 
     allow_dockerd_to_start(&app_state, true);
 
-    app_state.param_handle = setup_axparameter(&app_state);
-    if (!app_state.param_handle)
+    // The first start cycle includes reading the parameters.
+    app_state.startup_timing = startup_timing_new(STARTUP_HISTORY_LENGTH);
+    startup_timing_begin(app_state.startup_timing);
+
+    app_state.restart_scheduler = restart_scheduler_new(RESTART_DEBOUNCE_MS,
+                                                        RESTART_MAX_LATENCY_MS,
+                                                        reconfigure_dockerd,
+                                                        &app_state);
+
+    const struct supervisor_policy supervisor_policy = {
+        .initial_backoff_ms = SUPERVISOR_INITIAL_BACKOFF_MS,
+        .max_backoff_ms = SUPERVISOR_MAX_BACKOFF_MS,
+        .budget = SUPERVISOR_RESTART_BUDGET,
+        .window_s = SUPERVISOR_BUDGET_WINDOW_S,
+        .stable_after_s = SUPERVISOR_STABLE_AFTER_S,
+    };
+    app_state.supervisor =
+        supervisor_new(&supervisor_policy, start_dockerd_after_backoff, &app_state);
+
+    const struct health_monitor_policy health_policy = {
+        .interval_ms = HEALTH_INTERVAL_MS,
+        .timeout_ms = HEALTH_TIMEOUT_MS,
+        .info_interval = HEALTH_INFO_INTERVAL,
+        .hang_threshold = HEALTH_HANG_THRESHOLD,
+    };
+    app_state.health_monitor = health_monitor_new(&health_policy, restart_hung_dockerd, &app_state);
+
+    const gint64 phase_start = g_get_monotonic_time();
+    app_state.parameters = parameters_new(restart_dockerd_when_parameter_changed, &app_state);
+    if (!app_state.parameters)
         return EX_SOFTWARE;
+    startup_timing_record(app_state.startup_timing, STARTUP_PHASE_PARAMETERS, phase_start);
+
+    app_state.resource_sampler =
+        resource_sampler_new(app_state.parameters->values.resource_sample_interval,
+                             app_state.parameters->values.resource_sample_retention);
+
+    app_state.network_acceleration =
+        network_acceleration_new(restart_dockerd_after_bypass4netns_exit, &app_state);
+    app_state.port_forwarder = port_forwarder_new();
+    app_state.storage_probe = storage_probe_new(start_dockerd_after_storage_probe, NULL);
+    app_state.image_preload = image_preload_new();
+    app_state.registry_cache = registry_cache_new();
+    app_state.registry_cache_forwarder = port_forwarder_new();
 
-    log_debug_set(is_app_log_level_debug(app_state.param_handle));
+    log_debug_set(is_app_log_level_debug(app_state.parameters));
 
     if (!set_env_variables())
         return EX_SOFTWARE;
 
     init_signals();
 
-    struct restart_dockerd_context restart_dockerd_context;
-    restart_dockerd_context.restart_dockerd = restart_dockerd_after_file_upload;
-    restart_dockerd_context.app_state = &app_state;
-    int fcgi_error = fcgi_start(http_request_callback, &restart_dockerd_context);
+    fcgi_remove_stale_uploads(APP_LOCALDATA);
+    struct http_request_context http_request_context;
+    http_request_context.restart_dockerd = restart_dockerd_after_file_upload;
+    http_request_context.app_state = &app_state;
+    http_request_context.json_routes = json_routes;
+    int fcgi_error = fcgi_start(http_request_callback,
+                                &http_request_context,
+                                FCGI_NUM_WORKERS,
+                                FCGI_BACKLOG);
     if (fcgi_error)
         return fcgi_error;
 
@@ -827,19 +1364,33 @@ int main(int argc, char** argv) {
 
         main_loop_run();
 
-        log_debug_set(is_app_log_level_debug(app_state.param_handle));
+        log_debug_set(is_app_log_level_debug(app_state.parameters));
 
-        stop_dockerd();
+        stop_dockerd(&app_state);
     }
 
     sd_disk_storage_free(sd_disk_storage);
 
     fcgi_stop();
 
-    set_status_parameter(app_state.param_handle, STATUS_NOT_STARTED);
-    ax_parameter_free(app_state.param_handle);
+    set_status_parameter(app_state.parameters, STATUS_NOT_STARTED);
+    parameters_free(app_state.parameters);
+    restart_scheduler_free(app_state.restart_scheduler);
+    supervisor_free(app_state.supervisor);
+    health_monitor_free(app_state.health_monitor);
+    resource_sampler_free(app_state.resource_sampler);
+    network_acceleration_free(app_state.network_acceleration);
+    port_forwarder_free(app_state.port_forwarder);
+    storage_probe_free(app_state.storage_probe);
+    image_preload_free(app_state.image_preload);
+    registry_cache_free(app_state.registry_cache);
+    port_forwarder_free(app_state.registry_cache_forwarder);
+    startup_timing_free(app_state.startup_timing);
+    parameter_values_clear(&app_state.running_values);
 
     free(app_state.sd_card_area);
+    g_free(app_state.data_root);
+    g_free(app_state.registry_cache_mirror);
 
     main_loop_unref();
 
@@ -12,30 +12,48 @@
 
 static const char* g_socket_path = NULL;
 static int g_socket = -1;
-static GThread* g_thread = NULL;
+static GThread** g_threads = NULL;
+static unsigned int g_num_threads = 0;
+
+// Serializes FCGX_Accept_r() calls on the shared socket, as recommended by libfcgi for
+// multi-threaded servers, so that only one worker at a time is woken up by a new connection.
+static GMutex accept_mutex;
 
 struct request_context {
     fcgi_request_callback callback;
     void* parameter;
 };
 
+static struct request_context g_request_context;
+
+static bool accept_request(FCGX_Request* request) {
+    g_mutex_lock(&accept_mutex);
+    const int result = FCGX_Accept_r(request);
+    g_mutex_unlock(&accept_mutex);
+    return result >= 0;
+}
+
 static void* handle_fcgi(void* request_context_void_ptr) {
-    g_autofree struct request_context* request_context =
-        (struct request_context*)request_context_void_ptr;
+    const struct request_context* request_context = request_context_void_ptr;
+    FCGX_Request request = {};
+    FCGX_InitRequest(&request, g_socket, FCGI_FAIL_ACCEPT_ON_INTR);
     while (true) {
-        FCGX_Request request = {};
-        FCGX_InitRequest(&request, g_socket, FCGI_FAIL_ACCEPT_ON_INTR);
-        if (FCGX_Accept_r(&request) < 0) {
+        if (!accept_request(&request)) {
             // shutdown() was called on g_socket, which causes FCGX_Accept_r() to fail.
-            log_debug("Stopping FCGI server, because FCGX_Accept_r() returned %s", strerror(errno));
+            log_debug("Stopping FCGI worker, because FCGX_Accept_r() returned %s",
+                      strerror(errno));
+            FCGX_Free(&request, false);
             return NULL;
         }
         request_context->callback(&request, request_context->parameter);
     }
 }
 
-int fcgi_start(fcgi_request_callback request_callback, void* request_callback_parameter) {
-    log_debug("Starting FCGI server");
+int fcgi_start(fcgi_request_callback request_callback,
+               void* request_callback_parameter,
+               unsigned int num_workers,
+               int backlog) {
+    log_debug("Starting FCGI server with %u workers and a backlog of %d", num_workers, backlog);
 
     g_socket_path = getenv(FCGI_SOCKET_NAME);
     if (!g_socket_path) {
@@ -48,22 +66,29 @@ int fcgi_start(fcgi_request_callback request_callback, void* request_callback_pa
         return EX_SOFTWARE;
     }
 
-    if ((g_socket = FCGX_OpenSocket(g_socket_path, 5)) < 0) {
+    if ((g_socket = FCGX_OpenSocket(g_socket_path, backlog)) < 0) {
         log_error("FCGX_OpenSocket failed: %s", strerror(errno));
         return EX_SOFTWARE;
     }
     chmod(g_socket_path, S_IRWXU | S_IRWXG | S_IRWXO);
 
-    /* Create a thread for request handling */
-    struct request_context* request_context = malloc(sizeof(struct request_context));
-    request_context->callback = request_callback;
-    request_context->parameter = request_callback_parameter;
-    if ((g_thread = g_thread_new("fcgi_server", &handle_fcgi, request_context)) == NULL) {
-        log_error("Failed to launch FCGI server thread");
-        return EX_SOFTWARE;
+    /* Create the worker threads for request handling */
+    g_request_context.callback = request_callback;
+    g_request_context.parameter = request_callback_parameter;
+    g_threads = g_new0(GThread*, MAX(num_workers, 1));
+    for (g_num_threads = 0; g_num_threads < MAX(num_workers, 1); g_num_threads++) {
+        g_autofree char* name = g_strdup_printf("fcgi_worker%u", g_num_threads);
+        GError* error = NULL;
+        if (!(g_threads[g_num_threads] =
+                  g_thread_try_new(name, &handle_fcgi, &g_request_context, &error))) {
+            log_error("Failed to launch FCGI worker thread: %s", error->message);
+            g_clear_error(&error);
+            fcgi_stop();
+            return EX_SOFTWARE;
+        }
     }
 
-    log_debug("Launched FCGI server thread.");
+    log_debug("Launched %u FCGI worker threads.", g_num_threads);
     return EX_OK;
 }
 
@@ -80,11 +105,20 @@ void fcgi_stop(void) {
             log_warning("Could not unlink socket, err: %s", strerror(errno));
         }
     }
-    log_debug("Joining FCGI server thread.");
-    g_thread_join(g_thread);
+
+    // Workers that are busy with a request will finish it before noticing the shutdown, so
+    // joining them drains all requests that were accepted before the socket was shut down.
+    log_debug("Joining %u FCGI worker threads.", g_num_threads);
+    for (unsigned int i = 0; i < g_num_threads; i++)
+        g_thread_join(g_threads[i]);
+    g_free(g_threads);
+
+    if (g_socket != -1)
+        close(g_socket);
 
     g_socket_path = NULL;
     g_socket = -1;
-    g_thread = NULL;
+    g_threads = NULL;
+    g_num_threads = 0;
     log_debug("FCGI server has stopped.");
 }
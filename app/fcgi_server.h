@@ -3,5 +3,14 @@
 
 typedef void (*fcgi_request_callback)(FCGX_Request* request, void* userdata);
 
-int fcgi_start(fcgi_request_callback request_callback, void* request_callback_parameter);
+// Start a pool of num_workers threads, each accepting and handling requests on the shared FCGI
+// socket, so that a slow request does not block the others. The callback may therefore be called
+// from several threads at once. backlog is the listen() queue length of the socket.
+int fcgi_start(fcgi_request_callback request_callback,
+               void* request_callback_parameter,
+               unsigned int num_workers,
+               int backlog);
+
+// Stop accepting new requests, let the workers finish the requests they are handling and join
+// them.
 void fcgi_stop(void);
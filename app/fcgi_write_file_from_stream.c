@@ -1,24 +1,56 @@
 #include "fcgi_write_file_from_stream.h"
-#include "fcgi_server.h"
 #include "log.h"
+#include "multipart_boundary.h"
 #include <unistd.h>
 
-static int request_content_length(const FCGX_Request* request) {
-    const char* content_length_str = FCGX_GetParam("CONTENT_LENGTH", request->envp);
-    if (!content_length_str)
-        return 0;
-    return strtol(content_length_str, NULL, 10);
+#define TEMP_FILE_PREFIX ".fcgi_upload."
+
+// Smallest buffer that is accepted, to leave room for the part headers and a split delimiter.
+#define MIN_BUFFER_SIZE 4096
+
+static bool write_all(int file_des, const char* data, size_t len, const char* filename) {
+    while (len > 0) {
+        const ssize_t written = write(file_des, data, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("Failed to write %zu bytes to %s: %s", len, filename, strerror(errno));
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
 }
 
-char* fcgi_write_file_from_stream(FCGX_Request request) {
+// Read as much as fits in buffer[*used..size). FCGX_GetStr() only returns less than requested when
+// the end of the stream has been reached, which is reported through *eof.
+static bool read_more(FCGX_Request* request, char* buffer, size_t* used, size_t size, bool* eof) {
+    const int to_read = size - *used;
+    const int bytes_read = FCGX_GetStr(buffer + *used, to_read, request->in);
+    if (bytes_read < 0) {
+        log_error("Failed to read from FCGI stream: %s", strerror(errno));
+        return false;
+    }
+    *used += bytes_read;
+    *eof = bytes_read < to_read;
+    return true;
+}
+
+char* fcgi_write_file_from_stream(FCGX_Request request,
+                                  const char* directory,
+                                  size_t buffer_size,
+                                  fcgi_upload_check_t check,
+                                  void* user_data) {
     char* temp_file = NULL;
-    const int content_length = request_content_length(&request);
+    int file_des = -1;
     const char* content_type = FCGX_GetParam("CONTENT_TYPE", request.envp);
 
     log_debug("Content-Type: %s", content_type);
 
     const char* MULTIPART_FORM_DATA = "multipart/form-data";
-    if (strncmp(content_type, MULTIPART_FORM_DATA, sizeof(MULTIPART_FORM_DATA) - 1) != 0) {
+    if (!content_type ||
+        strncmp(content_type, MULTIPART_FORM_DATA, strlen(MULTIPART_FORM_DATA)) != 0) {
         log_error("Content type \"%s\" is not supported. Use \"%s\" instead.",
                   content_type,
                   MULTIPART_FORM_DATA);
@@ -32,136 +64,118 @@ char* fcgi_write_file_from_stream(FCGX_Request request) {
         return NULL;
     }
     boundary_text += strlen(BOUNDARY_KEY);
-    const int boundary_len = strlen(boundary_text);
 
-    temp_file = g_strdup_printf("/tmp/fcgi_upload.XXXXXX");
-    int file_des = mkstemp(temp_file);
-    if (file_des == -1) {
-        log_error("Failed to create %s, err %s.", temp_file, strerror(errno));
+    struct multipart_boundary boundary;
+    if (!multipart_boundary_init(&boundary, boundary_text)) {
+        log_error("Invalid multipart boundary \"%s\".", boundary_text);
         return NULL;
     }
-    log_debug("Opened %s for writing.", temp_file);
 
     bool remove_temp_file = true;  // Clear this to return the filename to the caller.
 
-    const int bufferLen = 2048;
-    char buffer[bufferLen + 1 /* Allow for NULL termination */];
+    buffer_size = MAX(buffer_size, MIN_BUFFER_SIZE);
+    char* buffer = g_malloc(buffer_size + 1 /* Allow for NULL termination */);
+    size_t used = 0;
+    bool eof = false;
 
+    /* Skip the first delimiter line and the part headers, which end with an empty line */
     const char* data_start = "\r\n\r\n";
-    const char* data_end = "\r\n--";
-
-    int total_bytes_processed = 0;
-    bool pre_boundary_found = false;
-    bool post_boundary_found = false;
-
-    int loop_counter = 0;  // First iteration is special.
-    char* p_payload = buffer;
-    char* p_payload_end = NULL;
-
-    while (total_bytes_processed < content_length) {
-        loop_counter++;
-        const int available_len = bufferLen - (p_payload - buffer);
-
-        const int bytes_read = FCGX_GetStr(p_payload, available_len, request.in);
-        log_debug("FCGX_GetStr: bytes_read %d, p_payload %p(%d), available_len %d(%d)",
-                  bytes_read,
-                  p_payload,
-                  (int)(p_payload - buffer),
-                  available_len,
-                  available_len - bufferLen);
-        if (bytes_read < 0) {
-            log_error("Failed to read from FCGI stream: %s", strerror(errno));
-            break;
+    char* p_payload = NULL;
+    while (!p_payload) {
+        if (eof || used == buffer_size) {
+            log_error("Failed to find pre boundary in uploaded data.");
+            goto end;
         }
-
-        /* Look for pre boundary */
-        if (!pre_boundary_found) {
-            buffer[bytes_read] = 0; /* NULL terminate */
-            p_payload = strstr(buffer + boundary_len + 1, data_start);
-            if (p_payload == NULL) {
-                log_error("Failed to find boundary in uploaded data.");
-            }
-            pre_boundary_found = true;
-            p_payload += strlen(data_start);
-        } else {
-            log_debug("Pre boundary already found");
-            p_payload = buffer;
+        if (!read_more(&request, buffer, &used, buffer_size, &eof))
+            goto end;
+        buffer[used] = '\0';
+        p_payload = strstr(buffer, data_start);
+    }
+    p_payload += strlen(data_start);
+    used -= p_payload - buffer;
+    memmove(buffer, p_payload, used);
+
+    // Fill the buffer, so that the check sees as much of the file as possible.
+    if (!eof && !read_more(&request, buffer, &used, buffer_size, &eof))
+        goto end;
+    if (check) {
+        size_t match = 0;
+        size_t safe_len = 0;
+        const bool found = multipart_boundary_find(&boundary, buffer, used, &match, &safe_len);
+        const size_t len = found ? match : safe_len;
+        if (!check(buffer, len, user_data)) {
+            log_error("Rejected the upload from its first %zu bytes", len);
+            goto end;
         }
+    }
 
-        /* Look for post boundary */
-        if (!post_boundary_found) {
-            char* pchar;
-            for (pchar = (loop_counter == 1) ? p_payload : buffer;
-                 pchar < buffer + bytes_read - ((loop_counter == 1) ? boundary_len : 0);
-                 pchar++) {
-                if (memcmp(pchar, boundary_text, boundary_len) == 0) {
-                    log_debug("Post boundary found for %.*s", boundary_len, pchar);
-                    pchar -= strlen(data_end);
-                    if (memcmp(pchar, data_end, strlen(data_end)) != 0) {
-                        log_error("Post boundary data end not found");
-                        log_debug("Found %02x%02x%02x%02x at post boundary",
-                                  pchar[0],
-                                  pchar[1],
-                                  pchar[2],
-                                  pchar[3]);
-                        goto end;
-                    }
-                    post_boundary_found = true;
-                    break;
-                }
-            }
-            p_payload_end = pchar;
-        }
+    temp_file = g_strdup_printf("%s/" TEMP_FILE_PREFIX "XXXXXX", directory);
+    file_des = mkstemp(temp_file);
+    if (file_des == -1) {
+        log_error("Failed to create %s, err %s.", temp_file, strerror(errno));
+        goto end;
+    }
+    log_debug("Opened %s for writing.", temp_file);
 
-        int to_write = p_payload_end - p_payload;
-        int written = 0;
-        while (to_write > 0) {
-            if ((written = write(file_des, p_payload + written, to_write)) < 0) {
-                log_error("Failed to write %d bytes to %s: %s",
-                          to_write,
-                          temp_file,
-                          strerror(errno));
+    /* Write everything up to the post boundary, keeping a possibly split delimiter in buffer */
+    while (true) {
+        size_t match = 0;
+        size_t safe_len = 0;
+        if (multipart_boundary_find(&boundary, buffer, used, &match, &safe_len)) {
+            if (!write_all(file_des, buffer, match, temp_file))
                 goto end;
-            }
-            total_bytes_processed += written;
-            to_write -= written;
-        }
-        log_debug("write: p_payload %p, %d bytes", p_payload, (int)(p_payload_end - p_payload));
-        log_debug("loop %d, bytes_read %d, done %d",
-                  loop_counter,
-                  bytes_read,
-                  total_bytes_processed);
-
-        if (post_boundary_found) {
-            total_bytes_processed = content_length;
             remove_temp_file = false;  // File has been successfully received.
-        } else {
-            if (!pre_boundary_found) {
-                log_error("No pre boundary found");
-                goto end;
-            }
-            if (bytes_read != available_len) {
-                log_error("No post boundary found");
-                goto end;
-            }
-
-            /* Post boundary may have been partial at payload end. Ensure possible rematch */
-            p_payload = buffer + boundary_len;
-            memcpy(buffer, p_payload_end, boundary_len);
+            break;
+        }
+        if (!write_all(file_des, buffer, safe_len, temp_file))
+            goto end;
+        used -= safe_len;
+        memmove(buffer, buffer + safe_len, used);
+
+        if (eof) {
+            log_error("No post boundary found");
+            goto end;
         }
+        if (!read_more(&request, buffer, &used, buffer_size, &eof))
+            goto end;
+    }
+
+    // The caller will rename the file into place, so make sure the data is on disk before that.
+    if (fsync(file_des) != 0) {
+        log_error("Failed to sync %s: %s", temp_file, strerror(errno));
+        remove_temp_file = true;
     }
 
 end:
+    g_free(buffer);
+    multipart_boundary_free(&boundary);
     if (file_des != -1) {
         log_debug("Closing %s after writing %ld bytes.", temp_file, lseek(file_des, 0, SEEK_CUR));
         if (close(file_des) == -1)
             log_warning("Failed to close %s: %s", temp_file, strerror(errno));
     }
-    if (remove_temp_file && temp_file) {
-        if (unlink(temp_file) != 0)
+    if (remove_temp_file) {
+        if (file_des != -1 && unlink(temp_file) != 0)
             log_error("Failed to remove %s: %s", temp_file, strerror(errno));
         g_free(temp_file);
         temp_file = NULL;
     }
     return temp_file;
 }
+
+void fcgi_remove_stale_uploads(const char* directory) {
+    GDir* dir = g_dir_open(directory, 0, NULL);
+    if (!dir)
+        return;
+    const char* name;
+    while ((name = g_dir_read_name(dir))) {
+        if (!g_str_has_prefix(name, TEMP_FILE_PREFIX))
+            continue;
+        g_autofree char* path = g_build_filename(directory, name, NULL);
+        if (unlink(path) == 0)
+            log_info("Removed %s, left behind by an interrupted upload", path);
+        else
+            log_warning("Failed to remove %s: %s", path, strerror(errno));
+    }
+    g_dir_close(dir);
+}
@@ -1,7 +1,25 @@
 #pragma once
 #include <fcgiapp.h>
+#include <stddef.h>
 
-// Given a request with multipart/form-data, store incoming data in a file on /tmp. On success,
-// return the filename and let the caller do all cleanup. On failure, log the error, clean up the
-// file and return NULL.
-char* fcgi_write_file_from_stream(FCGX_Request request);
+#include <stdbool.h>
+
+// Return whether the first len bytes of the uploaded file, or all of it if it is shorter than the
+// buffer, can be the start of an acceptable file.
+typedef bool (*fcgi_upload_check_t)(const char* data, size_t len, void* user_data);
+
+// Given a request with multipart/form-data, store incoming data in a temporary file in directory
+// and sync it to disk. Placing the file on the same file system as its final destination lets the
+// caller publish it with rename() instead of copying it. The stream is read buffer_size bytes at a
+// time. If check is not NULL, it is given the first buffer of the file before the temporary file
+// is created, so that an upload that it rejects is never written. On success, return the filename
+// and let the caller do all cleanup. On failure, log the error, clean up the file and return NULL.
+char* fcgi_write_file_from_stream(FCGX_Request request,
+                                  const char* directory,
+                                  size_t buffer_size,
+                                  fcgi_upload_check_t check,
+                                  void* user_data);
+
+// Remove the temporary files that uploads to directory left behind when the application crashed or
+// was stopped during an upload. Call before any upload can be in progress.
+void fcgi_remove_stale_uploads(const char* directory);
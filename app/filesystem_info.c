@@ -0,0 +1,127 @@
+#define _GNU_SOURCE  // For ST_NOATIME, ST_RELATIME and ST_SYNCHRONOUS
+#include "filesystem_info.h"
+#include "log.h"
+#include <errno.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+
+static const struct {
+    unsigned long magic;
+    const char* type;
+} known_types[] = {
+    {0xEF53, "ext4"},  // Also ext2 and ext3
+    {0x4d44, "vfat"},
+    {0x2011BAB0, "exfat"},
+    {0x58465342, "xfs"},
+    {0x9123683E, "btrfs"},
+    {0xF2F52010, "f2fs"},
+    {0x24051905, "ubifs"},
+    {0x01021994, "tmpfs"},
+    {0x794c7630, "overlay"},
+};
+
+static GHashTable* cache;  // dev_t -> struct filesystem_info
+
+static const char* type_of_magic(unsigned long magic) {
+    for (size_t i = 0; i < G_N_ELEMENTS(known_types); ++i)
+        if (known_types[i].magic == magic)
+            return known_types[i].type;
+    return NULL;
+}
+
+// Find the type name of the file system on the device in /proc/self/mountinfo, where each line is
+// "<id> <parent id> <major>:<minor> <root> <mount point> <options> [<tags>...] - <type> ...".
+static bool type_from_mountinfo(dev_t dev, char* type, size_t type_size) {
+    FILE* fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) {
+        log_error("Failed to open /proc/self/mountinfo: %s", strerror(errno));
+        return false;
+    }
+
+    bool found = false;
+    char* line = NULL;
+    size_t line_size = 0;
+    while (!found && getline(&line, &line_size, fp) != -1) {
+        unsigned int major_number;
+        unsigned int minor_number;
+        if (sscanf(line, "%*u %*u %u:%u", &major_number, &minor_number) != 2 ||
+            makedev(major_number, minor_number) != dev)
+            continue;
+        const char* separator = strstr(line, " - ");
+        if (!separator)
+            continue;
+        const size_t length = strcspn(separator + 3, " \n");
+        if (length == 0 || length >= type_size)
+            continue;
+        memcpy(type, separator + 3, length);
+        type[length] = '\0';
+        found = true;
+    }
+    free(line);
+    fclose(fp);
+    return found;
+}
+
+bool filesystem_info_of_path(const char* path, struct filesystem_info* info) {
+    struct stat path_stat;
+    if (stat(path, &path_stat) != 0) {
+        log_error("Cannot identify the file system of %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    if (!cache)
+        cache = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+    const gint64 key = path_stat.st_dev;
+    const struct filesystem_info* cached = g_hash_table_lookup(cache, &key);
+    if (cached) {
+        *info = *cached;
+        return true;
+    }
+
+    struct statfs fs_stat;
+    if (statfs(path, &fs_stat) != 0) {
+        log_error("Cannot identify the file system of %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    struct filesystem_info result = {0};
+    const unsigned long magic = fs_stat.f_type;
+    const char* type = type_of_magic(magic);
+    if (type)
+        g_strlcpy(result.type, type, sizeof(result.type));
+    else if (!type_from_mountinfo(path_stat.st_dev, result.type, sizeof(result.type))) {
+        log_error("Unknown file system with magic number 0x%lx at %s", magic, path);
+        return false;
+    }
+    result.read_only = fs_stat.f_flags & ST_RDONLY;
+    result.noatime = fs_stat.f_flags & ST_NOATIME;
+    result.relatime = fs_stat.f_flags & ST_RELATIME;
+    result.sync = fs_stat.f_flags & ST_SYNCHRONOUS;
+
+    gint64* cache_key = g_new(gint64, 1);
+    *cache_key = key;
+    struct filesystem_info* cache_value = g_new(struct filesystem_info, 1);
+    *cache_value = result;
+    g_hash_table_insert(cache, cache_key, cache_value);
+    *info = result;
+    return true;
+}
+
+void filesystem_info_invalidate(void) {
+    if (cache)
+        g_hash_table_remove_all(cache);
+}
+
+char* filesystem_info_options(const struct filesystem_info* info) {
+    return g_strdup_printf("%s%s%s%s",
+                           info->read_only ? "ro" : "rw",
+                           info->noatime ? ",noatime" : "",
+                           info->relatime ? ",relatime" : "",
+                           info->sync ? ",sync" : "");
+}
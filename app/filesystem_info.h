@@ -0,0 +1,25 @@
+#pragma once
+#include <stdbool.h>
+
+// Identify the file system that holds a path without scanning the mount table. statfs() gives the
+// file system magic number and the mount flags in one system call. Only when the magic number is
+// unknown is /proc/self/mountinfo searched, by the major:minor of the device, for the type name.
+// Results are cached per device until filesystem_info_invalidate() is called. Not thread safe.
+
+struct filesystem_info {
+    char type[32];  // "ext4", "vfat", ...
+    bool read_only;
+    bool noatime;   // Reads do not update the access time
+    bool relatime;  // Reads only update the access time now and then
+    bool sync;      // All writes are synchronous
+};
+
+// Return false and log an error if the path does not exist or its file system cannot be
+// identified. ext2, ext3 and ext4 share a magic number, and are all reported as "ext4".
+bool filesystem_info_of_path(const char* path, struct filesystem_info* info);
+
+// Forget all cached results. Call when storage has been mounted or unmounted.
+void filesystem_info_invalidate(void);
+
+// Return the mount flags as a comma separated string, such as "rw,noatime". Free with g_free().
+char* filesystem_info_options(const struct filesystem_info* info);
@@ -0,0 +1,169 @@
+#include "health_monitor.h"
+#include "docker_api.h"
+#include "histogram.h"
+#include "log.h"
+#include <gio/gio.h>
+
+struct health_monitor {
+    struct health_monitor_policy policy;
+    health_hang_t hang;
+    void* user_data;
+
+    // Only used from the main loop
+    GSource* timer;             // Pending probe, or NULL
+    GCancellable* cancellable;  // Cancelled by stop, so that a running probe's result is ignored
+    guint probe_number;         // Number of probes since start
+    guint consecutive_failures;
+
+    GMutex mutex;  // Protects the members below
+    struct histogram ping_latency;
+    struct histogram info_latency;
+    guint64 probes;
+    guint64 failures;
+    guint64 hangs;
+};
+
+// Owned by the task, and only refers to the monitor while the task has not been cancelled, since
+// the monitor may have been freed by then.
+struct probe {
+    struct health_monitor* monitor;
+    int timeout_ms;
+    bool with_info;
+    gint64 ping_us;  // -1 if the request failed
+    gint64 info_us;  // -1 if the request failed or was not sent
+};
+
+// Send a request and return its latency, or -1 if it failed.
+static gint64 timed_request(const char* path, int timeout_ms) {
+    const gint64 start = g_get_monotonic_time();
+    int status_code = 0;
+    g_autofree char* body = docker_api_request("GET", path, timeout_ms, &status_code);
+    if (!body || status_code != 200) {
+        log_warning("GET %s failed after %" G_GINT64_FORMAT " ms (status %d)",
+                    path,
+                    (g_get_monotonic_time() - start) / 1000,
+                    status_code);
+        return -1;
+    }
+    return g_get_monotonic_time() - start;
+}
+
+static void probe_thread(GTask* task, gpointer, gpointer probe_void_ptr, GCancellable*) {
+    struct probe* probe = probe_void_ptr;
+    const int timeout_ms = probe->timeout_ms;
+    probe->ping_us = timed_request("/_ping", timeout_ms);
+    probe->info_us = probe->ping_us >= 0 && probe->with_info ? timed_request("/info", timeout_ms)
+                                                             : -1;
+    g_task_return_boolean(task, true);
+}
+
+static gboolean start_probe(void* monitor_void_ptr);
+
+static void schedule_probe(struct health_monitor* monitor) {
+    monitor->timer = g_timeout_source_new(monitor->policy.interval_ms);
+    g_source_set_callback(monitor->timer, start_probe, monitor, NULL);
+    g_source_attach(monitor->timer, NULL);
+}
+
+static void probe_done(GObject*, GAsyncResult* result, gpointer probe_void_ptr) {
+    if (g_cancellable_is_cancelled(g_task_get_cancellable(G_TASK(result))))
+        return;  // Monitoring has been stopped or restarted since the probe was started.
+    struct probe* probe = probe_void_ptr;
+    struct health_monitor* monitor = probe->monitor;
+
+    const bool failed = probe->ping_us < 0 || (probe->with_info && probe->info_us < 0);
+    g_mutex_lock(&monitor->mutex);
+    monitor->probes++;
+    if (probe->ping_us >= 0)
+        histogram_add(&monitor->ping_latency, probe->ping_us);
+    if (probe->info_us >= 0)
+        histogram_add(&monitor->info_latency, probe->info_us);
+    if (failed)
+        monitor->failures++;
+    g_mutex_unlock(&monitor->mutex);
+
+    monitor->consecutive_failures = failed ? monitor->consecutive_failures + 1 : 0;
+    if (monitor->consecutive_failures < monitor->policy.hang_threshold) {
+        schedule_probe(monitor);
+        return;
+    }
+
+    log_error("dockerd has not answered %u health probes in a row", monitor->consecutive_failures);
+    g_mutex_lock(&monitor->mutex);
+    monitor->hangs++;
+    g_mutex_unlock(&monitor->mutex);
+    health_monitor_stop(monitor);
+    monitor->hang(monitor->user_data);
+}
+
+static gboolean start_probe(void* monitor_void_ptr) {
+    struct health_monitor* monitor = monitor_void_ptr;
+    g_clear_pointer(&monitor->timer, g_source_unref);
+
+    struct probe* probe = g_new0(struct probe, 1);
+    probe->monitor = monitor;
+    probe->timeout_ms = monitor->policy.timeout_ms;
+    probe->with_info = monitor->probe_number++ % monitor->policy.info_interval == 0;
+
+    GTask* task = g_task_new(NULL, monitor->cancellable, probe_done, probe);
+    g_task_set_task_data(task, probe, g_free);
+    g_task_run_in_thread(task, probe_thread);
+    g_object_unref(task);
+    return G_SOURCE_REMOVE;
+}
+
+struct health_monitor* health_monitor_new(const struct health_monitor_policy* policy,
+                                          health_hang_t hang,
+                                          void* user_data) {
+    struct health_monitor* monitor = g_malloc0(sizeof(struct health_monitor));
+    monitor->policy = *policy;
+    monitor->policy.info_interval = MAX(policy->info_interval, 1);
+    monitor->hang = hang;
+    monitor->user_data = user_data;
+    g_mutex_init(&monitor->mutex);
+    return monitor;
+}
+
+void health_monitor_free(struct health_monitor* monitor) {
+    if (!monitor)
+        return;
+    health_monitor_stop(monitor);
+    g_mutex_clear(&monitor->mutex);
+    g_free(monitor);
+}
+
+void health_monitor_start(struct health_monitor* monitor) {
+    health_monitor_stop(monitor);
+    monitor->cancellable = g_cancellable_new();
+    monitor->probe_number = 0;
+    monitor->consecutive_failures = 0;
+    schedule_probe(monitor);
+}
+
+void health_monitor_stop(struct health_monitor* monitor) {
+    if (monitor->cancellable) {
+        g_cancellable_cancel(monitor->cancellable);
+        g_clear_object(&monitor->cancellable);
+    }
+    if (monitor->timer) {
+        g_source_destroy(monitor->timer);
+        g_clear_pointer(&monitor->timer, g_source_unref);
+    }
+}
+
+json_t* health_monitor_json(struct health_monitor* monitor) {
+    g_mutex_lock(&monitor->mutex);
+    json_t* json = json_pack("{s:o, s:o, s:I, s:I, s:I}",
+                             "ping_latency",
+                             histogram_json(&monitor->ping_latency),
+                             "info_latency",
+                             histogram_json(&monitor->info_latency),
+                             "probes",
+                             (json_int_t)monitor->probes,
+                             "failures",
+                             (json_int_t)monitor->failures,
+                             "hangs",
+                             (json_int_t)monitor->hangs);
+    g_mutex_unlock(&monitor->mutex);
+    return json;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <glib.h>
+#include <jansson.h>
+
+// Periodically checks that a running dockerd answers requests, by sending GET /_ping, and now and
+// then the more demanding GET /info, from a worker thread. The latencies are collected in
+// histograms. If hang_threshold probes in a row fail or time out, dockerd is considered hung.
+
+struct health_monitor_policy {
+    guint interval_ms;     // Time between the end of a probe and the start of the next
+    guint timeout_ms;      // Time after which a request counts as failed
+    guint info_interval;   // Every info_interval probe also sends GET /info
+    guint hang_threshold;  // Number of failed probes in a row that means that dockerd is hung
+};
+
+// Called from the main loop when dockerd is considered hung. Monitoring has then been stopped.
+typedef void (*health_hang_t)(void* user_data);
+
+struct health_monitor* health_monitor_new(const struct health_monitor_policy* policy,
+                                          health_hang_t hang,
+                                          void* user_data);
+void health_monitor_free(struct health_monitor* monitor);
+
+// Start monitoring dockerd, which must be ready. Restarts monitoring if it is running.
+void health_monitor_start(struct health_monitor* monitor);
+
+// Stop monitoring, before dockerd is stopped or when it has exited. The result of a probe that is
+// running is discarded.
+void health_monitor_stop(struct health_monitor* monitor);
+
+// Return the histograms and counters as a JSON object. May be called from any thread.
+json_t* health_monitor_json(struct health_monitor* monitor);
@@ -0,0 +1,33 @@
+#include "histogram.h"
+
+static guint bucket_index(gint64 value_us) {
+    guint index = 0;
+    while (index < HISTOGRAM_BUCKETS - 1 && value_us > (G_TIME_SPAN_MILLISECOND << index))
+        index++;
+    return index;
+}
+
+void histogram_add(struct histogram* histogram, gint64 value_us) {
+    histogram->buckets[bucket_index(value_us)]++;
+    histogram->count++;
+    histogram->sum_us += value_us;
+    histogram->max_us = MAX(histogram->max_us, value_us);
+}
+
+json_t* histogram_json(const struct histogram* histogram) {
+    json_t* buckets = json_object();
+    for (guint i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        g_autofree char* le = i < HISTOGRAM_BUCKETS - 1 ? g_strdup_printf("%u", 1u << i)
+                                                        : g_strdup("+Inf");
+        json_object_set_new(buckets, le, json_integer(histogram->buckets[i]));
+    }
+    return json_pack("{s:I, s:f, s:f, s:o}",
+                     "count",
+                     (json_int_t)histogram->count,
+                     "sum_ms",
+                     histogram->sum_us / 1e3,
+                     "max_ms",
+                     histogram->max_us / 1e3,
+                     "buckets_ms",
+                     buckets);
+}
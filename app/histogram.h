@@ -0,0 +1,20 @@
+#pragma once
+#include <glib.h>
+#include <jansson.h>
+
+// Latency histogram with power-of-two buckets. Bucket i counts values of at most 2^i ms, and the
+// last bucket counts all slower values. Not thread safe.
+
+#define HISTOGRAM_BUCKETS 16
+
+struct histogram {
+    guint64 buckets[HISTOGRAM_BUCKETS];
+    guint64 count;
+    gint64 sum_us;
+    gint64 max_us;
+};
+
+void histogram_add(struct histogram* histogram, gint64 value_us);
+
+// Return the histogram as a JSON object, where the buckets are keyed by their upper bound in ms.
+json_t* histogram_json(const struct histogram* histogram);
@@ -1,10 +1,15 @@
 #include "http_request.h"
 #include "app_paths.h"
 #include "fcgi_write_file_from_stream.h"
+#include "image_load.h"
 #include "log.h"
+#include "metrics.h"
 #include "tls.h"
-#include <gio/gio.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <jansson.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #define HTTP_200_OK                    "200 OK"
 #define HTTP_204_NO_CONTENT            "204 No Content"
@@ -13,27 +18,40 @@
 #define HTTP_405_METHOD_NOT_ALLOWED    "405 Method Not Allowed"
 #define HTTP_422_UNPROCESSABLE_CONTENT "422 Unprocessable Content"
 #define HTTP_500_INTERNAL_SERVER_ERROR "500 Internal Server Error"
+#define HTTP_503_SERVICE_UNAVAILABLE   "503 Service Unavailable"
+
+// Route that streams an image archive into dockerd, as opposed to the TLS file routes.
+#define IMAGES_ROUTE "images"
+
+// Route that serves metrics in the Prometheus text exposition format.
+#define METRICS_ROUTE        "metrics"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+// Size of the buffer used when receiving uploaded files.
+#define UPLOAD_BUFFER_SIZE (64 * 1024)
 
 static char* localdata_full_path(const char* filename) {
     return g_strdup_printf("%s/%s", APP_LOCALDATA, filename);
 }
 
-static bool copy_to_localdata(const char* source_path, const char* destination_filename) {
+// Atomically replace destination_filename in localdata with source_path, which must reside in
+// localdata as well. Sync the directory so that the rename survives a power loss.
+static bool move_to_localdata(const char* source_path, const char* destination_filename) {
     g_autofree char* full_path = localdata_full_path(destination_filename);
-    log_debug("Copying %s to %s.", source_path, full_path);
+    log_debug("Moving %s to %s.", source_path, full_path);
 
-    GFile* source = g_file_new_for_path(source_path);
-    GFile* destination = g_file_new_for_path(full_path);
-    GError* error = NULL;
-    bool success =
-        g_file_copy(source, destination, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error);
-    if (!success)
-        log_error("Failed to copy %s to %s: %s.", source_path, full_path, error->message);
-    g_object_unref(source);
-    g_object_unref(destination);
-    g_clear_error(&error);
+    if (rename(source_path, full_path) != 0) {
+        log_error("Failed to move %s to %s: %s.", source_path, full_path, strerror(errno));
+        return false;
+    }
 
-    return success;
+    int dir_fd = open(APP_LOCALDATA, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1 || fsync(dir_fd) != 0)
+        // The file is in place, so this is not reported as a failure.
+        log_warning("Failed to sync %s: %s.", APP_LOCALDATA, strerror(errno));
+    if (dir_fd != -1)
+        close(dir_fd);
+    return true;
 }
 
 static bool exists_in_localdata(const char* filename) {
@@ -75,23 +93,133 @@ static void response_msg(FCGX_Request* request, const char* status, const char*
     response(request, status, "text/plain", body);
 }
 
+static void response_json(FCGX_Request* request, const char* status, json_t* json) {
+    g_autofree char* body = json_dumps(json, JSON_COMPACT);
+    log_debug("Send response %s: %s", status, body);
+    response(request, status, "application/json", body);
+}
+
+// Return the value of CONTENT_LENGTH, or -1 if the request has no such header, which is the case
+// when the client used chunked transfer encoding.
+static gint64 request_content_length(const FCGX_Request* request) {
+    const char* content_length_str = FCGX_GetParam("CONTENT_LENGTH", request->envp);
+    if (!content_length_str || !*content_length_str)
+        return -1;
+    return g_ascii_strtoll(content_length_str, NULL, 10);
+}
+
+struct request_body {
+    FCGX_Request* request;
+    gint64 remaining;  // -1 if unknown
+};
+
+static ssize_t read_request_body(void* request_body_void_ptr, char* buffer, size_t len) {
+    struct request_body* body = request_body_void_ptr;
+    if (body->remaining == 0)
+        return 0;
+    if (body->remaining > 0)
+        len = MIN((gint64)len, body->remaining);
+
+    const int bytes_read = FCGX_GetStr(buffer, len, body->request->in);
+    if (bytes_read < 0) {
+        log_error("Failed to read from FCGI stream: %s", strerror(errno));
+        return -1;
+    }
+    if (body->remaining > 0) {
+        if (bytes_read == 0) {
+            log_error("Request body ended %" G_GINT64_FORMAT " bytes early", body->remaining);
+            return -1;
+        }
+        body->remaining -= bytes_read;
+    }
+    return bytes_read;
+}
+
+static void post_image_request(FCGX_Request* request) {
+    struct request_body body = {request, request_content_length(request)};
+    struct image_load_result result;
+    const bool loaded = image_load(read_request_body, NULL, &body, &result);
+    if (loaded || result.error) {
+        metrics_observe(METRICS_UPLOAD_BYTES, result.bytes);
+        metrics_observe(METRICS_UPLOAD_DURATION, result.duration_us);
+    }
+
+    if (!loaded && !result.error) {
+        response_msg(request, HTTP_503_SERVICE_UNAVAILABLE, "Failed to deliver image to dockerd.");
+    } else {
+        const double seconds = result.duration_us / 1e6;
+        json_t* images = json_array();
+        for (guint i = 0; i < result.messages->len; i++)
+            json_array_append_new(images, json_string(g_ptr_array_index(result.messages, i)));
+        json_t* json = json_pack("{s:I, s:f, s:f, s:o}",
+                                 "bytes",
+                                 (json_int_t)result.bytes,
+                                 "seconds",
+                                 seconds,
+                                 "bytes_per_second",
+                                 seconds > 0 ? result.bytes / seconds : 0.0,
+                                 "images",
+                                 images);
+        if (result.error)
+            json_object_set_new(json, "error", json_string(result.error));
+        response_json(request, loaded ? HTTP_200_OK : HTTP_422_UNPROCESSABLE_CONTENT, json);
+        json_decref(json);
+    }
+    image_load_result_clear(&result);
+}
+
+struct upload_check {
+    const char* filename;
+    bool rejected;
+};
+
+// Meant to be used as a fcgi_write_file_from_stream() check
+static bool tls_upload_starts_correctly(const char* data, size_t len, void* check_void_ptr) {
+    struct upload_check* check = check_void_ptr;
+    check->rejected = !tls_file_starts_correctly(check->filename, data, len);
+    return !check->rejected;
+}
+
 static void post_request(FCGX_Request* request,
                          const char* filename,
-                         struct restart_dockerd_context* restart_dockerd_context) {
-    g_autofree char* temp_file = fcgi_write_file_from_stream(*request);
+                         struct http_request_context* context) {
+    // Unknown files and files without the right header are rejected before anything is written.
+    if (!tls_file_description(filename)) {
+        log_error("Rejected an upload of %s, which is not a TLS file", filename);
+        response_msg(request, HTTP_404_NOT_FOUND, "No such file can be uploaded");
+        return;
+    }
+    const gint64 start = g_get_monotonic_time();
+    struct upload_check check = {filename, false};
+    g_autofree char* temp_file = fcgi_write_file_from_stream(*request,
+                                                             APP_LOCALDATA,
+                                                             UPLOAD_BUFFER_SIZE,
+                                                             tls_upload_starts_correctly,
+                                                             &check);
+    if (!temp_file && check.rejected) {
+        g_autofree char* msg =
+            g_strdup_printf("File is not a valid %s.", tls_file_description(filename));
+        response_msg(request, HTTP_400_BAD_REQUEST, msg);
+        return;
+    }
     if (!temp_file) {
         response_msg(request, HTTP_422_UNPROCESSABLE_CONTENT, "Upload to temporary file failed.");
         return;
     }
+    struct stat temp_file_stat;
+    if (stat(temp_file, &temp_file_stat) == 0)
+        metrics_observe(METRICS_UPLOAD_BYTES, temp_file_stat.st_size);
+    metrics_observe(METRICS_UPLOAD_DURATION, g_get_monotonic_time() - start);
     if (!tls_file_has_correct_format(filename, temp_file)) {
         g_autofree char* msg =
             g_strdup_printf("File is not a valid %s.", tls_file_description(filename));
         response_msg(request, HTTP_400_BAD_REQUEST, msg);
-    } else if (!copy_to_localdata(temp_file, filename))
-        response_msg(request, HTTP_500_INTERNAL_SERVER_ERROR, "Failed to copy file to localdata");
+    } else if (!move_to_localdata(temp_file, filename))
+        response_msg(request, HTTP_500_INTERNAL_SERVER_ERROR, "Failed to move file to localdata");
     else {
         response_204_no_content(request);
-        restart_dockerd_context->restart_dockerd(restart_dockerd_context->app_state);
+        context->restart_dockerd(context->app_state);
+        return;  // The temporary file is now the destination file.
     }
 
     if (unlink(temp_file) != 0)
@@ -109,6 +237,25 @@ static void delete_request(FCGX_Request* request, const char* filename) {
         response_204_no_content(request);
 }
 
+static void get_request(FCGX_Request* request,
+                        const char* filename,
+                        const struct http_request_context* context) {
+    if (strcmp(filename, METRICS_ROUTE) == 0) {
+        g_autofree char* text = metrics_text();
+        log_debug("Send response %s: %zu bytes of metrics", HTTP_200_OK, strlen(text));
+        response(request, HTTP_200_OK, METRICS_CONTENT_TYPE, text);
+        return;
+    }
+    for (const struct json_route* route = context->json_routes; route->name; route++)
+        if (strcmp(route->name, filename) == 0) {
+            json_t* json = route->report(context->app_state);
+            response_json(request, HTTP_200_OK, json);
+            json_decref(json);
+            return;
+        }
+    response_msg(request, HTTP_404_NOT_FOUND, "No such report");
+}
+
 static void unsupported_request(FCGX_Request* request, const char* method, const char* filename) {
     log_error("Unsupported request %s %s", method, filename);
     response_msg(request, HTTP_405_METHOD_NOT_ALLOWED, "Unsupported request method");
@@ -119,24 +266,58 @@ static void malformed_request(FCGX_Request* request, const char* method, const c
     response_msg(request, HTTP_400_BAD_REQUEST, "Malformed request");
 }
 
-void http_request_callback(FCGX_Request* request, void* restart_dockerd_context_void_ptr) {
+static enum metrics_method method_of(const char* method) {
+    if (strcmp(method, "GET") == 0)
+        return METRICS_METHOD_GET;
+    if (strcmp(method, "POST") == 0)
+        return METRICS_METHOD_POST;
+    if (strcmp(method, "DELETE") == 0)
+        return METRICS_METHOD_DELETE;
+    return METRICS_METHOD_OTHER;
+}
+
+// Group the routes, so that a client requesting arbitrary URIs cannot add metrics.
+static enum metrics_route route_of(const char* filename,
+                                   const struct http_request_context* context) {
+    if (strcmp(filename, IMAGES_ROUTE) == 0)
+        return METRICS_ROUTE_IMAGES;
+    if (tls_file_description(filename))
+        return METRICS_ROUTE_TLS;
+    if (strcmp(filename, METRICS_ROUTE) == 0)
+        return METRICS_ROUTE_REPORT;
+    for (const struct json_route* route = context->json_routes; route->name; route++)
+        if (strcmp(route->name, filename) == 0)
+            return METRICS_ROUTE_REPORT;
+    return METRICS_ROUTE_OTHER;
+}
+
+void http_request_callback(FCGX_Request* request, void* http_request_context_void_ptr) {
+    struct http_request_context* context = http_request_context_void_ptr;
+    const gint64 start = g_get_monotonic_time();
     const char* method = FCGX_GetParam("REQUEST_METHOD", request->envp);
     const char* uri = FCGX_GetParam("REQUEST_URI", request->envp);
 
     log_info("Processing HTTP request %s %s", method, uri);
 
     const char* filename = strrchr(uri, '/');
+    enum metrics_route route = METRICS_ROUTE_OTHER;
     if (!filename) {
         malformed_request(request, method, uri);
     } else {
         filename++;  // Strip leading '/'
+        route = route_of(filename, context);
 
-        if (strcmp(method, "POST") == 0)
-            post_request(request, filename, restart_dockerd_context_void_ptr);
+        if (strcmp(method, "POST") == 0 && strcmp(filename, IMAGES_ROUTE) == 0)
+            post_image_request(request);
+        else if (strcmp(method, "POST") == 0)
+            post_request(request, filename, context);
+        else if (strcmp(method, "GET") == 0)
+            get_request(request, filename, context);
         else if (strcmp(method, "DELETE") == 0)
             delete_request(request, filename);
         else
             unsupported_request(request, method, filename);
     }
     FCGX_Finish_r(request);
+    metrics_observe_request(method_of(method), route, g_get_monotonic_time() - start);
 }
@@ -1,14 +1,25 @@
 #pragma once
 #include <fcgiapp.h>
+#include <jansson.h>
 
 struct app_state;
 
 typedef void (*restart_dockerd_t)(struct app_state*);
 
-struct restart_dockerd_context {
+// Return a new JSON document to be served by a read-only GET route. Called from an FCGI worker
+// thread.
+typedef json_t* (*json_report_t)(struct app_state*);
+
+struct json_route {
+    const char* name;  // Last component of the request URI
+    json_report_t report;
+};
+
+struct http_request_context {
     restart_dockerd_t restart_dockerd;
     struct app_state* app_state;
+    const struct json_route* json_routes;  // Terminated by an entry whose name is NULL
 };
 
-// Callback function called from a thread by the FCGI server
-void http_request_callback(FCGX_Request* request, void* restart_dockerd_context_void_ptr);
+// Callback function called by the FCGI server, possibly from several worker threads at once
+void http_request_callback(FCGX_Request* request, void* http_request_context_void_ptr);
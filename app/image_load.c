@@ -0,0 +1,94 @@
+#include "image_load.h"
+#include "docker_api.h"
+#include "log.h"
+#include <errno.h>
+#include <jansson.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE (64 * 1024)
+// A load is given up if dockerd neither reads nor responds for this long, so that a stuck dockerd
+// cannot hold on to the caller for good. Importing the layers of a large image without sending
+// anything takes well below this.
+#define INACTIVITY_TIMEOUT_MS (5 * 60 * 1000)
+
+static bool send_archive(int fd, image_load_read_t read, void* source, guint64* bytes) {
+    g_autofree char* buffer = g_malloc(CHUNK_SIZE);
+    ssize_t bytes_read;
+    while ((bytes_read = read(source, buffer, CHUNK_SIZE)) > 0) {
+        if (!docker_api_send_chunk(fd, buffer, bytes_read))
+            return false;
+        *bytes += bytes_read;
+    }
+    if (bytes_read < 0)
+        return false;
+    return docker_api_send_chunk(fd, NULL, 0);
+}
+
+// dockerd reports progress as a stream of JSON objects, one per line, such as
+// {"stream":"Loaded image: hello-world:latest\n"} or {"errorDetail":{...},"error":"..."}.
+static void parse_load_output(const char* output, struct image_load_result* result) {
+    g_auto(GStrv) lines = g_strsplit(output, "\n", -1);
+    for (char** line = lines; *line; line++) {
+        if (!**line)
+            continue;
+        json_t* json = json_loads(*line, 0, NULL);
+        const char* stream = json_string_value(json_object_get(json, "stream"));
+        const char* error = json_string_value(json_object_get(json, "error"));
+        const char* message = json_string_value(json_object_get(json, "message"));
+        if (stream)
+            g_ptr_array_add(result->messages, g_strchomp(g_strdup(stream)));
+        if ((error || message) && !result->error)
+            result->error = g_strdup(error ? error : message);
+        json_decref(json);
+    }
+}
+
+bool image_load(image_load_read_t read,
+                image_load_connected_t connected,
+                void* source,
+                struct image_load_result* result) {
+    *result = (struct image_load_result){.messages = g_ptr_array_new_with_free_func(g_free)};
+    const gint64 start = g_get_monotonic_time();
+
+    int fd = docker_api_connect(INACTIVITY_TIMEOUT_MS);
+    if (fd == -1) {
+        log_error("Cannot load image, dockerd is not available");
+        return false;
+    }
+    if (connected)
+        connected(source, fd);
+
+    bool success = false;
+    int status_code = 0;
+    g_autofree char* output = NULL;
+    if (!docker_api_send_request(fd, "POST", "/images/load?quiet=1", "application/x-tar", true) ||
+        !send_archive(fd, read, source, &result->bytes) ||
+        !(output = docker_api_read_response(fd, &status_code))) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            result->error = g_strdup_printf("dockerd did not respond for %d s",
+                                            INACTIVITY_TIMEOUT_MS / 1000);
+        goto end;
+    }
+
+    parse_load_output(output, result);
+    if (status_code != 200 && !result->error)
+        result->error = g_strdup_printf("dockerd responded with status %d", status_code);
+    success = !result->error;
+
+end:
+    if (connected)
+        connected(source, -1);
+    close(fd);
+    result->duration_us = g_get_monotonic_time() - start;
+    log_info("Loaded %" G_GUINT64_FORMAT " bytes of image data in %.1f s%s%s",
+             result->bytes,
+             result->duration_us / 1e6,
+             result->error ? ": " : "",
+             result->error ? result->error : "");
+    return success;
+}
+
+void image_load_result_clear(struct image_load_result* result) {
+    g_clear_pointer(&result->error, g_free);
+    g_clear_pointer(&result->messages, g_ptr_array_unref);
+}
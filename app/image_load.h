@@ -0,0 +1,32 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Read up to len bytes of an image archive into buffer. Return the number of bytes read, zero at
+// the end of the archive, or -1 on error.
+typedef ssize_t (*image_load_read_t)(void* source, char* buffer, size_t len);
+
+// Called with the socket to dockerd once it is connected, and with -1 right before it is closed,
+// so that the load can be aborted from another thread by shutting the socket down.
+typedef void (*image_load_connected_t)(void* source, int fd);
+
+struct image_load_result {
+    guint64 bytes;
+    gint64 duration_us;
+    char* error;          // Error reported by dockerd, a timeout, or NULL.
+    GPtrArray* messages;  // Progress messages reported by dockerd, such as "Loaded image: ...".
+};
+
+// Stream an image archive, as created by 'docker save', into dockerd's /images/load endpoint
+// without storing it in a file. The archive is sent in chunks as it is read, so a slow consumer
+// slows down the reader rather than causing data to be buffered. Return false if the archive could
+// not be delivered to dockerd. Also return false, with result->error set, if dockerd failed to
+// load it or stopped responding for several minutes. connected may be NULL. Free the result with
+// image_load_result_clear().
+bool image_load(image_load_read_t read,
+                image_load_connected_t connected,
+                void* source,
+                struct image_load_result* result);
+
+void image_load_result_clear(struct image_load_result* result);
@@ -0,0 +1,388 @@
+#include "image_preload.h"
+#include "docker_api.h"
+#include "image_load.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INDEX_FILE         ".image-preload.json"
+#define CONCURRENT_LOADS   2
+#define DIGEST_BUFFER      (64 * 1024)
+#define REQUEST_TIMEOUT_MS 5000
+
+// dockerd detects the compression of an archive by itself.
+static const char* const archive_suffixes[] = {".tar", ".tar.gz", ".tgz", ".tar.xz", NULL};
+
+struct image_preload {
+    GThreadPool* pool;
+    volatile int generation_atomic;  // Incremented by stop, which makes older jobs give up
+
+    GMutex mutex;        // Protects the members below
+    GCond idle;          // Signalled when running drops to zero
+    guint running;       // Jobs that have not finished
+    GPtrArray* sources;  // struct archive_source*, of the jobs that are loading
+    char* index_path;    // In the data root of the last start
+    json_t* index;       // {"archives": {<digest>: {...}}, "files": {<path>: {...}}}
+    GHashTable* queued;  // Paths of the archives that are queued or loading
+    json_t* results;     // File name -> result of the last start
+};
+
+struct preload_job {
+    char* path;
+    int generation;
+};
+
+struct archive_source {
+    int fd;  // -1 once the whole archive has been read
+    struct image_preload* preload;
+    int generation;
+    int connection;  // Socket to dockerd, or -1. Protected by the mutex of preload.
+};
+
+static bool cancelled(const struct image_preload* preload, int generation) {
+    return g_atomic_int_get(&preload->generation_atomic) != generation;
+}
+
+static bool is_archive(const char* filename) {
+    for (const char* const* suffix = archive_suffixes; *suffix; ++suffix)
+        if (g_str_has_suffix(filename, *suffix))
+            return true;
+    return false;
+}
+
+static json_t* read_index(const char* path) {
+    json_t* index = json_load_file(path, 0, NULL);
+    if (!json_is_object(json_object_get(index, "archives")) ||
+        !json_is_object(json_object_get(index, "files"))) {
+        json_decref(index);
+        index = json_pack("{s:{}, s:{}}", "archives", "files");
+    }
+    return index;
+}
+
+// Called with the mutex held. The index is replaced atomically, so a power loss leaves either the
+// old or the new index.
+static void write_index(struct image_preload* preload) {
+    g_autofree char* contents = json_dumps(preload->index, JSON_INDENT(4) | JSON_SORT_KEYS);
+    GError* error = NULL;
+    if (!contents || !g_file_set_contents(preload->index_path, contents, -1, &error)) {
+        log_warning("Failed to write %s: %s",
+                    preload->index_path,
+                    error ? error->message : "out of memory");
+        g_clear_error(&error);
+    }
+}
+
+static char* compute_digest(const struct preload_job* job, const struct image_preload* preload) {
+    const int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_autofree guchar* buffer = g_malloc(DIGEST_BUFFER);
+    ssize_t length;
+    while (!cancelled(preload, job->generation) &&
+           ((length = read(fd, buffer, DIGEST_BUFFER)) > 0 || (length < 0 && errno == EINTR)))
+        if (length > 0)
+            g_checksum_update(checksum, buffer, length);
+    if (cancelled(preload, job->generation))
+        length = -1;
+    close(fd);
+    char* digest = length == 0 ? g_strdup(g_checksum_get_string(checksum)) : NULL;
+    g_checksum_free(checksum);
+    return digest;
+}
+
+// Return the digest of the archive. Reading the whole archive is avoided when the index has the
+// digest of a file with the same path, size and modification time.
+static char* archive_digest(struct image_preload* preload, const struct preload_job* job) {
+    const char* path = job->path;
+    struct stat sb;
+    if (stat(path, &sb) != 0)
+        return NULL;
+
+    g_mutex_lock(&preload->mutex);
+    json_t* file = json_object_get(json_object_get(preload->index, "files"), path);
+    char* digest = NULL;
+    if (json_integer_value(json_object_get(file, "size")) == sb.st_size &&
+        json_integer_value(json_object_get(file, "mtime")) == sb.st_mtime)
+        digest = g_strdup(json_string_value(json_object_get(file, "digest")));
+    g_mutex_unlock(&preload->mutex);
+    if (digest)
+        return digest;
+
+    if (!(digest = compute_digest(job, preload)))
+        return NULL;
+    g_mutex_lock(&preload->mutex);
+    json_object_set_new(json_object_get(preload->index, "files"),
+                        path,
+                        json_pack("{s:I, s:I, s:s}",
+                                  "size",
+                                  (json_int_t)sb.st_size,
+                                  "mtime",
+                                  (json_int_t)sb.st_mtime,
+                                  "digest",
+                                  digest));
+    g_mutex_unlock(&preload->mutex);
+    return digest;
+}
+
+static bool image_present(const char* reference) {
+    g_autofree char* escaped = g_uri_escape_string(reference, ":/@", false);
+    g_autofree char* path = g_strdup_printf("/images/%s/json", escaped);
+    int status_code = 0;
+    g_autofree char* body = docker_api_request("GET", path, REQUEST_TIMEOUT_MS, &status_code);
+    return body && status_code == 200;
+}
+
+// Return true if the archive has been loaded before and dockerd still has all of its images.
+static bool already_loaded(struct image_preload* preload, const char* digest) {
+    g_mutex_lock(&preload->mutex);
+    json_t* archive = json_object_get(json_object_get(preload->index, "archives"), digest);
+    json_t* images = json_deep_copy(json_object_get(archive, "images"));
+    g_mutex_unlock(&preload->mutex);
+
+    bool loaded = json_array_size(images) > 0;
+    size_t i;
+    json_t* image;
+    json_array_foreach(images, i, image) {
+        if (!loaded)
+            break;
+        loaded = image_present(json_string_value(image));
+    }
+    json_decref(images);
+    return loaded;
+}
+
+// dockerd reports "Loaded image: <name>:<tag>" for tagged images and "Loaded image ID: <id>" for
+// the others.
+static json_t* loaded_images(GPtrArray* messages) {
+    json_t* images = json_array();
+    for (guint i = 0; i < messages->len; ++i) {
+        const char* message = g_ptr_array_index(messages, i);
+        if (g_str_has_prefix(message, "Loaded image ID: "))
+            json_array_append_new(images, json_string(message + strlen("Loaded image ID: ")));
+        else if (g_str_has_prefix(message, "Loaded image: "))
+            json_array_append_new(images, json_string(message + strlen("Loaded image: ")));
+    }
+    return images;
+}
+
+// The archive is closed as soon as it has been read, since dockerd may take minutes to import
+// the images after that, and the SD card could not be unmounted meanwhile.
+static ssize_t read_archive(void* source_void_ptr, char* buffer, size_t len) {
+    struct archive_source* source = source_void_ptr;
+    if (cancelled(source->preload, source->generation))
+        return -1;
+    ssize_t length;
+    while ((length = read(source->fd, buffer, len)) < 0 && errno == EINTR)
+        ;
+    if (length <= 0) {
+        close(source->fd);
+        source->fd = -1;
+    }
+    return length;
+}
+
+// Register the socket, so that stop can shut it down rather than wait for dockerd to respond.
+static void archive_connected(void* source_void_ptr, int fd) {
+    struct archive_source* source = source_void_ptr;
+    struct image_preload* preload = source->preload;
+    g_mutex_lock(&preload->mutex);
+    source->connection = fd;
+    if (fd == -1)
+        g_ptr_array_remove_fast(preload->sources, source);
+    else if (cancelled(preload, source->generation))
+        shutdown(fd, SHUT_RDWR);
+    else
+        g_ptr_array_add(preload->sources, source);
+    g_mutex_unlock(&preload->mutex);
+}
+
+// Load the archive and return its result.
+static json_t* preload_archive(struct image_preload* preload, const struct preload_job* job) {
+    g_autofree char* digest = archive_digest(preload, job);
+    if (!digest)
+        return json_pack("{s:s, s:s}", "status", "failed", "error", strerror(errno));
+    if (already_loaded(preload, digest))
+        return json_pack("{s:s, s:s}", "status", "skipped", "digest", digest);
+
+    struct archive_source source = {
+        .fd = open(job->path, O_RDONLY | O_CLOEXEC),
+        .preload = preload,
+        .generation = job->generation,
+        .connection = -1,
+    };
+    if (source.fd < 0)
+        return json_pack("{s:s, s:s}", "status", "failed", "error", strerror(errno));
+
+    struct image_load_result load;
+    const bool loaded = image_load(read_archive, archive_connected, &source, &load);
+    if (source.fd != -1)
+        close(source.fd);
+
+    json_t* images = loaded_images(load.messages);
+    const char* error = load.error ? load.error : "dockerd could not be reached";
+    if (cancelled(preload, job->generation))
+        error = "cancelled";
+    json_t* result = json_pack("{s:s, s:s, s:I, s:I, s:o}",
+                               "status",
+                               loaded ? "loaded" : "failed",
+                               "digest",
+                               digest,
+                               "bytes",
+                               (json_int_t)load.bytes,
+                               "duration_ms",
+                               (json_int_t)(load.duration_us / 1000),
+                               "images",
+                               images);
+    if (!loaded)
+        json_object_set_new(result, "error", json_string(error));
+    image_load_result_clear(&load);
+
+    if (loaded) {
+        g_mutex_lock(&preload->mutex);
+        json_object_set_new(json_object_get(preload->index, "archives"),
+                            digest,
+                            json_pack("{s:s, s:O}", "file", job->path, "images", images));
+        write_index(preload);
+        g_mutex_unlock(&preload->mutex);
+    }
+    return result;
+}
+
+// Run by the worker threads.
+static void preload_job_run(gpointer job_void_ptr, gpointer preload_void_ptr) {
+    struct preload_job* job = job_void_ptr;
+    struct image_preload* preload = preload_void_ptr;
+    g_mutex_lock(&preload->mutex);
+    const bool run = !cancelled(preload, job->generation);
+    if (run)
+        preload->running++;
+    g_mutex_unlock(&preload->mutex);
+
+    if (run) {
+        json_t* result = preload_archive(preload, job);
+        const char* status = json_string_value(json_object_get(result, "status"));
+        if (strcmp(status, "loaded") == 0)
+            log_info("Preloaded %s in %" JSON_INTEGER_FORMAT " ms",
+                     job->path,
+                     json_integer_value(json_object_get(result, "duration_ms")));
+        else if (strcmp(status, "failed") == 0)
+            log_warning("Failed to preload %s: %s",
+                        job->path,
+                        json_string_value(json_object_get(result, "error")));
+
+        g_autofree char* filename = g_path_get_basename(job->path);
+        g_mutex_lock(&preload->mutex);
+        if (!cancelled(preload, job->generation)) {
+            json_object_set_new(preload->results, filename, result);
+            g_hash_table_remove(preload->queued, job->path);
+        } else {
+            json_decref(result);
+        }
+        if (--preload->running == 0)
+            g_cond_broadcast(&preload->idle);
+        g_mutex_unlock(&preload->mutex);
+    }
+    g_free(job->path);
+    g_free(job);
+}
+
+struct image_preload* image_preload_new(void) {
+    struct image_preload* preload = g_new0(struct image_preload, 1);
+    g_mutex_init(&preload->mutex);
+    g_cond_init(&preload->idle);
+    preload->queued = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    preload->results = json_object();
+    preload->sources = g_ptr_array_new();
+    preload->pool = g_thread_pool_new(preload_job_run, preload, CONCURRENT_LOADS, false, NULL);
+    return preload;
+}
+
+void image_preload_free(struct image_preload* preload) {
+    if (!preload)
+        return;
+    image_preload_stop(preload);
+    g_thread_pool_free(preload->pool, false, true);
+    g_hash_table_destroy(preload->queued);
+    g_ptr_array_unref(preload->sources);
+    json_decref(preload->results);
+    json_decref(preload->index);
+    g_free(preload->index_path);
+    g_cond_clear(&preload->idle);
+    g_mutex_clear(&preload->mutex);
+    g_free(preload);
+}
+
+void image_preload_start(struct image_preload* preload,
+                         const char* directory,
+                         const char* data_root) {
+    GError* error = NULL;
+    GDir* dir = g_dir_open(directory, 0, &error);
+    if (!dir) {
+        log_info("No images are preloaded: %s", error->message);
+        g_clear_error(&error);
+        return;
+    }
+
+    g_autofree char* index_path = g_build_filename(data_root, INDEX_FILE, NULL);
+    const int generation = g_atomic_int_get(&preload->generation_atomic);
+    guint num_queued = 0;
+    g_mutex_lock(&preload->mutex);
+    if (g_strcmp0(index_path, preload->index_path) != 0) {
+        g_free(preload->index_path);
+        preload->index_path = g_strdup(index_path);
+        json_decref(preload->index);
+        preload->index = read_index(index_path);
+    }
+    json_object_clear(preload->results);
+
+    const char* filename;
+    while ((filename = g_dir_read_name(dir))) {
+        char* path = g_build_filename(directory, filename, NULL);
+        if (!is_archive(filename) || g_hash_table_contains(preload->queued, path)) {
+            g_free(path);
+            continue;
+        }
+        g_hash_table_add(preload->queued, path);
+        struct preload_job* job = g_new0(struct preload_job, 1);
+        job->path = g_strdup(path);
+        job->generation = generation;
+        g_thread_pool_push(preload->pool, job, NULL);
+        num_queued++;
+    }
+    g_mutex_unlock(&preload->mutex);
+    g_dir_close(dir);
+    log_info("Queued %u image archives in %s for preloading", num_queued, directory);
+}
+
+void image_preload_stop(struct image_preload* preload) {
+    g_mutex_lock(&preload->mutex);
+    g_atomic_int_inc(&preload->generation_atomic);
+    g_hash_table_remove_all(preload->queued);
+    // The jobs give up at their next read, and must have closed their archives before an SD card
+    // can be unmounted. Shutting down the sockets makes the jobs that wait for dockerd to import an
+    // archive give up right away too.
+    for (guint i = 0; i < preload->sources->len; ++i) {
+        const struct archive_source* source = g_ptr_array_index(preload->sources, i);
+        shutdown(source->connection, SHUT_RDWR);
+    }
+    while (preload->running)
+        g_cond_wait(&preload->idle, &preload->mutex);
+    g_mutex_unlock(&preload->mutex);
+}
+
+json_t* image_preload_json(struct image_preload* preload) {
+    g_mutex_lock(&preload->mutex);
+    json_t* json = json_pack("{s:i, s:o}",
+                             "queued",
+                             (int)g_hash_table_size(preload->queued),
+                             "archives",
+                             json_deep_copy(preload->results));
+    g_mutex_unlock(&preload->mutex);
+    return json;
+}
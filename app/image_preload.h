@@ -0,0 +1,29 @@
+#pragma once
+#include <jansson.h>
+
+// Loading of image archives, as created by 'docker save', from a directory into dockerd in the
+// background, so that the images of a device do not have to be pushed to it again when dockerd
+// starts with a fresh data root. The archives are loaded a few at a time by worker threads. An
+// index in the data root records the SHA-256 digest of every loaded archive and the images it
+// contained, and archives are skipped when they have been loaded before and their images are still
+// present.
+
+struct image_preload* image_preload_new(void);
+
+// Cancel the loads in progress and wait for the workers to finish.
+void image_preload_free(struct image_preload* preload);
+
+// Queue the archives in directory that are not loaded into the dockerd that uses data_root, which
+// must be ready to answer requests. Archives that are already queued are not queued again. Return
+// without waiting for the loads.
+void image_preload_start(struct image_preload* preload,
+                         const char* directory,
+                         const char* data_root);
+
+// Abort the loads in progress and drop the queued ones, before dockerd is stopped or the SD card is
+// removed. Return when no archive is open any longer.
+void image_preload_stop(struct image_preload* preload);
+
+// Return the result of every archive since the last start, with the time and bytes of each load.
+// May be called from any thread.
+json_t* image_preload_json(struct image_preload* preload);
@@ -0,0 +1,215 @@
+#include "metrics.h"
+#include <stdatomic.h>
+
+#define METRICS_PREFIX APP_NAME "_"
+#define MAX_BUCKETS    16
+
+struct counter_definition {
+    const char* name;
+    const char* help;
+};
+
+// Bucket i has the upper bound first_bound * factor^i, and a last bucket counts all larger values.
+struct histogram_definition {
+    const char* name;
+    const char* help;
+    gint64 first_bound;
+    gint64 factor;
+    guint num_buckets;  // Not counting the last bucket
+    double scale;       // Converts an observed value to the unit of the metric
+};
+
+struct atomic_histogram {
+    atomic_ullong buckets[MAX_BUCKETS + 1];  // Not cumulative, unlike in the exposition format
+    atomic_llong sum;
+};
+
+static const struct counter_definition counter_definitions[METRICS_NUM_COUNTERS] = {
+    [METRICS_DOCKERD_STARTS] = {"dockerd_starts_total",
+                                "Number of times dockerd has been started."},
+    [METRICS_DOCKERD_STOPS] = {"dockerd_stops_total",
+                               "Number of times dockerd has been stopped by the application."},
+    [METRICS_DOCKERD_CRASHES] = {"dockerd_crashes_total",
+                                 "Number of times dockerd has exited without being stopped."},
+};
+
+static const struct histogram_definition histogram_definitions[METRICS_NUM_HISTOGRAMS] = {
+    [METRICS_UPLOAD_BYTES] = {"upload_bytes", "Size of uploaded files.", 64 * 1024, 4, 10, 1},
+    [METRICS_UPLOAD_DURATION] =
+        {"upload_duration_seconds", "Time to receive uploaded files.", 100000, 2, 12, 1e-6},
+    [METRICS_PARAMETER_READ] =
+        {"parameter_read_seconds", "Time to read a parameter from AXParameter.", 100, 2, 16, 1e-6},
+    [METRICS_API_UNREACHABLE] = {"api_unreachable_seconds",
+                                 "Time from an address change until the API is forwarded on it.",
+                                 10000,
+                                 2,
+                                 12,
+                                 1e-6},
+};
+
+static const struct histogram_definition request_definition = {
+    "http_request_duration_seconds", "Time to handle FastCGI requests.", 1000, 2, 16, 1e-6};
+
+static const char* const method_names[METRICS_NUM_METHODS] = {
+    [METRICS_METHOD_GET] = "GET",
+    [METRICS_METHOD_POST] = "POST",
+    [METRICS_METHOD_DELETE] = "DELETE",
+    [METRICS_METHOD_OTHER] = "other",
+};
+
+static const char* const route_names[METRICS_NUM_ROUTES] = {
+    [METRICS_ROUTE_IMAGES] = "images",
+    [METRICS_ROUTE_TLS] = "tls",
+    [METRICS_ROUTE_REPORT] = "report",
+    [METRICS_ROUTE_OTHER] = "other",
+};
+
+static atomic_ullong counters[METRICS_NUM_COUNTERS];
+static struct atomic_histogram histograms[METRICS_NUM_HISTOGRAMS];
+static struct atomic_histogram requests[METRICS_NUM_METHODS][METRICS_NUM_ROUTES];
+static atomic_llong dockerd_ready_at;  // Monotonic time, zero when dockerd is not ready
+static atomic_llong dockerd_ready_latency_us;
+
+static void observe(const struct histogram_definition* definition,
+                    struct atomic_histogram* histogram,
+                    gint64 value) {
+    value = MAX(value, 0);
+    guint index = 0;
+    for (gint64 bound = definition->first_bound;
+         index < definition->num_buckets && value > bound;
+         bound *= definition->factor)
+        index++;
+    atomic_fetch_add_explicit(&histogram->buckets[index], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+}
+
+void metrics_count(enum metrics_counter counter) {
+    atomic_fetch_add_explicit(&counters[counter], 1, memory_order_relaxed);
+}
+
+void metrics_observe(enum metrics_histogram histogram, gint64 value) {
+    observe(&histogram_definitions[histogram], &histograms[histogram], value);
+}
+
+void metrics_observe_request(enum metrics_method method,
+                             enum metrics_route route,
+                             gint64 duration_us) {
+    observe(&request_definition, &requests[method][route], duration_us);
+}
+
+void metrics_dockerd_ready(gint64 spawn_to_ready_us) {
+    atomic_store_explicit(&dockerd_ready_latency_us, spawn_to_ready_us, memory_order_relaxed);
+    atomic_store_explicit(&dockerd_ready_at, g_get_monotonic_time(), memory_order_relaxed);
+}
+
+void metrics_dockerd_exited(void) {
+    atomic_store_explicit(&dockerd_ready_at, 0, memory_order_relaxed);
+}
+
+static void append_header(GString* text, const char* name, const char* help, const char* type) {
+    g_string_append_printf(text,
+                           "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n",
+                           name,
+                           help,
+                           name,
+                           type);
+}
+
+static void append_gauge(GString* text, const char* name, const char* help, double value) {
+    append_header(text, name, help, "gauge");
+    g_string_append_printf(text, METRICS_PREFIX "%s %g\n", name, value);
+}
+
+static guint64 histogram_count(const struct histogram_definition* definition,
+                               struct atomic_histogram* histogram) {
+    guint64 count = 0;
+    for (guint i = 0; i <= definition->num_buckets; ++i)
+        count += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    return count;
+}
+
+// labels is empty or a comma separated list of labels, such as method="GET",route="images".
+static void append_histogram(GString* text,
+                             const struct histogram_definition* definition,
+                             struct atomic_histogram* histogram,
+                             const char* labels) {
+    const char* separator = *labels ? "," : "";
+    guint64 count = 0;
+    gint64 bound = definition->first_bound;
+    for (guint i = 0; i < definition->num_buckets; ++i, bound *= definition->factor) {
+        count += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        g_string_append_printf(text,
+                               METRICS_PREFIX "%s_bucket{%s%sle=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                               definition->name,
+                               labels,
+                               separator,
+                               bound * definition->scale,
+                               count);
+    }
+    // The count is the sum of the buckets rather than a separate counter, so that it always
+    // matches the +Inf bucket, also when values are observed during the scrape.
+    count +=
+        atomic_load_explicit(&histogram->buckets[definition->num_buckets], memory_order_relaxed);
+    g_string_append_printf(text,
+                           METRICS_PREFIX "%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                           definition->name,
+                           labels,
+                           separator,
+                           count);
+
+    const double sum =
+        atomic_load_explicit(&histogram->sum, memory_order_relaxed) * definition->scale;
+    g_autofree char* braced_labels = *labels ? g_strdup_printf("{%s}", labels) : g_strdup("");
+    g_string_append_printf(text,
+                           METRICS_PREFIX "%s_sum%s %g\n" METRICS_PREFIX
+                                          "%s_count%s %" G_GUINT64_FORMAT "\n",
+                           definition->name,
+                           braced_labels,
+                           sum,
+                           definition->name,
+                           braced_labels,
+                           count);
+}
+
+char* metrics_text(void) {
+    GString* text = g_string_new(NULL);
+
+    for (guint i = 0; i < METRICS_NUM_COUNTERS; ++i) {
+        append_header(text, counter_definitions[i].name, counter_definitions[i].help, "counter");
+        g_string_append_printf(text,
+                               METRICS_PREFIX "%s %llu\n",
+                               counter_definitions[i].name,
+                               atomic_load_explicit(&counters[i], memory_order_relaxed));
+    }
+
+    const gint64 ready_at = atomic_load_explicit(&dockerd_ready_at, memory_order_relaxed);
+    append_gauge(text, "dockerd_up", "Whether dockerd is running and ready.", ready_at ? 1 : 0);
+    append_gauge(text,
+                 "dockerd_uptime_seconds",
+                 "Time since dockerd became ready, zero when it is not running.",
+                 ready_at ? (g_get_monotonic_time() - ready_at) / 1e6 : 0);
+    append_gauge(text,
+                 "dockerd_ready_seconds",
+                 "Time from spawning dockerd until it answered API requests, at the last start.",
+                 atomic_load_explicit(&dockerd_ready_latency_us, memory_order_relaxed) / 1e6);
+
+    for (guint i = 0; i < METRICS_NUM_HISTOGRAMS; ++i) {
+        const struct histogram_definition* definition = &histogram_definitions[i];
+        append_header(text, definition->name, definition->help, "histogram");
+        append_histogram(text, definition, &histograms[i], "");
+    }
+
+    // Only the combinations of method and route that have been requested are listed.
+    append_header(text, request_definition.name, request_definition.help, "histogram");
+    for (guint method = 0; method < METRICS_NUM_METHODS; ++method)
+        for (guint route = 0; route < METRICS_NUM_ROUTES; ++route) {
+            if (histogram_count(&request_definition, &requests[method][route]) == 0)
+                continue;
+            g_autofree char* labels = g_strdup_printf("method=\"%s\",route=\"%s\"",
+                                                      method_names[method],
+                                                      route_names[route]);
+            append_histogram(text, &request_definition, &requests[method][route], labels);
+        }
+
+    return g_string_free(text, false);
+}
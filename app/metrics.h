@@ -0,0 +1,51 @@
+#pragma once
+#include <glib.h>
+
+// Process wide metrics, served by GET /metrics in the Prometheus text exposition format. Every
+// update is a single relaxed atomic operation without locks, so metrics may be updated from any
+// thread, also on hot paths.
+
+enum metrics_counter {
+    METRICS_DOCKERD_STARTS,
+    METRICS_DOCKERD_STOPS,    // dockerd was stopped by the application
+    METRICS_DOCKERD_CRASHES,  // dockerd exited without being asked to
+    METRICS_NUM_COUNTERS
+};
+
+enum metrics_histogram {
+    METRICS_UPLOAD_BYTES,
+    METRICS_UPLOAD_DURATION,  // Microseconds
+    METRICS_PARAMETER_READ,   // Microseconds
+    METRICS_API_UNREACHABLE,  // Microseconds from an address change until the API is forwarded
+    METRICS_NUM_HISTOGRAMS
+};
+
+enum metrics_method {
+    METRICS_METHOD_GET,
+    METRICS_METHOD_POST,
+    METRICS_METHOD_DELETE,
+    METRICS_METHOD_OTHER,
+    METRICS_NUM_METHODS
+};
+
+enum metrics_route {
+    METRICS_ROUTE_IMAGES,
+    METRICS_ROUTE_TLS,     // Certificate and key files
+    METRICS_ROUTE_REPORT,  // JSON reports and the metrics themselves
+    METRICS_ROUTE_OTHER,
+    METRICS_NUM_ROUTES
+};
+
+void metrics_count(enum metrics_counter counter);
+void metrics_observe(enum metrics_histogram histogram, gint64 value);
+void metrics_observe_request(enum metrics_method method,
+                             enum metrics_route route,
+                             gint64 duration_us);
+
+// Call when dockerd has become ready, with the time from spawning it, and when it has exited. The
+// uptime of dockerd is counted from the call to metrics_dockerd_ready().
+void metrics_dockerd_ready(gint64 spawn_to_ready_us);
+void metrics_dockerd_exited(void);
+
+// Return all metrics in the text exposition format. Free with g_free().
+char* metrics_text(void);
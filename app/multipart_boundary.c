@@ -0,0 +1,57 @@
+#include "multipart_boundary.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DELIMITER_PREFIX     "\r\n--"
+#define DELIMITER_PREFIX_LEN (sizeof(DELIMITER_PREFIX) - 1)
+#define MAX_BOUNDARY_LEN     70  // RFC 2046, section 5.1.1
+
+bool multipart_boundary_init(struct multipart_boundary* boundary, const char* boundary_text) {
+    const size_t boundary_len = strlen(boundary_text);
+    if (boundary_len == 0 || boundary_len > MAX_BOUNDARY_LEN)
+        return false;
+
+    boundary->delimiter_len = DELIMITER_PREFIX_LEN + boundary_len;
+    boundary->delimiter = malloc(boundary->delimiter_len + 1);
+    if (!boundary->delimiter)
+        return false;
+    memcpy(boundary->delimiter, DELIMITER_PREFIX, DELIMITER_PREFIX_LEN);
+    memcpy(boundary->delimiter + DELIMITER_PREFIX_LEN, boundary_text, boundary_len + 1);
+    return true;
+}
+
+void multipart_boundary_free(struct multipart_boundary* boundary) {
+    free(boundary->delimiter);
+    boundary->delimiter = NULL;
+    boundary->delimiter_len = 0;
+}
+
+// The delimiter always starts with '\r', which is rare in uploaded data. Let memchr(), which the C
+// library implements with word-at-a-time or NEON/SSE loads, skip ahead to each candidate and only
+// compare the full delimiter there.
+bool multipart_boundary_find(const struct multipart_boundary* boundary,
+                             const char* data,
+                             size_t len,
+                             size_t* match,
+                             size_t* safe_len) {
+    const char* const end = data + len;
+    const size_t delimiter_len = boundary->delimiter_len;
+
+    for (const char* p = data; (p = memchr(p, '\r', end - p)); p++) {
+        const size_t remaining = end - p;
+        if (remaining < delimiter_len) {
+            // A delimiter may start here and continue in the next read.
+            if (memcmp(p, boundary->delimiter, remaining) == 0) {
+                *safe_len = p - data;
+                return false;
+            }
+            continue;
+        }
+        if (memcmp(p, boundary->delimiter, delimiter_len) == 0) {
+            *match = p - data;
+            return true;
+        }
+    }
+    *safe_len = len;
+    return false;
+}
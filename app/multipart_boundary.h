@@ -0,0 +1,25 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// Streaming search for the delimiter that ends a part of a multipart/form-data body, i.e.
+// "\r\n--" followed by the boundary. The delimiter may be split across reads, so the caller keeps
+// the bytes that multipart_boundary_find() reports as not yet safe to consume and prepends them
+// to the next read.
+struct multipart_boundary {
+    char* delimiter;
+    size_t delimiter_len;
+};
+
+// Return false if the boundary is empty or too long to be valid according to RFC 2046.
+bool multipart_boundary_init(struct multipart_boundary* boundary, const char* boundary_text);
+void multipart_boundary_free(struct multipart_boundary* boundary);
+
+// Search data[0..len) for the delimiter. If found, return true and set *match to its offset.
+// Otherwise return false and set *safe_len to the number of leading bytes that cannot be part of
+// a delimiter, even if it continues in the next read.
+bool multipart_boundary_find(const struct multipart_boundary* boundary,
+                             const char* data,
+                             size_t len,
+                             size_t* match,
+                             size_t* safe_len);
@@ -0,0 +1,278 @@
+#include "network_acceleration.h"
+#include "app_paths.h"
+#include "child_process.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#define BYPASS4NETNS            APP_DIRECTORY "/bypass4netns"
+#define DEFAULT_SECCOMP_PROFILE APP_DIRECTORY "/seccomp-default.json"
+#define SOCKET_WAIT_MS          2000  // Time for bypass4netns to start listening
+#define STOP_TIMEOUT_MS         2000  // Time for bypass4netns to exit before it is killed
+#define POLL_INTERVAL_MS        10
+
+// SECCOMP_IOCTL_NOTIF_ADDFD, which bypass4netns replaces sockets with, was added in Linux 5.9.
+#define MIN_KERNEL_MAJOR 5
+#define MIN_KERNEL_MINOR 9
+
+// The system calls that bypass4netns handles.
+static const char* const intercepted_syscalls[] =
+    {"bind", "close", "connect", "fcntl", "sendmsg", "sendto", "setsockopt", NULL};
+
+// Traffic to these networks stays in the namespace of rootlesskit: loopback, the slirp4netns
+// network of network_profile.c and the networks that dockerd creates bridges for.
+static const char* const ignored_subnets[] = {"127.0.0.0/8", "10.0.3.0/24", "172.16.0.0/12", NULL};
+
+struct network_acceleration {
+    network_acceleration_exited_t exited;
+    void* user_data;
+    GPid pid;  // Zero when bypass4netns is not running
+    guint watch_id;
+    guint socket_wait_id;  // Polls for the socket while bypass4netns is starting
+    guint socket_waited_ms;
+    char* socket_path;
+    char* seccomp_profile;
+    bool failed_to_start;  // Until acceleration is disabled, so that dockerd is not restarted again
+
+    GMutex mutex;  // Protects the members below
+    bool requested;
+    const char* inactive_reason;  // NULL when active or not requested
+};
+
+static char* runtime_file(const char* filename) {
+    return g_strdup_printf("/var/run/user/%d/%s", getuid(), filename);
+}
+
+static void set_state(struct network_acceleration* acceleration,
+                      bool requested,
+                      const char* inactive_reason) {
+    g_mutex_lock(&acceleration->mutex);
+    acceleration->requested = requested;
+    acceleration->inactive_reason = inactive_reason;
+    g_mutex_unlock(&acceleration->mutex);
+}
+
+static bool kernel_supports_addfd(void) {
+    struct utsname name;
+    int major = 0;
+    int minor = 0;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2)
+        return false;
+    return major > MIN_KERNEL_MAJOR || (major == MIN_KERNEL_MAJOR && minor >= MIN_KERNEL_MINOR);
+}
+
+static bool is_intercepted(const char* syscall) {
+    for (const char* const* name = intercepted_syscalls; *name; ++name)
+        if (strcmp(*name, syscall) == 0)
+            return true;
+    return false;
+}
+
+// Write the default seccomp profile of dockerd with the intercepted system calls moved from the
+// rules that allow them to a rule that notifies bypass4netns, so containers keep the same
+// restrictions as without acceleration.
+static bool write_seccomp_profile(const char* path, const char* socket_path) {
+    json_error_t error;
+    json_t* profile = json_load_file(DEFAULT_SECCOMP_PROFILE, 0, &error);
+    json_t* syscalls = json_object_get(profile, "syscalls");
+    if (!json_is_array(syscalls)) {
+        log_error("Failed to read the seccomp profile %s: %s",
+                  DEFAULT_SECCOMP_PROFILE,
+                  profile ? "no syscalls" : error.text);
+        json_decref(profile);
+        return false;
+    }
+
+    size_t index;
+    json_t* rule;
+    json_array_foreach(syscalls, index, rule) {
+        if (g_strcmp0(json_string_value(json_object_get(rule, "action")), "SCMP_ACT_ALLOW") != 0)
+            continue;
+        json_t* names = json_object_get(rule, "names");
+        for (size_t i = json_array_size(names); i-- > 0;)
+            if (is_intercepted(json_string_value(json_array_get(names, i))))
+                json_array_remove(names, i);
+    }
+    json_t* names = json_array();
+    for (const char* const* name = intercepted_syscalls; *name; ++name)
+        json_array_append_new(names, json_string(*name));
+    json_array_append_new(syscalls,
+                          json_pack("{s:o, s:s}", "names", names, "action", "SCMP_ACT_NOTIFY"));
+    json_object_set_new(profile, "listenerPath", json_string(socket_path));
+
+    const bool success = json_dump_file(profile, path, JSON_INDENT(4)) == 0;
+    if (!success)
+        log_error("Failed to write the seccomp profile %s", path);
+    json_decref(profile);
+    return success;
+}
+
+static void bypass4netns_exited(GPid pid, gint status, gpointer acceleration_void_ptr) {
+    struct network_acceleration* acceleration = acceleration_void_ptr;
+    g_spawn_close_pid(pid);
+    acceleration->pid = 0;
+    acceleration->watch_id = 0;
+    const bool starting = acceleration->socket_wait_id;
+    if (starting) {
+        g_source_remove(acceleration->socket_wait_id);
+        acceleration->socket_wait_id = 0;
+        acceleration->failed_to_start = true;
+    }
+
+    log_warning("bypass4netns (%d) exited with status %d, container networking falls back to "
+                "slirp4netns when dockerd has been restarted",
+                pid,
+                status);
+    set_state(acceleration,
+              true,
+              starting ? "bypass4netns failed to start" : "bypass4netns exited");
+    acceleration->exited(acceleration->user_data);
+}
+
+// dockerd has already been configured with the seccomp profile, so if bypass4netns does not start
+// listening, dockerd must be restarted without it, as when bypass4netns exits.
+static gboolean wait_for_socket(gpointer acceleration_void_ptr) {
+    struct network_acceleration* acceleration = acceleration_void_ptr;
+    if (access(acceleration->socket_path, F_OK) == 0) {
+        acceleration->socket_wait_id = 0;
+        set_state(acceleration, true, NULL);
+        log_info("Network acceleration is active, bypass4netns is running as %d",
+                 acceleration->pid);
+        return G_SOURCE_REMOVE;
+    }
+    acceleration->socket_waited_ms += POLL_INTERVAL_MS;
+    if (acceleration->socket_waited_ms < SOCKET_WAIT_MS)
+        return G_SOURCE_CONTINUE;
+
+    acceleration->socket_wait_id = 0;
+    log_error("bypass4netns did not create %s within %d ms, container networking falls back to "
+              "slirp4netns when dockerd has been restarted",
+              acceleration->socket_path,
+              SOCKET_WAIT_MS);
+    network_acceleration_stop(acceleration);
+    acceleration->failed_to_start = true;
+    set_state(acceleration, true, "bypass4netns failed to start");
+    acceleration->exited(acceleration->user_data);
+    return G_SOURCE_REMOVE;
+}
+
+static bool spawn_bypass4netns(struct network_acceleration* acceleration) {
+    const char* socket_path = acceleration->socket_path;
+    GPtrArray* argv = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(argv, g_strdup(BYPASS4NETNS));
+    g_ptr_array_add(argv, g_strdup_printf("--socket=%s", socket_path));
+    for (const char* const* subnet = ignored_subnets; *subnet; ++subnet)
+        g_ptr_array_add(argv, g_strdup_printf("--ignore=%s", *subnet));
+    g_ptr_array_add(argv, NULL);
+
+    unlink(socket_path);  // Left behind if bypass4netns was killed
+    GError* error = NULL;
+    const bool spawned = g_spawn_async(NULL,
+                                       (char**)argv->pdata,
+                                       NULL,
+                                       G_SPAWN_DO_NOT_REAP_CHILD,
+                                       NULL,
+                                       NULL,
+                                       &acceleration->pid,
+                                       &error);
+    g_ptr_array_free(argv, true);
+    if (!spawned) {
+        log_error("Failed to start bypass4netns: %s", error->message);
+        g_clear_error(&error);
+        return false;
+    }
+    log_debug("Child process bypass4netns (%d) was started.", acceleration->pid);
+    acceleration->watch_id =
+        g_child_watch_add(acceleration->pid, bypass4netns_exited, acceleration);
+    acceleration->socket_waited_ms = 0;
+    acceleration->socket_wait_id = g_timeout_add(POLL_INTERVAL_MS, wait_for_socket, acceleration);
+    return true;
+}
+
+struct network_acceleration* network_acceleration_new(network_acceleration_exited_t exited,
+                                                      void* user_data) {
+    struct network_acceleration* acceleration = g_new0(struct network_acceleration, 1);
+    acceleration->exited = exited;
+    acceleration->user_data = user_data;
+    g_mutex_init(&acceleration->mutex);
+    return acceleration;
+}
+
+void network_acceleration_free(struct network_acceleration* acceleration) {
+    if (!acceleration)
+        return;
+    network_acceleration_stop(acceleration);
+    g_free(acceleration->socket_path);
+    g_free(acceleration->seccomp_profile);
+    g_mutex_clear(&acceleration->mutex);
+    g_free(acceleration);
+}
+
+const char* network_acceleration_start(struct network_acceleration* acceleration,
+                                       bool enabled,
+                                       bool user_seccomp_profile) {
+    network_acceleration_stop(acceleration);
+    g_clear_pointer(&acceleration->seccomp_profile, g_free);
+    if (!enabled) {
+        acceleration->failed_to_start = false;
+        set_state(acceleration, false, NULL);
+        return NULL;
+    }
+
+    const char* inactive_reason = NULL;
+    g_free(acceleration->socket_path);
+    acceleration->socket_path = runtime_file("bypass4netns.sock");
+    g_autofree char* profile_path = runtime_file("seccomp-bypass4netns.json");
+    if (user_seccomp_profile)
+        inactive_reason = "daemon.json sets a seccomp profile of its own";
+    else if (acceleration->failed_to_start)
+        inactive_reason = "bypass4netns failed to start";
+    else if (access(BYPASS4NETNS, X_OK) != 0)
+        inactive_reason = "bypass4netns is not installed";
+    else if (!kernel_supports_addfd())
+        inactive_reason = "the kernel is older than 5.9";
+    else if (!write_seccomp_profile(profile_path, acceleration->socket_path))
+        inactive_reason = "no seccomp profile";
+    else if (!spawn_bypass4netns(acceleration))
+        inactive_reason = "bypass4netns failed to start";
+
+    set_state(acceleration, true, inactive_reason ? inactive_reason : "bypass4netns is starting");
+    if (inactive_reason) {
+        log_warning("Network acceleration is not active, since %s", inactive_reason);
+        return NULL;
+    }
+    acceleration->seccomp_profile = g_steal_pointer(&profile_path);
+    return acceleration->seccomp_profile;
+}
+
+void network_acceleration_stop(struct network_acceleration* acceleration) {
+    if (acceleration->socket_wait_id) {
+        g_source_remove(acceleration->socket_wait_id);
+        acceleration->socket_wait_id = 0;
+    }
+    if (!acceleration->pid)
+        return;
+    child_process_stop("bypass4netns",
+                       acceleration->pid,
+                       acceleration->watch_id,
+                       STOP_TIMEOUT_MS,
+                       NULL,
+                       NULL);
+    acceleration->pid = 0;
+    acceleration->watch_id = 0;
+}
+
+json_t* network_acceleration_json(struct network_acceleration* acceleration) {
+    g_mutex_lock(&acceleration->mutex);
+    json_t* json = json_pack("{s:b, s:b}",
+                             "requested",
+                             acceleration->requested,
+                             "active",
+                             acceleration->requested && !acceleration->inactive_reason);
+    if (acceleration->inactive_reason)
+        json_object_set_new(json, "inactive_reason", json_string(acceleration->inactive_reason));
+    g_mutex_unlock(&acceleration->mutex);
+    return json;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <glib.h>
+#include <jansson.h>
+#include <stdbool.h>
+
+// Optional acceleration of container networking with bypass4netns. bypass4netns runs in the
+// network namespace of the device, outside rootlesskit, and runc hands it the seccomp user
+// notification fd of every container through a socket. When a container connects or sends to an
+// address outside the container networks, bypass4netns replaces the socket of the container with
+// a socket of its own, so the traffic no longer passes through slirp4netns. All other traffic
+// still goes through slirp4netns, and so does all traffic when bypass4netns is not installed, the
+// kernel is too old or bypass4netns fails to start.
+
+// Called from the main loop if bypass4netns exits while it is active, or does not start listening
+// in time. Containers started with the seccomp profile then fail their socket calls, so dockerd
+// must be restarted. After a failed start, acceleration is not attempted again until it has been
+// disabled.
+typedef void (*network_acceleration_exited_t)(void* user_data);
+
+struct network_acceleration* network_acceleration_new(network_acceleration_exited_t exited,
+                                                      void* user_data);
+void network_acceleration_free(struct network_acceleration* acceleration);
+
+// Start bypass4netns and generate the seccomp profile that dockerd should use for containers, or
+// stop it if enabled is false. Restarts bypass4netns if it is running. Acceleration replaces the
+// seccomp profile of containers, so it is not activated if user_seccomp_profile tells that the
+// user's daemon.json sets one. Return the path of the seccomp profile, or NULL if acceleration is
+// not active. The path is valid until the next call. Does not wait for bypass4netns to start
+// listening.
+const char* network_acceleration_start(struct network_acceleration* acceleration,
+                                       bool enabled,
+                                       bool user_seccomp_profile);
+
+// Stop bypass4netns, after dockerd has exited. Does not wait for it to exit.
+void network_acceleration_stop(struct network_acceleration* acceleration);
+
+// Return whether acceleration is requested and active, and why not. May be called from any thread.
+json_t* network_acceleration_json(struct network_acceleration* acceleration);
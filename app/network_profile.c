@@ -0,0 +1,27 @@
+#include "network_profile.h"
+#include <stddef.h>
+#include <string.h>
+
+// Shared by all profiles. The CIDR avoids the range of the company proxy, and the host loopback
+// interface is not reachable from containers.
+#define COMMON_ARGS "--net=slirp4netns --disable-host-loopback --cidr=10.0.3.0/24"
+
+static const struct network_profile profiles[] = {
+    // The slirp4netns port driver preserves the source address of connections to published ports.
+    // The MTU is left to rootlesskit, which uses 65520 for slirp4netns. The driver only forwards
+    // from IPv4 addresses.
+    {"compatible", COMMON_ARGS " --port-driver=slirp4netns", 0, false},
+    // The sandbox and seccomp options of slirp4netns are enabled where the kernel supports them.
+    {"performance",
+     COMMON_ARGS " --mtu=65520 --port-driver=builtin --slirp4netns-sandbox=auto "
+                 "--slirp4netns-seccomp=auto",
+     65520,
+     true},
+};
+
+const struct network_profile* network_profile_find(const char* name) {
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i)
+        if (strcmp(profiles[i].name, name) == 0)
+            return &profiles[i];
+    return &profiles[0];
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdbool.h>
+
+// Network options of rootlesskit and dockerd. Containers reach the network through slirp4netns,
+// which runs a TCP/IP stack in user space, so every packet that passes it costs CPU time. A larger
+// MTU means fewer, larger packets for the same amount of data, and the builtin port driver
+// forwards published ports with a socket copy in rootlesskit rather than through slirp4netns.
+
+struct network_profile {
+    const char* name;              // Value of the NetworkProfile parameter
+    const char* rootlesskit_args;  // Separated by spaces
+    int bridge_mtu;                // MTU of the container bridge network, or 0 to leave it unset
+    bool forwards_ipv6;            // Whether the port driver forwards from IPv6 addresses
+};
+
+// Return the profile with this name, or the default profile if there is no such profile.
+const struct network_profile* network_profile_find(const char* name);
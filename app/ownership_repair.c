@@ -0,0 +1,296 @@
+#include "ownership_repair.h"
+#include "log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define UNIT_DEPTH          3  // In a Docker data root, each layer in data/overlay2 is a unit
+#define REPAIR_THREADS      4  // Changing an inode mostly waits for the storage, not for the CPU
+#define PROGRESS_INTERVAL_S 10
+#define CHECKPOINT_COMPLETE "complete"
+
+struct repair_stats {
+    guint64 visited;
+    guint64 repaired;
+    guint64 failed;
+};
+
+struct repair {
+    const char* root;
+    uid_t uid;
+    gid_t gid;
+    GHashTable* done_units;  // Relative paths of the units in the checkpoint file
+    FILE* checkpoint;
+
+    GMutex mutex;  // Protects the members below
+    GCond unit_done;
+    guint units_left;
+    struct repair_stats stats;
+};
+
+static bool is_dot_or_dot_dot(const char* name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+static void repair_inode(const struct repair* repair,
+                         int dir_fd,
+                         const char* name,
+                         const struct stat* inode_stat,
+                         struct repair_stats* stats) {
+    stats->visited++;
+    if (inode_stat->st_uid == repair->uid && inode_stat->st_gid == repair->gid)
+        return;
+    if (fchownat(dir_fd, name, repair->uid, repair->gid, AT_SYMLINK_NOFOLLOW) == 0) {
+        stats->repaired++;
+    } else {
+        log_debug("Failed to change the owner of %s: %s", name, strerror(errno));
+        stats->failed++;
+    }
+}
+
+// Repair everything below the directory, and close dir_fd.
+static void repair_tree(const struct repair* repair, int dir_fd, struct repair_stats* stats) {
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        stats->failed++;
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (is_dot_or_dot_dot(entry->d_name))
+            continue;
+        struct stat inode_stat;
+        if (fstatat(dirfd(dir), entry->d_name, &inode_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            stats->failed++;
+            continue;
+        }
+        repair_inode(repair, dirfd(dir), entry->d_name, &inode_stat, stats);
+        if (!S_ISDIR(inode_stat.st_mode))
+            continue;
+        const int child_fd =
+            openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child_fd < 0)
+            stats->failed++;
+        else
+            repair_tree(repair, child_fd, stats);
+    }
+    closedir(dir);
+}
+
+static void add_stats(struct repair_stats* total, const struct repair_stats* stats) {
+    total->visited += stats->visited;
+    total->repaired += stats->repaired;
+    total->failed += stats->failed;
+}
+
+static void repair_unit(gpointer unit_void_ptr, gpointer repair_void_ptr) {
+    g_autofree char* unit = unit_void_ptr;
+    struct repair* repair = repair_void_ptr;
+    struct repair_stats stats = {0};
+
+    g_autofree char* path = g_build_filename(repair->root, unit, NULL);
+    const int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd < 0)
+        stats.failed++;
+    else
+        repair_tree(repair, dir_fd, &stats);
+
+    g_mutex_lock(&repair->mutex);
+    add_stats(&repair->stats, &stats);
+    if (stats.failed == 0 && !g_hash_table_contains(repair->done_units, unit)) {
+        // The unit is not recorded as done unless all of it was repaired, and a unit that is
+        // already in the checkpoint file is not recorded again.
+        fprintf(repair->checkpoint, "%s\n", unit);
+        fflush(repair->checkpoint);
+    }
+    repair->units_left--;
+    g_cond_signal(&repair->unit_done);
+    g_mutex_unlock(&repair->mutex);
+}
+
+// Repair the inodes above UNIT_DEPTH directly, and hand the directories at UNIT_DEPTH over to the
+// thread pool, unless they are in the checkpoint file and still have the right owner. Close dir_fd.
+static void split_into_units(struct repair* repair,
+                             GThreadPool* pool,
+                             int dir_fd,
+                             const char* relative_path,
+                             guint depth) {
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        g_mutex_lock(&repair->mutex);
+        repair->stats.failed++;
+        g_mutex_unlock(&repair->mutex);
+        return;
+    }
+    struct repair_stats stats = {0};
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (is_dot_or_dot_dot(entry->d_name))
+            continue;
+        struct stat inode_stat;
+        if (fstatat(dirfd(dir), entry->d_name, &inode_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            stats.failed++;
+            continue;
+        }
+        const bool wrong_owner =
+            inode_stat.st_uid != repair->uid || inode_stat.st_gid != repair->gid;
+        repair_inode(repair, dirfd(dir), entry->d_name, &inode_stat, &stats);
+        if (!S_ISDIR(inode_stat.st_mode))
+            continue;
+
+        char* child_path = relative_path ? g_build_filename(relative_path, entry->d_name, NULL)
+                                         : g_strdup(entry->d_name);
+        if (depth + 1 == UNIT_DEPTH) {
+            // A unit that was repaired and has since been written by another owner, e.g. on
+            // another device, is repaired again.
+            if (!wrong_owner && g_hash_table_contains(repair->done_units, child_path)) {
+                g_free(child_path);
+                continue;
+            }
+            g_mutex_lock(&repair->mutex);
+            repair->units_left++;
+            g_mutex_unlock(&repair->mutex);
+            g_thread_pool_push(pool, child_path, NULL);
+            continue;
+        }
+        const int child_fd =
+            openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child_fd < 0)
+            stats.failed++;
+        else
+            split_into_units(repair, pool, child_fd, child_path, depth + 1);
+        g_free(child_path);
+    }
+    closedir(dir);
+
+    g_mutex_lock(&repair->mutex);
+    add_stats(&repair->stats, &stats);
+    g_mutex_unlock(&repair->mutex);
+}
+
+// Read the units that have been repaired for this owner, and open the checkpoint file for
+// appending more. Return false if the checkpoint file could not be opened, and set *complete if
+// the whole tree has been repaired for this owner before.
+static bool open_checkpoint(struct repair* repair, const char* checkpoint_path, bool* complete) {
+    g_autofree char* owner = g_strdup_printf("%u:%u", repair->uid, repair->gid);
+    bool same_owner = false;
+    *complete = false;
+
+    FILE* fp = fopen(checkpoint_path, "r");
+    if (fp) {
+        char* line = NULL;
+        size_t line_size = 0;
+        ssize_t length;
+        for (guint line_number = 0; (length = getline(&line, &line_size, fp)) != -1;
+             ++line_number) {
+            if (length > 0 && line[length - 1] == '\n')
+                line[length - 1] = '\0';
+            if (line_number == 0)
+                same_owner = strcmp(line, owner) == 0;
+            else if (!same_owner)
+                break;
+            else if (strcmp(line, CHECKPOINT_COMPLETE) == 0)
+                *complete = true;
+            else
+                g_hash_table_add(repair->done_units, g_strdup(line));
+        }
+        free(line);
+        fclose(fp);
+    }
+
+    repair->checkpoint = fopen(checkpoint_path, same_owner ? "a" : "w");
+    if (!repair->checkpoint) {
+        log_error("Failed to open %s: %s", checkpoint_path, strerror(errno));
+        return false;
+    }
+    if (!same_owner)
+        fprintf(repair->checkpoint, "%s\n", owner);
+    else if (*complete)
+        log_info("Verifying ownership of %s, which has been repaired for %s before",
+                 repair->root,
+                 owner);
+    else
+        log_info("Resuming ownership repair of %s, %u units are already done",
+                 repair->root,
+                 g_hash_table_size(repair->done_units));
+    return true;
+}
+
+bool ownership_repair(const char* root, uid_t uid, gid_t gid, const char* checkpoint_path) {
+    struct repair repair = {.root = root, .uid = uid, .gid = gid};
+    repair.done_units = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_mutex_init(&repair.mutex);
+    g_cond_init(&repair.unit_done);
+    const gint64 start = g_get_monotonic_time();
+    bool success = false;
+
+    bool complete;
+    if (!open_checkpoint(&repair, checkpoint_path, &complete))
+        goto end;
+
+    struct stat root_stat;
+    const int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0 || fstat(root_fd, &root_stat) != 0) {
+        log_error("Failed to open %s: %s", root, strerror(errno));
+        if (root_fd >= 0)
+            close(root_fd);
+        goto end;
+    }
+    repair.stats.visited++;
+    if (root_stat.st_uid != uid || root_stat.st_gid != gid) {
+        if (fchown(root_fd, uid, gid) == 0)
+            repair.stats.repaired++;
+        else
+            repair.stats.failed++;
+    }
+
+    GThreadPool* pool = g_thread_pool_new(repair_unit, &repair, REPAIR_THREADS, true, NULL);
+    split_into_units(&repair, pool, root_fd, NULL, 0);
+
+    gint64 next_report = g_get_monotonic_time() + PROGRESS_INTERVAL_S * G_TIME_SPAN_SECOND;
+    g_mutex_lock(&repair.mutex);
+    while (repair.units_left > 0)
+        if (!g_cond_wait_until(&repair.unit_done, &repair.mutex, next_report)) {
+            log_info("Repairing ownership of %s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+                     " inodes changed so far, %u units left, %" G_GINT64_FORMAT " s elapsed",
+                     root,
+                     repair.stats.repaired,
+                     repair.stats.visited,
+                     repair.units_left,
+                     (g_get_monotonic_time() - start) / G_TIME_SPAN_SECOND);
+            next_report += PROGRESS_INTERVAL_S * G_TIME_SPAN_SECOND;
+        }
+    g_mutex_unlock(&repair.mutex);
+    g_thread_pool_free(pool, false, true);
+
+    log_info("Repaired ownership of %s in %.1f s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+             " inodes changed, %" G_GUINT64_FORMAT " failed",
+             root,
+             (g_get_monotonic_time() - start) / 1e6,
+             repair.stats.repaired,
+             repair.stats.visited,
+             repair.stats.failed);
+    success = repair.stats.failed == 0;
+    if (success && !complete)
+        fprintf(repair.checkpoint, "%s\n", CHECKPOINT_COMPLETE);
+    else if (!success)
+        log_error("Failed to change the owner of %" G_GUINT64_FORMAT " inodes below %s",
+                  repair.stats.failed,
+                  root);
+
+end:
+    if (repair.checkpoint)
+        fclose(repair.checkpoint);
+    g_hash_table_destroy(repair.done_units);
+    g_cond_clear(&repair.unit_done);
+    g_mutex_clear(&repair.mutex);
+    return success;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Give every file in a directory tree the same owner, like chown -R, but only change the inodes
+// that have another owner, and spread the work over several threads. The tree is split into units
+// at a fixed depth, and every finished unit is recorded in a checkpoint file, so that a repair
+// that was interrupted, e.g. by a reboot, resumes where it stopped. Once a repair has completed for
+// the same owner, later repairs only check the inodes above the units and the units themselves,
+// and repair the units that are new or have another owner. Progress is logged while the repair
+// runs.
+
+// Return false if the tree could not be walked or some inodes could not be changed. Changing the
+// owner of a file requires root privileges.
+bool ownership_repair(const char* root, uid_t uid, gid_t gid, const char* checkpoint_path);
@@ -0,0 +1,195 @@
+#include "parameters.h"
+#include "log.h"
+#include "metrics.h"
+#include <stddef.h>
+#include <stdlib.h>
+
+enum parameter_type { PARAMETER_TYPE_BOOL, PARAMETER_TYPE_INT, PARAMETER_TYPE_STRING };
+
+struct parameter_definition {
+    const char* name;
+    enum parameter_type type;
+    size_t offset;              // Offset of the value in struct parameter_values
+    const char* default_value;  // Used if the parameter cannot be read, same as in manifest.json
+};
+
+#define BOOL_PARAMETER(name, member, default_value) \
+    {name, PARAMETER_TYPE_BOOL, offsetof(struct parameter_values, member), default_value}
+#define INT_PARAMETER(name, member, default_value) \
+    {name, PARAMETER_TYPE_INT, offsetof(struct parameter_values, member), default_value}
+#define STRING_PARAMETER(name, member, default_value) \
+    {name, PARAMETER_TYPE_STRING, offsetof(struct parameter_values, member), default_value}
+
+#define DOCKER_HUB "https://registry-1.docker.io"
+
+static const struct parameter_definition parameter_definitions[] = {
+    STRING_PARAMETER(PARAM_APPLICATION_LOG_LEVEL, application_log_level, "info"),
+    INT_PARAMETER(PARAM_CONTAINER_LOG_MAX_FILES, container_log_max_files, "3"),
+    INT_PARAMETER(PARAM_CONTAINER_LOG_MAX_SIZE, container_log_max_size, "10"),
+    STRING_PARAMETER(PARAM_CONTAINER_LOG_POLICY, container_log_policy, "local"),
+    STRING_PARAMETER(PARAM_DEFAULT_ULIMITS, default_ulimits, ""),
+    STRING_PARAMETER(PARAM_DOCKERD_LOG_LEVEL, dockerd_log_level, "warn"),
+    INT_PARAMETER(PARAM_DOCKERD_STOP_TIMEOUT, dockerd_stop_timeout, "13"),
+    STRING_PARAMETER(PARAM_IMAGE_PRELOAD, image_preload, "none"),
+    BOOL_PARAMETER(PARAM_IPC_SOCKET, ipc_socket, "no"),
+    INT_PARAMETER(PARAM_MAX_CONCURRENT_DOWNLOADS, max_concurrent_downloads, "0"),
+    INT_PARAMETER(PARAM_MAX_CONCURRENT_UPLOADS, max_concurrent_uploads, "0"),
+    INT_PARAMETER(PARAM_MAX_DOWNLOAD_ATTEMPTS, max_download_attempts, "0"),
+    BOOL_PARAMETER(PARAM_NETWORK_ACCELERATION, network_acceleration, "no"),
+    STRING_PARAMETER(PARAM_NETWORK_PROFILE, network_profile, "compatible"),
+    BOOL_PARAMETER(PARAM_REGISTRY_CACHE, registry_cache, "no"),
+    INT_PARAMETER(PARAM_REGISTRY_CACHE_MAX_SIZE, registry_cache_max_size, "4096"),
+    INT_PARAMETER(PARAM_REGISTRY_CACHE_PORT, registry_cache_port, "29500"),
+    BOOL_PARAMETER(PARAM_REGISTRY_CACHE_SHARED, registry_cache_shared, "no"),
+    STRING_PARAMETER(PARAM_REGISTRY_CACHE_UPSTREAM, registry_cache_upstream, DOCKER_HUB),
+    STRING_PARAMETER(PARAM_REGISTRY_MIRRORS, registry_mirrors, ""),
+    INT_PARAMETER(PARAM_RESOURCE_SAMPLE_INTERVAL, resource_sample_interval, "10"),
+    INT_PARAMETER(PARAM_RESOURCE_SAMPLE_RETENTION, resource_sample_retention, "60"),
+    BOOL_PARAMETER(PARAM_SD_CARD_SUPPORT, sd_card_support, "no"),
+    INT_PARAMETER(PARAM_SD_CARD_WAIT_TIMEOUT, sd_card_wait_timeout, "30"),
+    BOOL_PARAMETER(PARAM_TCP_SOCKET, tcp_socket, "yes"),
+    BOOL_PARAMETER(PARAM_USE_TLS, use_tls, "yes"),
+};
+
+#define NUM_PARAMETERS (sizeof(parameter_definitions) / sizeof(parameter_definitions[0]))
+
+static const struct parameter_definition* find_definition(const char* name) {
+    for (size_t i = 0; i < NUM_PARAMETERS; ++i)
+        if (strcmp(parameter_definitions[i].name, name) == 0)
+            return &parameter_definitions[i];
+    return NULL;
+}
+
+static void store_value(struct parameter_values* values,
+                        const struct parameter_definition* definition,
+                        const char* value) {
+    void* member = (char*)values + definition->offset;
+    switch (definition->type) {
+        case PARAMETER_TYPE_BOOL:
+            // A parameter of type "bool:no,yes" is guaranteed to contain one of those strings.
+            *(bool*)member = strcmp(value, "yes") == 0;
+            break;
+        case PARAMETER_TYPE_INT:
+            // The parameter service enforces the range given in manifest.json.
+            *(int*)member = atoi(value);
+            break;
+        case PARAMETER_TYPE_STRING:
+            g_free(*(char**)member);
+            *(char**)member = g_strdup(value);
+            break;
+    }
+}
+
+static void load_value(struct parameters* parameters,
+                       const struct parameter_definition* definition) {
+    GError* error = NULL;
+    g_autofree char* value = NULL;
+    const gint64 start = g_get_monotonic_time();
+    const bool read = ax_parameter_get(parameters->handle, definition->name, &value, &error);
+    metrics_observe(METRICS_PARAMETER_READ, g_get_monotonic_time() - start);
+    if (!read) {
+        log_error("Failed to fetch parameter value of %s, using %s. Error: %s",
+                  definition->name,
+                  definition->default_value,
+                  error->message);
+        g_clear_error(&error);
+    }
+    store_value(&parameters->values, definition, value ? value : definition->default_value);
+}
+
+static void parameter_changed(const gchar* name, const gchar* value, gpointer parameters_void_ptr) {
+    struct parameters* parameters = parameters_void_ptr;
+    const gchar* parname = name + strlen("root." APP_NAME ".");
+
+    const struct parameter_definition* definition = find_definition(parname);
+    if (!definition)
+        return;
+    store_value(&parameters->values, definition, value);
+
+    parameters->callback(parname, value, parameters->user_data);
+}
+
+struct parameters* parameters_new(parameter_changed_t callback, void* user_data) {
+    GError* error = NULL;
+    struct parameters* parameters = g_malloc0(sizeof(struct parameters));
+    parameters->callback = callback;
+    parameters->user_data = user_data;
+
+    if (!(parameters->handle = ax_parameter_new(APP_NAME, &error))) {
+        log_error("Error when creating AXParameter: %s", error->message);
+        goto error;
+    }
+
+    for (size_t i = 0; i < NUM_PARAMETERS; ++i) {
+        const struct parameter_definition* definition = &parameter_definitions[i];
+        load_value(parameters, definition);
+        if (!ax_parameter_register_callback(parameters->handle,
+                                            definition->name,
+                                            parameter_changed,
+                                            parameters,
+                                            &error)) {
+            log_error("Could not register %s callback. Error: %s",
+                      definition->name,
+                      error->message);
+            goto error;
+        }
+    }
+    return parameters;
+
+error:
+    g_clear_error(&error);
+    parameters_free(parameters);
+    return NULL;
+}
+
+static char** string_member(struct parameter_values* values,
+                            const struct parameter_definition* definition) {
+    return (char**)((char*)values + definition->offset);
+}
+
+void parameter_values_copy(struct parameter_values* dest, const struct parameter_values* src) {
+    parameter_values_clear(dest);
+    *dest = *src;
+    for (size_t i = 0; i < NUM_PARAMETERS; ++i)
+        if (parameter_definitions[i].type == PARAMETER_TYPE_STRING) {
+            char** member = string_member(dest, &parameter_definitions[i]);
+            *member = g_strdup(*member);
+        }
+}
+
+void parameter_values_clear(struct parameter_values* values) {
+    for (size_t i = 0; i < NUM_PARAMETERS; ++i)
+        if (parameter_definitions[i].type == PARAMETER_TYPE_STRING)
+            g_clear_pointer(string_member(values, &parameter_definitions[i]), g_free);
+    memset(values, 0, sizeof(*values));
+}
+
+void parameters_free(struct parameters* parameters) {
+    if (!parameters)
+        return;
+    if (parameters->handle)
+        ax_parameter_free(parameters->handle);
+    parameter_values_clear(&parameters->values);
+    g_free(parameters->status);
+    g_free(parameters);
+}
+
+void parameters_set_status(struct parameters* parameters, const char* status) {
+    if (g_strcmp0(parameters->status, status) == 0) {
+        log_debug("%s is already %s", PARAM_STATUS, status);
+        return;
+    }
+
+    log_debug("About to set %s to %s", PARAM_STATUS, status);
+    GError* error = NULL;
+    if (!ax_parameter_set(parameters->handle, PARAM_STATUS, status, true, &error)) {
+        log_error("Failed to write parameter value of %s to %s. Error: %s",
+                  PARAM_STATUS,
+                  status,
+                  error->message);
+        g_clear_error(&error);
+        return;
+    }
+    g_free(parameters->status);
+    parameters->status = g_strdup(status);
+}
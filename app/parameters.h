@@ -0,0 +1,88 @@
+#pragma once
+#include <axsdk/axparameter.h>
+#include <stdbool.h>
+
+#define PARAM_APPLICATION_LOG_LEVEL     "ApplicationLogLevel"
+#define PARAM_CONTAINER_LOG_MAX_FILES   "ContainerLogMaxFiles"
+#define PARAM_CONTAINER_LOG_MAX_SIZE    "ContainerLogMaxSize"
+#define PARAM_CONTAINER_LOG_POLICY      "ContainerLogPolicy"
+#define PARAM_DEFAULT_ULIMITS           "DefaultUlimits"
+#define PARAM_DOCKERD_LOG_LEVEL         "DockerdLogLevel"
+#define PARAM_DOCKERD_STOP_TIMEOUT      "DockerdStopTimeout"
+#define PARAM_IMAGE_PRELOAD             "ImagePreload"
+#define PARAM_IPC_SOCKET                "IPCSocket"
+#define PARAM_MAX_CONCURRENT_DOWNLOADS  "MaxConcurrentDownloads"
+#define PARAM_MAX_CONCURRENT_UPLOADS    "MaxConcurrentUploads"
+#define PARAM_MAX_DOWNLOAD_ATTEMPTS     "MaxDownloadAttempts"
+#define PARAM_NETWORK_ACCELERATION      "NetworkAcceleration"
+#define PARAM_NETWORK_PROFILE           "NetworkProfile"
+#define PARAM_REGISTRY_CACHE            "RegistryCache"
+#define PARAM_REGISTRY_CACHE_MAX_SIZE   "RegistryCacheMaxSize"
+#define PARAM_REGISTRY_CACHE_PORT       "RegistryCachePort"
+#define PARAM_REGISTRY_CACHE_SHARED     "RegistryCacheShared"
+#define PARAM_REGISTRY_CACHE_UPSTREAM   "RegistryCacheUpstream"
+#define PARAM_REGISTRY_MIRRORS          "RegistryMirrors"
+#define PARAM_RESOURCE_SAMPLE_INTERVAL  "ResourceSampleInterval"
+#define PARAM_RESOURCE_SAMPLE_RETENTION "ResourceSampleRetention"
+#define PARAM_SD_CARD_SUPPORT           "SDCardSupport"
+#define PARAM_SD_CARD_WAIT_TIMEOUT      "SDCardWaitTimeout"
+#define PARAM_TCP_SOCKET                "TCPSocket"
+#define PARAM_USE_TLS                   "UseTLS"
+#define PARAM_STATUS                    "Status"
+
+// Typed snapshot of the application parameters. Parameters of type "bool:no,yes" are stored as
+// bool, integers as int and enums as strings.
+struct parameter_values {
+    char* application_log_level;
+    int container_log_max_files;
+    int container_log_max_size;  // MiB per file
+    char* container_log_policy;
+    char* default_ulimits;  // Comma separated <name>=<soft>[:<hard>], such as nofile=1024:4096
+    char* dockerd_log_level;
+    int dockerd_stop_timeout;  // Seconds
+    char* image_preload;       // Where image archives are preloaded from
+    bool ipc_socket;
+    int max_concurrent_downloads;  // Zero leaves these to daemon.json or the default of dockerd
+    int max_concurrent_uploads;
+    int max_download_attempts;
+    bool network_acceleration;
+    char* network_profile;
+    bool registry_cache;
+    int registry_cache_max_size;  // MiB
+    int registry_cache_port;      // The statistics are served on the next port
+    bool registry_cache_shared;
+    char* registry_cache_upstream;
+    char* registry_mirrors;         // Comma separated URLs
+    int resource_sample_interval;   // Seconds, zero disables sampling
+    int resource_sample_retention;  // Number of samples
+    bool sd_card_support;
+    int sd_card_wait_timeout;  // Seconds
+    bool tcp_socket;
+    bool use_tls;
+};
+
+// Called after the snapshot has been updated with the new value of the parameter.
+typedef void (*parameter_changed_t)(const char* name, const char* value, void* user_data);
+
+// Every read from AXParameter is a call to the parameter service, which can block for a long time
+// when there are queued callbacks. The snapshot is therefore read once at startup and then kept up
+// to date from the AXParameter callbacks, so the rest of the application never reads parameters.
+struct parameters {
+    AXParameter* handle;
+    struct parameter_values values;
+    char* status;  // Last value written to the Status parameter
+    parameter_changed_t callback;
+    void* user_data;
+};
+
+// Read all parameters and register callback to be called when one of them changes. Return NULL
+// on error.
+struct parameters* parameters_new(parameter_changed_t callback, void* user_data);
+void parameters_free(struct parameters* parameters);
+
+// Make dest a deep copy of src. Free the copy with parameter_values_clear().
+void parameter_values_copy(struct parameter_values* dest, const struct parameter_values* src);
+void parameter_values_clear(struct parameter_values* values);
+
+// Write the Status parameter, unless it already has this value.
+void parameters_set_status(struct parameters* parameters, const char* status);
@@ -0,0 +1,468 @@
+#include "port_forwarder.h"
+#include "docker_api.h"
+#include "log.h"
+#include "metrics.h"
+#include <arpa/inet.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define STATE_DIRECTORY    "rootlesskit"
+#define API_SOCKET         "api.sock"
+#define CHILD_PID_FILE     "child_pid"
+#define LOOPBACK           "127.0.0.1"
+#define API_TIMEOUT_MS     2000
+#define SETTLE_MS          200  // Address changes come in bursts, so wait for them to end
+#define RETRY_INTERVAL_MS  500
+#define MAX_SYNC_ATTEMPTS  20  // Also covers the time for rootlesskit to create its API socket
+#define CHANGE_HISTORY_LEN 16
+
+struct port_forwarder {
+    // Only used from the main loop
+    int port;  // Zero when stopped
+    bool forward_ipv6;
+    int netlink_fd;
+    guint netlink_id;
+    guint sync_id;
+    GCancellable* cancellable;  // Cancelled by stop, so that a running sync's result is ignored
+    bool syncing;               // A sync is running in a thread
+    bool sync_again;            // The addresses changed while syncing
+    int failed_syncs;           // Since the last address change
+    gint64 changed_at;  // Monotonic time of the first change not yet applied, or zero
+
+    GMutex mutex;         // Protects the members below
+    GPtrArray* forwards;  // char*, the addresses that port is forwarded on
+    GQueue changes;       // json_t*, oldest first
+};
+
+char* port_forwarder_state_directory(void) {
+    return g_strdup_printf("/var/run/user/%d/%s", getuid(), STATE_DIRECTORY);
+}
+
+static bool contains(GPtrArray* strings, const char* string) {
+    for (guint i = 0; i < strings->len; ++i)
+        if (strcmp(g_ptr_array_index(strings, i), string) == 0)
+            return true;
+    return false;
+}
+
+// A sync of the forwards with the addresses of the device, run in a thread since every request to
+// rootlesskit may take up to API_TIMEOUT_MS.
+struct sync_job {
+    struct port_forwarder* forwarder;  // Only used in sync_done(), unless cancelled
+    int port;
+    bool forward_ipv6;
+
+    bool success;
+    GPtrArray* forwarded;  // char*, NULL if the forwards could not be listed
+    json_t* added;
+    json_t* removed;
+};
+
+static void free_sync_job(void* job_void_ptr) {
+    struct sync_job* job = job_void_ptr;
+    if (job->forwarded)
+        g_ptr_array_unref(job->forwarded);
+    json_decref(job->added);
+    json_decref(job->removed);
+    g_free(job);
+}
+
+// Return the addresses of the device that the API should be reachable on.
+static GPtrArray* device_addresses(bool ipv6) {
+    GPtrArray* addresses = g_ptr_array_new_with_free_func(g_free);
+    struct ifaddrs* ifaddrs;
+    if (getifaddrs(&ifaddrs) != 0) {
+        log_error("Failed to list the addresses of the device: %s", strerror(errno));
+        return addresses;
+    }
+    for (struct ifaddrs* ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || (ifa->ifa_flags & IFF_LOOPBACK) || !(ifa->ifa_flags & IFF_UP))
+            continue;
+        char text[INET6_ADDRSTRLEN];
+        const void* address = NULL;
+        if (ifa->ifa_addr->sa_family == AF_INET) {
+            address = &((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+        } else if (ifa->ifa_addr->sa_family == AF_INET6 && ipv6) {
+            const struct in6_addr* address6 = &((struct sockaddr_in6*)ifa->ifa_addr)->sin6_addr;
+            if (!IN6_IS_ADDR_LINKLOCAL(address6))
+                address = address6;
+        }
+        if (address && inet_ntop(ifa->ifa_addr->sa_family, address, text, sizeof(text)) &&
+            !contains(addresses, text))
+            g_ptr_array_add(addresses, g_strdup(text));
+    }
+    freeifaddrs(ifaddrs);
+    return addresses;
+}
+
+// Send a request to the API of rootlesskit, with an optional JSON body. Return the parsed response
+// body, or NULL on error. A successful response without a body is returned as JSON null.
+static json_t* api_request(const char* method, const char* path, json_t* body) {
+    g_autofree char* state_directory = port_forwarder_state_directory();
+    g_autofree char* socket_path = g_build_filename(state_directory, API_SOCKET, NULL);
+    int fd = docker_api_connect_to(socket_path, API_TIMEOUT_MS);
+    if (fd == -1)
+        return NULL;
+
+    g_autofree char* text = body ? json_dumps(body, JSON_COMPACT) : NULL;
+    g_autofree char* response = NULL;
+    int status_code = 0;
+    const bool sent =
+        docker_api_send_request(fd, method, path, text ? "application/json" : NULL, text) &&
+        (!text ||
+         (docker_api_send_chunk(fd, text, strlen(text)) && docker_api_send_chunk(fd, NULL, 0)));
+    if (sent)
+        response = docker_api_read_response(fd, &status_code);
+    close(fd);
+    if (!response)
+        return NULL;
+
+    if (status_code / 100 != 2) {
+        log_debug("%s %s failed with status %d: %s", method, path, status_code, response);
+        return NULL;
+    }
+    json_t* result = json_loads(response, JSON_DECODE_ANY, NULL);
+    return result ? result : json_null();
+}
+
+static bool add_forward(int port, const char* address) {
+    json_t* spec = json_pack("{s:s, s:s, s:i, s:i}",
+                             "proto",
+                             "tcp",
+                             "parentIP",
+                             address,
+                             "parentPort",
+                             port,
+                             "childPort",
+                             port);
+    json_t* status = api_request("POST", "/v1/ports", spec);
+    const bool success = status;
+    json_decref(status);
+    json_decref(spec);
+    return success;
+}
+
+static void forward_loopback_thread(GTask* task, gpointer, gpointer port_ptr, GCancellable*) {
+    const int port = GPOINTER_TO_INT(port_ptr);
+    json_t* ports = api_request("GET", "/v1/ports", NULL);
+    if (!json_is_array(ports)) {
+        json_decref(ports);
+        log_error("Failed to list the forwards of rootlesskit, port %d is not forwarded on the "
+                  "loopback address",
+                  port);
+        g_task_return_boolean(task, false);
+        return;
+    }
+    bool forwarded = false;
+    size_t i;
+    json_t* status;
+    json_array_foreach(ports, i, status) {
+        json_t* spec = json_object_get(status, "spec");
+        const char* address = json_string_value(json_object_get(spec, "parentIP"));
+        if (g_strcmp0(address, LOOPBACK) == 0 &&
+            json_integer_value(json_object_get(spec, "parentPort")) == port)
+            forwarded = true;
+    }
+    json_decref(ports);
+
+    if (!forwarded && !add_forward(port, LOOPBACK)) {
+        log_error("rootlesskit did not forward port %d on the loopback address", port);
+        g_task_return_boolean(task, false);
+        return;
+    }
+    g_task_return_boolean(task, true);
+}
+
+void port_forwarder_forward_loopback(int port) {
+    // Nothing waits for the result, which forward_loopback_thread() logs.
+    GTask* task = g_task_new(NULL, NULL, NULL, NULL);
+    g_task_set_task_data(task, GINT_TO_POINTER(port), NULL);
+    g_task_run_in_thread(task, forward_loopback_thread);
+    g_object_unref(task);
+}
+
+pid_t port_forwarder_child_pid(void) {
+    g_autofree char* state_directory = port_forwarder_state_directory();
+    g_autofree char* path = g_build_filename(state_directory, CHILD_PID_FILE, NULL);
+    g_autofree char* contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL))
+        return 0;
+    return atoi(contents);
+}
+
+static bool remove_forward(json_int_t id) {
+    g_autofree char* path = g_strdup_printf("/v1/ports/%" JSON_INTEGER_FORMAT, id);
+    json_t* status = api_request("DELETE", path, NULL);
+    const bool success = status;
+    json_decref(status);
+    return success;
+}
+
+static void record_change(struct port_forwarder* forwarder, json_t* added, json_t* removed) {
+    const gint64 unreachable_us = g_get_monotonic_time() - forwarder->changed_at;
+    metrics_observe(METRICS_API_UNREACHABLE, unreachable_us);
+    log_info("Forwarded port %d on %zu new and removed %zu old addresses after %" G_GINT64_FORMAT
+             " ms",
+             forwarder->port,
+             json_array_size(added),
+             json_array_size(removed),
+             unreachable_us / 1000);
+
+    g_autoptr(GDateTime) now = g_date_time_new_now_utc();
+    g_autofree char* time = g_date_time_format_iso8601(now);
+    json_t* change = json_pack("{s:s, s:O, s:O, s:I}",
+                               "time",
+                               time,
+                               "added",
+                               added,
+                               "removed",
+                               removed,
+                               "unreachable_ms",
+                               (json_int_t)(unreachable_us / 1000));
+    g_mutex_lock(&forwarder->mutex);
+    g_queue_push_tail(&forwarder->changes, change);
+    while (g_queue_get_length(&forwarder->changes) > CHANGE_HISTORY_LEN)
+        json_decref(g_queue_pop_head(&forwarder->changes));
+    g_mutex_unlock(&forwarder->mutex);
+}
+
+// Make the forwards of rootlesskit match the addresses of the device. Forwards of other ports are
+// left alone. Fails if rootlesskit could not be reached or did not accept all changes.
+static void sync_thread(GTask* task, gpointer, gpointer job_void_ptr, GCancellable*) {
+    struct sync_job* job = job_void_ptr;
+    json_t* ports = api_request("GET", "/v1/ports", NULL);
+    if (!json_is_array(ports)) {
+        json_decref(ports);
+        g_task_return_boolean(task, false);
+        return;
+    }
+
+    job->success = true;
+    job->forwarded = g_ptr_array_new_with_free_func(g_free);
+    job->added = json_array();
+    job->removed = json_array();
+    GPtrArray* wanted = device_addresses(job->forward_ipv6);
+
+    size_t i;
+    json_t* status;
+    json_array_foreach(ports, i, status) {
+        json_t* spec = json_object_get(status, "spec");
+        const char* address = json_string_value(json_object_get(spec, "parentIP"));
+        if (!address || json_integer_value(json_object_get(spec, "parentPort")) != job->port)
+            continue;
+        if (contains(wanted, address) && !contains(job->forwarded, address)) {
+            g_ptr_array_add(job->forwarded, g_strdup(address));
+        } else if (remove_forward(json_integer_value(json_object_get(status, "id")))) {
+            json_array_append_new(job->removed, json_string(address));
+        } else {
+            g_ptr_array_add(job->forwarded, g_strdup(address));
+            job->success = false;
+        }
+    }
+
+    for (guint j = 0; j < wanted->len; ++j) {
+        const char* address = g_ptr_array_index(wanted, j);
+        if (contains(job->forwarded, address))
+            continue;
+        if (add_forward(job->port, address)) {
+            g_ptr_array_add(job->forwarded, g_strdup(address));
+            json_array_append_new(job->added, json_string(address));
+        } else {
+            log_debug("rootlesskit did not forward port %d on %s", job->port, address);
+            job->success = false;
+        }
+    }
+
+    g_ptr_array_unref(wanted);
+    json_decref(ports);
+    g_task_return_boolean(task, job->success);
+}
+
+static void schedule_sync(struct port_forwarder* forwarder, guint delay_ms);
+
+static void sync_done(GObject*, GAsyncResult* result, gpointer job_void_ptr) {
+    if (g_cancellable_is_cancelled(g_task_get_cancellable(G_TASK(result))))
+        return;  // Forwarding has been stopped or restarted since the sync was started.
+    struct sync_job* job = job_void_ptr;
+    struct port_forwarder* forwarder = job->forwarder;
+    forwarder->syncing = false;
+
+    if (json_array_size(job->added) || json_array_size(job->removed))
+        record_change(forwarder, job->added, job->removed);
+    if (job->forwarded) {
+        g_mutex_lock(&forwarder->mutex);
+        g_ptr_array_unref(forwarder->forwards);
+        forwarder->forwards = g_steal_pointer(&job->forwarded);
+        g_mutex_unlock(&forwarder->mutex);
+    }
+
+    if (forwarder->sync_again) {
+        forwarder->sync_again = false;
+        schedule_sync(forwarder, SETTLE_MS);
+    } else if (job->success) {
+        forwarder->failed_syncs = 0;
+        forwarder->changed_at = 0;
+    } else if (++forwarder->failed_syncs < MAX_SYNC_ATTEMPTS) {
+        schedule_sync(forwarder, RETRY_INTERVAL_MS);
+    } else {
+        log_warning("Failed to forward port %d on all addresses of the device, retrying when they "
+                    "change",
+                    forwarder->port);
+        forwarder->changed_at = 0;
+    }
+}
+
+static gboolean sync_timeout(gpointer forwarder_void_ptr) {
+    struct port_forwarder* forwarder = forwarder_void_ptr;
+    forwarder->sync_id = 0;
+    if (forwarder->syncing) {
+        forwarder->sync_again = true;
+        return G_SOURCE_REMOVE;
+    }
+
+    struct sync_job* job = g_new0(struct sync_job, 1);
+    job->forwarder = forwarder;
+    job->port = forwarder->port;
+    job->forward_ipv6 = forwarder->forward_ipv6;
+    forwarder->syncing = true;
+
+    GTask* task = g_task_new(NULL, forwarder->cancellable, sync_done, job);
+    g_task_set_task_data(task, job, free_sync_job);
+    g_task_run_in_thread(task, sync_thread);
+    g_object_unref(task);
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_sync(struct port_forwarder* forwarder, guint delay_ms) {
+    if (forwarder->sync_id)
+        g_source_remove(forwarder->sync_id);
+    forwarder->sync_id = g_timeout_add(delay_ms, sync_timeout, forwarder);
+}
+
+// Return true if the messages include an address change, or if some were lost.
+static bool read_netlink_messages(int fd) {
+    bool changed = false;
+    char buffer[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t len;
+    while ((len = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) != 0) {
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return changed || errno == ENOBUFS;
+        }
+        for (struct nlmsghdr* header = (struct nlmsghdr*)buffer; NLMSG_OK(header, len);
+             header = NLMSG_NEXT(header, len))
+            if (header->nlmsg_type == RTM_NEWADDR || header->nlmsg_type == RTM_DELADDR)
+                changed = true;
+    }
+    return changed;
+}
+
+static gboolean netlink_ready(gint fd, GIOCondition, gpointer forwarder_void_ptr) {
+    struct port_forwarder* forwarder = forwarder_void_ptr;
+    if (!read_netlink_messages(fd))
+        return G_SOURCE_CONTINUE;
+
+    log_debug("The addresses of the device changed");
+    if (!forwarder->changed_at)
+        forwarder->changed_at = g_get_monotonic_time();
+    forwarder->failed_syncs = 0;
+    schedule_sync(forwarder, SETTLE_MS);
+    return G_SOURCE_CONTINUE;
+}
+
+static int open_netlink_socket(void) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
+    };
+    if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        log_error("Failed to listen for address changes: %s", strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct port_forwarder* port_forwarder_new(void) {
+    struct port_forwarder* forwarder = g_new0(struct port_forwarder, 1);
+    forwarder->netlink_fd = -1;
+    g_mutex_init(&forwarder->mutex);
+    forwarder->forwards = g_ptr_array_new_with_free_func(g_free);
+    g_queue_init(&forwarder->changes);
+    return forwarder;
+}
+
+void port_forwarder_free(struct port_forwarder* forwarder) {
+    if (!forwarder)
+        return;
+    port_forwarder_stop(forwarder);
+    g_ptr_array_unref(forwarder->forwards);
+    g_queue_clear_full(&forwarder->changes, (GDestroyNotify)json_decref);
+    g_mutex_clear(&forwarder->mutex);
+    g_free(forwarder);
+}
+
+void port_forwarder_start(struct port_forwarder* forwarder, int port, bool forward_ipv6) {
+    port_forwarder_stop(forwarder);
+    forwarder->port = port;
+    forwarder->forward_ipv6 = forward_ipv6;
+    forwarder->cancellable = g_cancellable_new();
+
+    // Without the listener, the forwards are still set up once.
+    forwarder->netlink_fd = open_netlink_socket();
+    if (forwarder->netlink_fd != -1)
+        forwarder->netlink_id =
+            g_unix_fd_add(forwarder->netlink_fd, G_IO_IN, netlink_ready, forwarder);
+
+    // The API is unreachable from the start of rootlesskit until the first forwards are set up.
+    forwarder->changed_at = g_get_monotonic_time();
+    forwarder->failed_syncs = 0;
+    schedule_sync(forwarder, SETTLE_MS);
+}
+
+void port_forwarder_stop(struct port_forwarder* forwarder) {
+    if (forwarder->cancellable) {
+        g_cancellable_cancel(forwarder->cancellable);
+        g_clear_object(&forwarder->cancellable);
+    }
+    forwarder->syncing = false;
+    forwarder->sync_again = false;
+    if (forwarder->sync_id)
+        g_source_remove(forwarder->sync_id);
+    if (forwarder->netlink_id)
+        g_source_remove(forwarder->netlink_id);
+    if (forwarder->netlink_fd != -1)
+        close(forwarder->netlink_fd);
+    forwarder->sync_id = 0;
+    forwarder->netlink_id = 0;
+    forwarder->netlink_fd = -1;
+    forwarder->port = 0;
+    forwarder->changed_at = 0;
+
+    // The forwards end with rootlesskit.
+    g_mutex_lock(&forwarder->mutex);
+    g_ptr_array_set_size(forwarder->forwards, 0);
+    g_mutex_unlock(&forwarder->mutex);
+}
+
+json_t* port_forwarder_json(struct port_forwarder* forwarder) {
+    json_t* addresses = json_array();
+    json_t* changes = json_array();
+    g_mutex_lock(&forwarder->mutex);
+    for (guint i = 0; i < forwarder->forwards->len; ++i)
+        json_array_append_new(addresses, json_string(g_ptr_array_index(forwarder->forwards, i)));
+    for (GList* change = forwarder->changes.head; change; change = change->next)
+        json_array_append_new(changes, json_deep_copy(change->data));
+    g_mutex_unlock(&forwarder->mutex);
+    return json_pack("{s:o, s:o}", "addresses", addresses, "changes", changes);
+}
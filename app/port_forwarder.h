@@ -0,0 +1,40 @@
+#pragma once
+#include <glib.h>
+#include <jansson.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Forwarding of the TCP socket of dockerd from every address of the device into the network
+// namespace of rootlesskit. The forwards are managed through the port API of rootlesskit rather
+// than given on its command line, and a netlink listener updates them whenever an address is added
+// or removed, such as when DHCP hands out a new lease, so dockerd keeps running. IPv4 and global
+// IPv6 addresses are forwarded; IPv6 link-local addresses are not, since they need a scope. The
+// requests to rootlesskit are sent from a thread, so the main loop does not wait for them.
+
+// Return the directory that rootlesskit should be started with --state-dir, so that its API socket
+// is found. Free with g_free().
+char* port_forwarder_state_directory(void);
+
+struct port_forwarder* port_forwarder_new(void);
+void port_forwarder_free(struct port_forwarder* forwarder);
+
+// Forward port on all addresses of the device to the same port in the namespace of rootlesskit,
+// once rootlesskit has been started, and keep the forwards up to date until
+// port_forwarder_stop(). Forwards that rootlesskit does not accept are retried a few times and
+// then left until the addresses change again. IPv6 addresses are left out unless forward_ipv6,
+// for port drivers that only forward from IPv4 addresses.
+void port_forwarder_start(struct port_forwarder* forwarder, int port, bool forward_ipv6);
+void port_forwarder_stop(struct port_forwarder* forwarder);
+
+// Forward port on the loopback address of the device to the same port in the namespace of
+// rootlesskit, for services of the application that run in the namespace. The forward ends with
+// rootlesskit. The requests are sent from a thread, and a failure is only logged.
+void port_forwarder_forward_loopback(int port);
+
+// Return the pid of the child of rootlesskit, whose namespaces dockerd runs in, or zero if
+// rootlesskit has not started it.
+pid_t port_forwarder_child_pid(void);
+
+// Return the forwarded addresses and the recent address changes, with how long the API was
+// unreachable on the new addresses after each change. May be called from any thread.
+json_t* port_forwarder_json(struct port_forwarder* forwarder);
@@ -21,5 +21,5 @@ fi
 APP_NAME="$(basename "$(pwd)")"
 SD_CARD_AREA=/var/spool/storage/SD_DISK/areas/"$APP_NAME"
 if $IS_ROOT && [ -d "$SD_CARD_AREA" ]; then
-	chown -R "$UID_DOT_GID" "$SD_CARD_AREA"
+	./dockerdwrapper --repair-ownership "$SD_CARD_AREA"
 fi
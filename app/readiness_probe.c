@@ -0,0 +1,113 @@
+#include "readiness_probe.h"
+#include "docker_api.h"
+#include "log.h"
+#include <gio/gio.h>
+
+// Long enough for dockerd to restore its containers before it starts serving the API.
+#define PING_TIMEOUT_MS 10000
+
+struct readiness_probe {
+    guint interval_ms;
+    guint max_interval_ms;
+    gint64 deadline;  // Monotonic time
+    readiness_callback_t callback;
+    readiness_timeout_t timed_out;
+    void* user_data;
+
+    GSource* timer;       // Pending ping, or NULL
+    bool ping_running;    // A ping is running in a worker thread
+    bool cancelled;       // Free the probe when the running ping has finished
+    gint64 listening_at;  // Written by the worker thread, zero until the socket accepts connections
+};
+
+static void free_probe(struct readiness_probe* probe) {
+    if (probe->timer) {
+        g_source_destroy(probe->timer);
+        g_source_unref(probe->timer);
+    }
+    g_free(probe);
+}
+
+static void ping_thread(GTask* task, gpointer, gpointer probe_void_ptr, GCancellable*) {
+    struct readiness_probe* probe = probe_void_ptr;
+    if (!probe->listening_at) {
+        if (!docker_api_listening()) {
+            g_task_return_boolean(task, false);
+            return;
+        }
+        probe->listening_at = g_get_monotonic_time();
+    }
+    int status_code = 0;
+    g_autofree char* body = docker_api_request("GET", "/_ping", PING_TIMEOUT_MS, &status_code);
+    g_task_return_boolean(task, body && status_code == 200);
+}
+
+static gboolean ping(void* probe_void_ptr);
+
+static void ping_done(GObject*, GAsyncResult* result, gpointer probe_void_ptr) {
+    struct readiness_probe* probe = probe_void_ptr;
+    probe->ping_running = false;
+    if (probe->cancelled) {
+        free_probe(probe);
+        return;
+    }
+
+    if (g_task_propagate_boolean(G_TASK(result), NULL)) {
+        const gint64 listening_at = probe->listening_at;
+        readiness_callback_t callback = probe->callback;
+        void* user_data = probe->user_data;
+        free_probe(probe);
+        callback(listening_at, user_data);
+        return;
+    }
+    if (g_get_monotonic_time() >= probe->deadline) {
+        readiness_timeout_t timed_out = probe->timed_out;
+        void* user_data = probe->user_data;
+        free_probe(probe);
+        timed_out(user_data);
+        return;
+    }
+
+    log_debug("dockerd is not ready, pinging it again in %u ms", probe->interval_ms);
+    probe->timer = g_timeout_source_new(probe->interval_ms);
+    g_source_set_callback(probe->timer, ping, probe, NULL);
+    g_source_attach(probe->timer, NULL);
+    probe->interval_ms = MIN(probe->interval_ms * 2, probe->max_interval_ms);
+}
+
+static gboolean ping(void* probe_void_ptr) {
+    struct readiness_probe* probe = probe_void_ptr;
+    g_clear_pointer(&probe->timer, g_source_unref);
+
+    GTask* task = g_task_new(NULL, NULL, ping_done, probe);
+    g_task_set_task_data(task, probe, NULL);
+    g_task_run_in_thread(task, ping_thread);
+    g_object_unref(task);
+    probe->ping_running = true;
+    return G_SOURCE_REMOVE;
+}
+
+struct readiness_probe* readiness_probe_start(guint initial_interval_ms,
+                                              guint max_interval_ms,
+                                              guint deadline_ms,
+                                              readiness_callback_t callback,
+                                              readiness_timeout_t timed_out,
+                                              void* user_data) {
+    struct readiness_probe* probe = g_malloc0(sizeof(struct readiness_probe));
+    probe->interval_ms = initial_interval_ms;
+    probe->max_interval_ms = max_interval_ms;
+    probe->deadline = g_get_monotonic_time() + (gint64)deadline_ms * 1000;
+    probe->callback = callback;
+    probe->timed_out = timed_out;
+    probe->user_data = user_data;
+    ping(probe);
+    return probe;
+}
+
+void readiness_probe_cancel(struct readiness_probe* probe) {
+    if (probe->ping_running)
+        // The worker thread uses the probe, so let ping_done() free it.
+        probe->cancelled = true;
+    else
+        free_probe(probe);
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <glib.h>
+
+// Finds out when a newly started dockerd is ready, by sending GET /_ping to its API socket from a
+// worker thread until it answers. dockerd accepts connections before it serves the API, so a ping
+// usually blocks until dockerd is ready rather than failing. If it fails, for instance because the
+// socket does not exist yet, the ping is retried after a delay that is doubled after each attempt,
+// from initial_interval_ms up to max_interval_ms. Probing gives up when dockerd has not answered
+// deadline_ms after the start, so that a dockerd that hangs during its initialization is noticed.
+
+// Called from the main loop when dockerd has answered. listening_at is the monotonic time when the
+// socket was first found to accept connections. The probe has freed itself when this is called.
+typedef void (*readiness_callback_t)(gint64 listening_at, void* user_data);
+
+// Called from the main loop when dockerd has not answered by the deadline. The probe has freed
+// itself when this is called.
+typedef void (*readiness_timeout_t)(void* user_data);
+
+struct readiness_probe* readiness_probe_start(guint initial_interval_ms,
+                                              guint max_interval_ms,
+                                              guint deadline_ms,
+                                              readiness_callback_t callback,
+                                              readiness_timeout_t timed_out,
+                                              void* user_data);
+
+// Stop probing and free the probe. The callback will not be called.
+void readiness_probe_cancel(struct readiness_probe* probe);
@@ -0,0 +1,71 @@
+#include "reconfigure.h"
+#include <glib.h>
+
+static const char* const strategy_names[RECONFIGURE_STRATEGY_COUNT] = {"none",
+                                                                       "in-process",
+                                                                       "reload",
+                                                                       "restart"};
+
+const char* reconfigure_strategy_name(enum reconfigure_strategy strategy) {
+    return strategy_names[strategy];
+}
+
+// dockerd can only toggle its "debug" option on SIGHUP. Enabling it sets the log level to debug and
+// disabling it sets the log level to info, regardless of the --log-level option.
+static bool dockerd_log_level_reloadable(const char* running, const char* wanted) {
+    return strcmp(wanted, "debug") == 0 ||
+           (strcmp(wanted, "info") == 0 && strcmp(running, "debug") == 0);
+}
+
+enum reconfigure_strategy reconfigure_strategy(const struct parameter_values* running,
+                                               const struct parameter_values* wanted) {
+    // Sockets, TLS, the data root and the network settings are command line options, or options
+    // of rootlesskit and of the containers, that require a restart.
+    if (running->ipc_socket != wanted->ipc_socket ||
+        running->sd_card_support != wanted->sd_card_support ||
+        running->tcp_socket != wanted->tcp_socket || running->use_tls != wanted->use_tls ||
+        running->network_acceleration != wanted->network_acceleration ||
+        strcmp(running->network_profile, wanted->network_profile) != 0)
+        return RECONFIGURE_RESTART;
+
+    // The registry cache is added to the registry mirrors when dockerd is started, and it is shared
+    // through forwards that only end with rootlesskit.
+    if (running->registry_cache != wanted->registry_cache ||
+        running->registry_cache_port != wanted->registry_cache_port ||
+        running->registry_cache_shared != wanted->registry_cache_shared)
+        return RECONFIGURE_RESTART;
+
+    // Of the options in daemon.json, dockerd rereads neither default-ulimits nor the log
+    // configuration on SIGHUP.
+    if (strcmp(running->default_ulimits, wanted->default_ulimits) != 0 ||
+        strcmp(running->container_log_policy, wanted->container_log_policy) != 0 ||
+        running->container_log_max_files != wanted->container_log_max_files ||
+        running->container_log_max_size != wanted->container_log_max_size)
+        return RECONFIGURE_RESTART;
+
+    // DockerdStopTimeout and SDCardWaitTimeout are only read when they are needed, so they need no
+    // action.
+    enum reconfigure_strategy strategy = RECONFIGURE_NONE;
+
+    if (strcmp(running->dockerd_log_level, wanted->dockerd_log_level) != 0) {
+        if (!dockerd_log_level_reloadable(running->dockerd_log_level, wanted->dockerd_log_level))
+            return RECONFIGURE_RESTART;
+        strategy = RECONFIGURE_RELOAD;
+    }
+
+    if (running->max_concurrent_downloads != wanted->max_concurrent_downloads ||
+        running->max_concurrent_uploads != wanted->max_concurrent_uploads ||
+        running->max_download_attempts != wanted->max_download_attempts ||
+        strcmp(running->registry_mirrors, wanted->registry_mirrors) != 0)
+        strategy = RECONFIGURE_RELOAD;
+
+    if (strcmp(running->application_log_level, wanted->application_log_level) != 0 ||
+        strcmp(running->image_preload, wanted->image_preload) != 0 ||
+        strcmp(running->registry_cache_upstream, wanted->registry_cache_upstream) != 0 ||
+        running->registry_cache_max_size != wanted->registry_cache_max_size ||
+        running->resource_sample_interval != wanted->resource_sample_interval ||
+        running->resource_sample_retention != wanted->resource_sample_retention)
+        strategy = MAX(strategy, RECONFIGURE_IN_PROCESS);
+
+    return strategy;
+}
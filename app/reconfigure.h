@@ -0,0 +1,18 @@
+#pragma once
+#include "parameters.h"
+
+// How a parameter change is applied, from least to most disruptive.
+enum reconfigure_strategy {
+    RECONFIGURE_NONE,        // Nothing that dockerd or the application uses has changed.
+    RECONFIGURE_IN_PROCESS,  // Only settings of the application itself have changed.
+    RECONFIGURE_RELOAD,      // Regenerate the dockerd configuration file and send SIGHUP.
+    RECONFIGURE_RESTART,     // Restart rootlesskit and dockerd, which stops all containers.
+    RECONFIGURE_STRATEGY_COUNT,
+};
+
+const char* reconfigure_strategy_name(enum reconfigure_strategy strategy);
+
+// Return the least disruptive strategy that takes dockerd from the parameter values it is
+// running with to the wanted ones.
+enum reconfigure_strategy reconfigure_strategy(const struct parameter_values* running,
+                                               const struct parameter_values* wanted);
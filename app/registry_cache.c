@@ -0,0 +1,552 @@
+#include "registry_cache.h"
+#include "child_process.h"
+#include "docker_api.h"
+#include "log.h"
+#include <errno.h>
+#include <gio/gio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define REGISTRY             "registry"
+#define NSENTER              "nsenter"
+#define CONFIG_FILE          "registry-cache.yml"
+#define BLOBS_DIRECTORY      "docker/registry/v2/blobs/sha256"
+#define BLOB_DATA            "data"
+#define EVICT_INTERVAL_S     60
+#define EVICT_TARGET_PERCENT 90  // Evict below the cap, so that evictions come in batches
+#define RESTART_DELAY_S      10  // Doubled after every restart, up to the maximum
+#define MAX_RESTART_DELAY_S  300
+#define STOP_TIMEOUT_MS      5000  // Time for the registry to finish its requests
+#define STATS_TIMEOUT_MS     1000
+#define MIB                  (1024 * 1024)
+
+struct registry_cache {
+    // Only used from the main loop
+    char* directory;  // NULL when stopped
+    pid_t namespace_pid;
+    GPid pid;  // Zero when the registry is not running
+    guint watch_id;
+    guint restart_id;
+    guint evict_id;
+    guint restart_delay_s;
+    guint stopping;                   // Registries that have been stopped but not yet exited
+    bool spawn_pending;               // Spawn the registry when the stopping ones have exited
+    GCancellable* evict_cancellable;  // Cancelled by stop, NULL when stopped
+    bool evicting;                    // An eviction is running in a thread
+    bool evict_again;                 // Evict once more when the running eviction is done
+
+    GMutex mutex;  // Protects the members below, which are only written from the main loop
+    bool requested;
+    const char* inactive_reason;  // NULL when active or not requested
+    int port;
+    char* upstream;
+    gint64 max_size;  // Bytes
+    gint64 size;      // Bytes of blobs at the last eviction check
+    guint64 evicted_blobs;
+    guint64 evicted_bytes;
+    guint64 restarts;
+};
+
+struct blob {
+    char* directory;
+    gint64 size;  // Bytes on disk
+    time_t used;  // Last access or modification
+};
+
+struct evict_job {
+    struct registry_cache* cache;  // Only used in evict_done()
+    char* blobs_directory;
+    gint64 max_size;
+
+    gint64 size;  // Before the eviction, or -1 if the eviction was cancelled
+    guint evicted_blobs;
+    gint64 evicted_bytes;
+};
+
+char* registry_cache_mirror(int port) {
+    return g_strdup_printf("http://127.0.0.1:%d", port);
+}
+
+static char* runtime_file(const char* filename) {
+    return g_strdup_printf("/var/run/user/%d/%s", getuid(), filename);
+}
+
+static void set_inactive_reason(struct registry_cache* cache, const char* inactive_reason) {
+    g_mutex_lock(&cache->mutex);
+    cache->inactive_reason = inactive_reason;
+    g_mutex_unlock(&cache->mutex);
+}
+
+// The upstream is written to the configuration file as a quoted YAML string.
+static bool valid_upstream(const char* upstream) {
+    if (!g_str_has_prefix(upstream, "https://") && !g_str_has_prefix(upstream, "http://"))
+        return false;
+    for (const char* c = upstream; *c; ++c)
+        if (!g_ascii_isgraph(*c) || *c == '"' || *c == '\\')
+            return false;
+    return true;
+}
+
+static bool write_config(const char* path, const char* directory, const char* upstream, int port) {
+    g_autofree char* contents = g_strdup_printf("version: 0.1\n"
+                                                "log:\n"
+                                                "  level: warn\n"
+                                                "  accesslog:\n"
+                                                "    disabled: true\n"
+                                                "storage:\n"
+                                                "  filesystem:\n"
+                                                "    rootdirectory: \"%s\"\n"
+                                                "http:\n"
+                                                "  addr: 127.0.0.1:%d\n"
+                                                "  debug:\n"
+                                                "    addr: 127.0.0.1:%d\n"
+                                                "proxy:\n"
+                                                "  remoteurl: \"%s\"\n",
+                                                directory,
+                                                port,
+                                                REGISTRY_CACHE_DEBUG_PORT(port),
+                                                upstream);
+    GError* error = NULL;
+    if (!g_file_set_contents(path, contents, -1, &error)) {
+        log_error("Failed to write %s: %s", path, error->message);
+        g_clear_error(&error);
+        return false;
+    }
+    return true;
+}
+
+static void free_blob(gpointer blob_void_ptr) {
+    struct blob* blob = blob_void_ptr;
+    g_free(blob->directory);
+    g_free(blob);
+}
+
+static gint compare_used(gconstpointer a, gconstpointer b) {
+    const struct blob* blob_a = *(struct blob* const*)a;
+    const struct blob* blob_b = *(struct blob* const*)b;
+    return (blob_a->used > blob_b->used) - (blob_a->used < blob_b->used);
+}
+
+// Return the blobs in blobs_directory, which the registry stores as <prefix>/<digest>/data, and
+// set *total to their size. The listing stops early if cancellable is cancelled.
+static GPtrArray* list_blobs(const char* blobs_directory,
+                             GCancellable* cancellable,
+                             gint64* total) {
+    GPtrArray* blobs = g_ptr_array_new_with_free_func(free_blob);
+    *total = 0;
+    GDir* prefixes = g_dir_open(blobs_directory, 0, NULL);
+    if (!prefixes)
+        return blobs;  // Nothing has been cached yet
+
+    const char* prefix;
+    while (!g_cancellable_is_cancelled(cancellable) && (prefix = g_dir_read_name(prefixes))) {
+        g_autofree char* prefix_directory = g_build_filename(blobs_directory, prefix, NULL);
+        GDir* digests = g_dir_open(prefix_directory, 0, NULL);
+        if (!digests)
+            continue;
+        const char* digest;
+        while ((digest = g_dir_read_name(digests))) {
+            g_autofree char* directory = g_build_filename(prefix_directory, digest, NULL);
+            g_autofree char* data = g_build_filename(directory, BLOB_DATA, NULL);
+            struct stat data_stat;
+            if (stat(data, &data_stat) != 0)
+                continue;
+            struct blob* blob = g_new(struct blob, 1);
+            blob->directory = g_steal_pointer(&directory);
+            blob->size = (gint64)data_stat.st_blocks * 512;
+            blob->used = MAX(data_stat.st_atime, data_stat.st_mtime);
+            g_ptr_array_add(blobs, blob);
+            *total += blob->size;
+        }
+        g_dir_close(digests);
+    }
+    g_dir_close(prefixes);
+    return blobs;
+}
+
+static bool remove_blob(const struct blob* blob) {
+    g_autofree char* data = g_build_filename(blob->directory, BLOB_DATA, NULL);
+    if (unlink(data) != 0 || rmdir(blob->directory) != 0) {
+        log_warning("Failed to evict %s from the registry cache: %s",
+                    blob->directory,
+                    strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Delete the least recently used blobs until the blobs are below the cap. The registry fetches a
+// blob from upstream again if it is requested after having been evicted. Access times are only as
+// accurate as the mount options of the SD card allow, which with relatime is a day. Run in a
+// thread, since walking the blobs on the SD card can take long.
+static void evict_thread(GTask* task, gpointer, gpointer job_void_ptr, GCancellable* cancellable) {
+    struct evict_job* job = job_void_ptr;
+    gint64 size;
+    GPtrArray* blobs = list_blobs(job->blobs_directory, cancellable, &size);
+
+    if (size > job->max_size && !g_cancellable_is_cancelled(cancellable)) {
+        const gint64 target = job->max_size / 100 * EVICT_TARGET_PERCENT;
+        g_ptr_array_sort(blobs, compare_used);
+        for (guint i = 0; i < blobs->len && size - job->evicted_bytes > target &&
+                          !g_cancellable_is_cancelled(cancellable);
+             ++i) {
+            const struct blob* blob = g_ptr_array_index(blobs, i);
+            if (remove_blob(blob)) {
+                job->evicted_blobs++;
+                job->evicted_bytes += blob->size;
+            }
+        }
+        log_info("Evicted %u blobs of %" G_GINT64_FORMAT " MiB from the registry cache",
+                 job->evicted_blobs,
+                 job->evicted_bytes / MIB);
+    }
+    g_ptr_array_unref(blobs);
+    job->size = g_cancellable_is_cancelled(cancellable) ? -1 : size;
+    g_task_return_boolean(task, true);
+}
+
+static void free_evict_job(void* job_void_ptr) {
+    struct evict_job* job = job_void_ptr;
+    g_free(job->blobs_directory);
+    g_free(job);
+}
+
+static void start_eviction(struct registry_cache* cache);
+
+static void evict_done(GObject*, GAsyncResult*, gpointer job_void_ptr) {
+    struct evict_job* job = job_void_ptr;
+    struct registry_cache* cache = job->cache;
+    cache->evicting = false;
+
+    // Blobs that were evicted before a cancellation are gone all the same.
+    g_mutex_lock(&cache->mutex);
+    if (job->size >= 0)
+        cache->size = job->size - job->evicted_bytes;
+    cache->evicted_blobs += job->evicted_blobs;
+    cache->evicted_bytes += job->evicted_bytes;
+    g_mutex_unlock(&cache->mutex);
+
+    if (cache->evict_again && cache->directory) {
+        cache->evict_again = false;
+        start_eviction(cache);
+    }
+}
+
+// Evict in a thread, or once more after the running eviction if there is one, since the cap or
+// the directory may have changed since it started.
+static void start_eviction(struct registry_cache* cache) {
+    if (cache->evicting) {
+        cache->evict_again = true;
+        return;
+    }
+    struct evict_job* job = g_new0(struct evict_job, 1);
+    job->cache = cache;
+    job->blobs_directory = g_build_filename(cache->directory, BLOBS_DIRECTORY, NULL);
+    g_mutex_lock(&cache->mutex);
+    job->max_size = cache->max_size;
+    g_mutex_unlock(&cache->mutex);
+    cache->evicting = true;
+
+    GTask* task = g_task_new(NULL, cache->evict_cancellable, evict_done, job);
+    g_task_set_task_data(task, job, free_evict_job);
+    g_task_run_in_thread(task, evict_thread);
+    g_object_unref(task);
+}
+
+static gboolean evict_timeout(gpointer cache_void_ptr) {
+    start_eviction(cache_void_ptr);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean restart_registry(gpointer cache_void_ptr);
+
+static void registry_exited(GPid pid, gint status, gpointer cache_void_ptr) {
+    struct registry_cache* cache = cache_void_ptr;
+    g_spawn_close_pid(pid);
+    cache->pid = 0;
+    cache->watch_id = 0;
+
+    log_warning("The registry cache (%d) exited with status %d, restarting it in %u s",
+                pid,
+                status,
+                cache->restart_delay_s);
+    set_inactive_reason(cache, "the registry exited");
+    cache->restart_id = g_timeout_add_seconds(cache->restart_delay_s, restart_registry, cache);
+    cache->restart_delay_s = MIN(cache->restart_delay_s * 2, MAX_RESTART_DELAY_S);
+}
+
+// Only the user and network namespaces are entered. The registry keeps the mount namespace of the
+// device, where the configuration file in the runtime directory is.
+static bool spawn_registry(struct registry_cache* cache) {
+    GPtrArray* argv = g_ptr_array_new_with_free_func(g_free);
+    if (cache->namespace_pid) {
+        g_ptr_array_add(argv, g_strdup(NSENTER));
+        g_ptr_array_add(argv, g_strdup("--preserve-credentials"));
+        g_ptr_array_add(argv, g_strdup("-U"));
+        g_ptr_array_add(argv, g_strdup("-n"));
+        g_ptr_array_add(argv, g_strdup_printf("--target=%d", cache->namespace_pid));
+    }
+    g_ptr_array_add(argv, g_strdup(REGISTRY));
+    g_ptr_array_add(argv, g_strdup("serve"));
+    g_ptr_array_add(argv, runtime_file(CONFIG_FILE));
+    g_ptr_array_add(argv, NULL);
+
+    GError* error = NULL;
+    const bool spawned = g_spawn_async(NULL,
+                                       (char**)argv->pdata,
+                                       NULL,
+                                       G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH,
+                                       NULL,
+                                       NULL,
+                                       &cache->pid,
+                                       &error);
+    g_ptr_array_free(argv, true);
+    if (!spawned) {
+        log_error("Failed to start the registry cache: %s", error->message);
+        g_clear_error(&error);
+        return false;
+    }
+    log_debug("Child process registry (%d) was started.", cache->pid);
+    cache->watch_id = g_child_watch_add(cache->pid, registry_exited, cache);
+    return true;
+}
+
+static gboolean restart_registry(gpointer cache_void_ptr) {
+    struct registry_cache* cache = cache_void_ptr;
+    cache->restart_id = 0;
+
+    g_mutex_lock(&cache->mutex);
+    cache->restarts++;
+    g_mutex_unlock(&cache->mutex);
+    if (spawn_registry(cache))
+        set_inactive_reason(cache, NULL);
+    else
+        cache->restart_id = g_timeout_add_seconds(cache->restart_delay_s, restart_registry, cache);
+    return G_SOURCE_REMOVE;
+}
+
+static void start_registry(struct registry_cache* cache);
+
+static void registry_stopped(void* cache_void_ptr) {
+    struct registry_cache* cache = cache_void_ptr;
+    if (--cache->stopping == 0 && cache->spawn_pending) {
+        cache->spawn_pending = false;
+        start_registry(cache);
+    }
+}
+
+static void stop_registry(struct registry_cache* cache) {
+    if (!cache->pid)
+        return;
+    child_process_stop("The registry cache",
+                       cache->pid,
+                       cache->watch_id,
+                       STOP_TIMEOUT_MS,
+                       registry_stopped,
+                       cache);
+    cache->stopping++;
+    cache->pid = 0;
+    cache->watch_id = 0;
+}
+
+struct registry_cache* registry_cache_new(void) {
+    struct registry_cache* cache = g_new0(struct registry_cache, 1);
+    g_mutex_init(&cache->mutex);
+    return cache;
+}
+
+void registry_cache_free(struct registry_cache* cache) {
+    if (!cache)
+        return;
+    registry_cache_stop(cache);
+    // The stopping registries and the eviction refer to the cache until they are done.
+    while (cache->stopping || cache->evicting)
+        g_main_context_iteration(NULL, true);
+    g_free(cache->upstream);
+    g_mutex_clear(&cache->mutex);
+    g_free(cache);
+}
+
+static void stop_cache(struct registry_cache* cache) {
+    if (cache->restart_id)
+        g_source_remove(cache->restart_id);
+    if (cache->evict_id)
+        g_source_remove(cache->evict_id);
+    cache->restart_id = 0;
+    cache->evict_id = 0;
+    cache->spawn_pending = false;
+    cache->evict_again = false;
+    if (cache->evict_cancellable) {
+        g_cancellable_cancel(cache->evict_cancellable);
+        g_clear_object(&cache->evict_cancellable);
+    }
+    stop_registry(cache);
+    g_clear_pointer(&cache->directory, g_free);
+}
+
+static void deactivate(struct registry_cache* cache, const char* inactive_reason) {
+    set_inactive_reason(cache, inactive_reason);
+    log_warning("The registry cache is not active, since %s", inactive_reason);
+    stop_cache(cache);
+}
+
+// The registry is spawned once the previous one has exited, since it listens on the same ports.
+static void start_registry(struct registry_cache* cache) {
+    if (cache->stopping) {
+        log_debug("The registry cache will start when the previous registry has exited");
+        set_inactive_reason(cache, "the previous registry is stopping");
+        cache->spawn_pending = true;
+        return;
+    }
+    if (!spawn_registry(cache)) {
+        deactivate(cache, "the registry failed to start");
+        return;
+    }
+    set_inactive_reason(cache, NULL);
+    log_info("The registry cache of %s is active in %s, the registry is running as %d",
+             cache->upstream,
+             cache->directory,
+             cache->pid);
+}
+
+void registry_cache_start(struct registry_cache* cache,
+                          const char* directory,
+                          const char* upstream,
+                          int port,
+                          int max_size_mib,
+                          pid_t namespace_pid) {
+    stop_cache(cache);
+    g_mutex_lock(&cache->mutex);
+    cache->requested = true;
+    cache->port = port;
+    g_free(cache->upstream);
+    cache->upstream = g_strdup(upstream);
+    cache->max_size = (gint64)max_size_mib * MIB;
+    g_mutex_unlock(&cache->mutex);
+
+    const char* inactive_reason = NULL;
+    g_autofree char* config_path = runtime_file(CONFIG_FILE);
+    g_autofree char* registry = g_find_program_in_path(REGISTRY);
+    g_autofree char* nsenter = g_find_program_in_path(NSENTER);
+    if (!directory)
+        inactive_reason = "there is no SD card";
+    else if (!valid_upstream(upstream))
+        inactive_reason = "the upstream is not an http or https URL";
+    else if (!registry || (namespace_pid && !nsenter))
+        inactive_reason = "the registry is not installed";
+    else if (g_mkdir_with_parents(directory, 0755) != 0)
+        inactive_reason = "the cache directory could not be created";
+    else if (!write_config(config_path, directory, upstream, port))
+        inactive_reason = "no configuration file";
+    if (inactive_reason) {
+        deactivate(cache, inactive_reason);
+        return;
+    }
+
+    cache->directory = g_strdup(directory);
+    cache->namespace_pid = namespace_pid;
+    cache->restart_delay_s = RESTART_DELAY_S;
+    cache->evict_cancellable = g_cancellable_new();
+    // The cap may have been lowered while the cache was stopped.
+    start_eviction(cache);
+    cache->evict_id = g_timeout_add_seconds(EVICT_INTERVAL_S, evict_timeout, cache);
+    start_registry(cache);
+}
+
+void registry_cache_stop(struct registry_cache* cache) {
+    stop_cache(cache);
+    g_mutex_lock(&cache->mutex);
+    cache->requested = false;
+    cache->inactive_reason = NULL;
+    g_mutex_unlock(&cache->mutex);
+}
+
+void registry_cache_set_max_size(struct registry_cache* cache, int max_size_mib) {
+    g_mutex_lock(&cache->mutex);
+    cache->max_size = (gint64)max_size_mib * MIB;
+    g_mutex_unlock(&cache->mutex);
+    if (cache->directory)
+        start_eviction(cache);
+}
+
+// The registry publishes its statistics with expvar, under registry.proxy. Return NULL if it does
+// not answer.
+static json_t* read_proxy_statistics(int port) {
+    int fd = docker_api_connect_loopback(REGISTRY_CACHE_DEBUG_PORT(port), STATS_TIMEOUT_MS);
+    if (fd == -1)
+        return NULL;
+    g_autofree char* response = NULL;
+    int status_code = 0;
+    if (docker_api_send_request(fd, "GET", "/debug/vars", NULL, false))
+        response = docker_api_read_response(fd, &status_code);
+    close(fd);
+    if (!response || status_code != 200)
+        return NULL;
+
+    json_t* vars = json_loads(response, 0, NULL);
+    json_t* proxy = json_incref(json_object_get(json_object_get(vars, "registry"), "proxy"));
+    json_decref(vars);
+    return proxy;
+}
+
+// The registry counts every request it serves, whether from the cache or from upstream, in
+// Requests, and the ones it had to pull from upstream in Misses.
+static json_t* ratio_json(json_t* statistics) {
+    const json_int_t requests = json_integer_value(json_object_get(statistics, "Requests"));
+    const json_int_t misses = json_integer_value(json_object_get(statistics, "Misses"));
+    const json_int_t hits = MAX(requests - misses, 0);
+    return json_pack("{s:I, s:I, s:I, s:f}",
+                     "requests",
+                     requests,
+                     "hits",
+                     hits,
+                     "misses",
+                     misses,
+                     "hit_ratio",
+                     requests ? (double)hits / requests : 0.0);
+}
+
+json_t* registry_cache_json(struct registry_cache* cache) {
+    g_mutex_lock(&cache->mutex);
+    g_autofree char* mirror = registry_cache_mirror(cache->port);
+    json_t* json = json_pack("{s:b, s:b, s:s, s:I, s:I, s:I, s:I, s:I}",
+                             "requested",
+                             cache->requested,
+                             "active",
+                             cache->requested && !cache->inactive_reason,
+                             "mirror",
+                             mirror,
+                             "size_bytes",
+                             (json_int_t)cache->size,
+                             "max_size_bytes",
+                             (json_int_t)cache->max_size,
+                             "evicted_blobs",
+                             (json_int_t)cache->evicted_blobs,
+                             "evicted_bytes",
+                             (json_int_t)cache->evicted_bytes,
+                             "restarts",
+                             (json_int_t)cache->restarts);
+    if (cache->upstream)
+        json_object_set_new(json, "upstream", json_string(cache->upstream));
+    if (cache->inactive_reason)
+        json_object_set_new(json, "inactive_reason", json_string(cache->inactive_reason));
+    const bool active = cache->requested && !cache->inactive_reason;
+    const int port = cache->port;
+    g_mutex_unlock(&cache->mutex);
+
+    // The statistics of the registry start over with every start of it.
+    json_t* statistics = active ? read_proxy_statistics(port) : NULL;
+    if (statistics) {
+        json_t* blobs = json_object_get(statistics, "blobs");
+        const json_int_t served = json_integer_value(json_object_get(blobs, "BytesPushed"));
+        const json_int_t pulled = json_integer_value(json_object_get(blobs, "BytesPulled"));
+        json_t* manifests = json_object_get(statistics, "manifests");
+        json_object_set_new(json, "blobs", ratio_json(blobs));
+        json_object_set_new(json, "manifests", ratio_json(manifests));
+        json_object_set_new(json, "bytes_saved", json_integer(MAX(served - pulled, 0)));
+    }
+    json_decref(statistics);
+    return json;
+}
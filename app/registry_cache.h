@@ -0,0 +1,50 @@
+#pragma once
+#include <jansson.h>
+#include <sys/types.h>
+
+// Pull-through cache of an upstream registry, stored in a directory on the SD card, so that layers
+// are pulled over the WAN once, rather than by every device of a site and after every reset of the
+// data root. The cache is the registry of the distribution project in proxy mode, which dockerd
+// uses as a registry mirror. It runs in the network namespace of rootlesskit, where dockerd reaches
+// it on the loopback address without it being exposed on the network of the device. Since the
+// registry only expires content by age, the cache evicts the least recently used blobs itself
+// whenever the blobs exceed the size cap.
+
+// The registry listens on a port of the loopback address of its namespace. Other devices reach the
+// cache on the port if it is forwarded from the addresses of the device. The registry serves its
+// statistics on the next port, which must be forwarded to the same port on the loopback address of
+// the device.
+#define REGISTRY_CACHE_DEBUG_PORT(port) ((port) + 1)
+
+// Return the URL that dockerd should use as registry mirror for a cache on port. Free with
+// g_free().
+char* registry_cache_mirror(int port);
+
+struct registry_cache* registry_cache_new(void);
+
+// Stop the registry, and run the default main context until it has exited and a running eviction
+// is done.
+void registry_cache_free(struct registry_cache* cache);
+
+// Start the registry on port with its content in directory, as a cache of upstream, in the network
+// namespace of namespace_pid, or in the current one if it is zero. Restarts the registry if it is
+// running, once the previous one has exited. A NULL directory means that there is no SD card to
+// store the cache on. The registry is restarted after a delay if it exits on its own.
+void registry_cache_start(struct registry_cache* cache,
+                          const char* directory,
+                          const char* upstream,
+                          int port,
+                          int max_size_mib,
+                          pid_t namespace_pid);
+
+// Stop the registry and cancel a running eviction, without waiting for either. The registry is
+// killed if it has not exited a few seconds after being asked to.
+void registry_cache_stop(struct registry_cache* cache);
+
+// Change the size cap, and evict blobs in the background right away if the cache exceeds the new
+// one.
+void registry_cache_set_max_size(struct registry_cache* cache, int max_size_mib);
+
+// Return whether the cache is active and why not, its size and evictions, and the hit ratios and
+// bytes saved according to the registry. May be called from any thread.
+json_t* registry_cache_json(struct registry_cache* cache);
@@ -0,0 +1,424 @@
+#include "resource_sampler.h"
+#include "log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROC_FILE_SIZE 4096  // Enough for /proc/<pid>/stat, statm, io and status
+#define CGROUP_ROOT    "/sys/fs/cgroup"
+
+struct process {
+    pid_t pid;
+    pid_t ppid;
+    char name[16];       // At most 15 characters, as in /proc/<pid>/comm
+    guint64 start_time;  // In clock ticks after boot, which tells a reused pid apart
+    guint64 cpu_ticks;   // At the last sample
+    gint64 sampled_at;  // Zero before the first sample
+};
+
+struct resource_sampler {
+    // Only used from the main loop
+    guint interval_s;
+    pid_t root;           // Zero when not sampling
+    GSource* timer;       // Pending sample, or NULL
+    GHashTable* tree;     // pid -> struct process, the processes below root
+    GHashTable* outside;  // pids that have been found not to be below root
+    char* cgroup_dir;     // cgroup v2 directory of root, or NULL
+    guint64 cgroup_cpu_us;
+    guint64 cgroup_write_ops;
+    gint64 cgroup_sampled_at;
+
+    GMutex mutex;  // Protects the members below
+    guint retention;
+    GQueue samples;  // json_t*, oldest first
+};
+
+static long clock_ticks_per_second;
+static long page_size;
+
+// Read a file in /proc. The file is not kept open, since a large container tree would otherwise
+// use up the file descriptors of the application. Return false if the process has exited, or if
+// the file is not readable, as io is not without the same rights as ptrace.
+static bool read_proc_file(pid_t pid, const char* name, char* buffer) {
+    char path[64];
+    g_snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    const ssize_t length = read(fd, buffer, PROC_FILE_SIZE - 1);
+    close(fd);
+    if (length <= 0)
+        return false;
+    buffer[length] = '\0';
+    return true;
+}
+
+// Return the number following key in a file of "key: value" lines, or zero if key is missing.
+static guint64 value_of(const char* buffer, const char* key) {
+    const char* found = strstr(buffer, key);
+    return found ? g_ascii_strtoull(found + strlen(key), NULL, 10) : 0;
+}
+
+// Parse /proc/<pid>/stat. The name is within parentheses and may itself contain parentheses and
+// spaces, so the fields are counted from the last ')'.
+static bool parse_stat(const char* buffer,
+                       struct process* process,
+                       guint64* cpu_ticks,
+                       long* threads,
+                       guint64* start_time) {
+    const char* name_start = strchr(buffer, '(');
+    const char* name_end = strrchr(buffer, ')');
+    if (!name_start || !name_end || name_end < name_start)
+        return false;
+    const size_t name_length = MIN((size_t)(name_end - name_start - 1), sizeof(process->name) - 1);
+    memcpy(process->name, name_start + 1, name_length);
+    process->name[name_length] = '\0';
+
+    char state;
+    unsigned long long user_ticks;
+    unsigned long long system_ticks;
+    unsigned long long start_ticks;
+    if (sscanf(name_end + 1,
+               " %c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %ld %*d %llu",
+               &state,
+               &process->ppid,
+               &user_ticks,
+               &system_ticks,
+               threads,
+               &start_ticks) != 6)
+        return false;
+    *cpu_ticks = user_ticks + system_ticks;
+    *start_time = start_ticks;
+    return true;
+}
+
+// Read the parent of a process that has not been seen before. Return NULL if it has exited.
+static struct process* read_process(pid_t pid) {
+    struct process* process = g_malloc0(sizeof(struct process));
+    process->pid = pid;
+
+    char buffer[PROC_FILE_SIZE];
+    guint64 cpu_ticks;
+    long threads;
+    if (!read_proc_file(pid, "stat", buffer) ||
+        !parse_stat(buffer, process, &cpu_ticks, &threads, &process->start_time)) {
+        g_free(process);
+        return NULL;
+    }
+    return process;
+}
+
+static void add_to_tree(struct resource_sampler* sampler, struct process* process) {
+    g_hash_table_insert(sampler->tree, GINT_TO_POINTER(process->pid), process);
+}
+
+static gboolean is_not_listed(gpointer pid_ptr, gpointer, gpointer listed_void_ptr) {
+    return !g_hash_table_contains(listed_void_ptr, pid_ptr);
+}
+
+// Add the processes that have appeared below root since the last call. Only the processes that
+// have not been seen before are read, and they are placed in the tree if their parent is in it.
+static void discover_processes(struct resource_sampler* sampler) {
+    DIR* proc = opendir("/proc");
+    if (!proc) {
+        log_warning("Failed to open /proc: %s", strerror(errno));
+        return;
+    }
+    g_autoptr(GHashTable) listed = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_autoptr(GPtrArray) new_processes = g_ptr_array_new_with_free_func(g_free);
+    struct dirent* entry;
+    while ((entry = readdir(proc))) {
+        char* end;
+        const pid_t pid = strtol(entry->d_name, &end, 10);
+        if (*end || pid <= 0)
+            continue;
+        g_hash_table_add(listed, GINT_TO_POINTER(pid));
+        if (g_hash_table_contains(sampler->tree, GINT_TO_POINTER(pid)) ||
+            g_hash_table_contains(sampler->outside, GINT_TO_POINTER(pid)))
+            continue;
+        struct process* process = read_process(pid);
+        if (process && pid == sampler->root)
+            add_to_tree(sampler, process);
+        else if (process)
+            g_ptr_array_add(new_processes, process);
+    }
+    closedir(proc);
+
+    // Forget pids that have been released, since they may be reused by processes in the tree.
+    g_hash_table_foreach_remove(sampler->outside, is_not_listed, listed);
+
+    // A new process may be the parent of another new process, so repeat until none is added.
+    for (bool added = true; added;) {
+        added = false;
+        for (guint i = 0; i < new_processes->len; ++i) {
+            struct process* process = g_ptr_array_index(new_processes, i);
+            if (!g_hash_table_contains(sampler->tree, GINT_TO_POINTER(process->ppid)))
+                continue;
+            add_to_tree(sampler, g_ptr_array_steal_index_fast(new_processes, i--));
+            added = true;
+        }
+    }
+    for (guint i = 0; i < new_processes->len; ++i) {
+        const struct process* process = g_ptr_array_index(new_processes, i);
+        g_hash_table_add(sampler->outside, GINT_TO_POINTER(process->pid));
+    }
+}
+
+// Return NULL if the process has exited, even if its pid has been reused since.
+static json_t* sample_process(struct process* process, gint64 now) {
+    char buffer[PROC_FILE_SIZE];
+    guint64 cpu_ticks;
+    long threads;
+    guint64 start_time;
+    if (!read_proc_file(process->pid, "stat", buffer) ||
+        !parse_stat(buffer, process, &cpu_ticks, &threads, &start_time) ||
+        start_time != process->start_time)
+        return NULL;
+
+    json_t* json = json_pack("{s:i, s:i, s:s, s:I, s:I}",
+                             "pid",
+                             process->pid,
+                             "ppid",
+                             process->ppid,
+                             "name",
+                             process->name,
+                             "threads",
+                             (json_int_t)threads,
+                             "cpu_ms",
+                             (json_int_t)(cpu_ticks * 1000 / clock_ticks_per_second));
+    if (process->sampled_at) {
+        const double cpu_us = (cpu_ticks - process->cpu_ticks) * 1e6 / clock_ticks_per_second;
+        json_object_set_new(json,
+                            "cpu_percent",
+                            json_real(100 * cpu_us / (now - process->sampled_at)));
+    }
+    process->cpu_ticks = cpu_ticks;
+    process->sampled_at = now;
+
+    unsigned long resident_pages;
+    if (read_proc_file(process->pid, "statm", buffer) &&
+        sscanf(buffer, "%*u %lu", &resident_pages) == 1)
+        json_object_set_new(json, "rss_kib", json_integer(resident_pages * page_size / 1024));
+    if (read_proc_file(process->pid, "io", buffer)) {
+        json_object_set_new(json, "read_bytes", json_integer(value_of(buffer, "\nread_bytes:")));
+        json_object_set_new(json, "write_bytes", json_integer(value_of(buffer, "\nwrite_bytes:")));
+    }
+    if (read_proc_file(process->pid, "status", buffer)) {
+        json_object_set_new(json,
+                            "voluntary_switches",
+                            json_integer(value_of(buffer, "\nvoluntary_ctxt_switches:")));
+        json_object_set_new(json,
+                            "involuntary_switches",
+                            json_integer(value_of(buffer, "\nnonvoluntary_ctxt_switches:")));
+    }
+    return json;
+}
+
+static gint compare_pids(gconstpointer a, gconstpointer b) {
+    return GPOINTER_TO_INT(a) - GPOINTER_TO_INT(b);
+}
+
+static json_t* sample_processes(struct resource_sampler* sampler, gint64 now) {
+    json_t* processes = json_array();
+    GList* pids = g_list_sort(g_hash_table_get_keys(sampler->tree), compare_pids);
+    for (GList* pid = pids; pid; pid = pid->next) {
+        json_t* json = sample_process(g_hash_table_lookup(sampler->tree, pid->data), now);
+        if (json)
+            json_array_append_new(processes, json);
+        else
+            g_hash_table_remove(sampler->tree, pid->data);
+    }
+    g_list_free(pids);
+    return processes;
+}
+
+// Return the cgroup v2 directory of the process, or NULL if it is not known.
+static char* cgroup_of(pid_t pid) {
+    g_autofree char* path = g_strdup_printf("/proc/%d/cgroup", pid);
+    g_autofree char* contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL))
+        return NULL;
+    const char* line = g_str_has_prefix(contents, "0::") ? contents : strstr(contents, "\n0::");
+    if (!line)
+        return NULL;  // Only cgroup v1 is mounted
+    line += *line == '\n' ? 4 : 3;
+    g_autofree char* cgroup = g_strndup(line, strcspn(line, "\n"));
+    return g_strconcat(CGROUP_ROOT, cgroup, NULL);
+}
+
+static bool read_cgroup_file(const char* dir, const char* name, char** contents) {
+    g_autofree char* path = g_build_filename(dir, name, NULL);
+    return g_file_get_contents(path, contents, NULL, NULL);
+}
+
+static json_t* sample_cgroup(struct resource_sampler* sampler, gint64 now) {
+    g_autofree char* cpu_stat = NULL;
+    if (!sampler->cgroup_dir || !read_cgroup_file(sampler->cgroup_dir, "cpu.stat", &cpu_stat))
+        return NULL;
+
+    const guint64 cpu_us = value_of(cpu_stat, "usage_usec ");
+    const gint64 previous_sample = sampler->cgroup_sampled_at;
+    json_t* json = json_pack("{s:s, s:I}",
+                             "path",
+                             sampler->cgroup_dir + strlen(CGROUP_ROOT),
+                             "cpu_ms",
+                             (json_int_t)(cpu_us / 1000));
+    if (previous_sample)
+        json_object_set_new(json,
+                            "cpu_percent",
+                            json_real(100.0 * (cpu_us - sampler->cgroup_cpu_us) /
+                                      (now - previous_sample)));
+    sampler->cgroup_cpu_us = cpu_us;
+    sampler->cgroup_sampled_at = now;
+
+    g_autofree char* memory_current = NULL;
+    if (read_cgroup_file(sampler->cgroup_dir, "memory.current", &memory_current))
+        json_object_set_new(json,
+                            "memory_bytes",
+                            json_integer(g_ascii_strtoull(memory_current, NULL, 10)));
+
+    // One line per device: "<major>:<minor> rbytes=<n> wbytes=<n> rios=<n> ..."
+    g_autofree char* io_stat = NULL;
+    if (read_cgroup_file(sampler->cgroup_dir, "io.stat", &io_stat)) {
+        guint64 read_bytes = 0;
+        guint64 write_bytes = 0;
+        guint64 read_ops = 0;
+        guint64 write_ops = 0;
+        for (const char* field = io_stat; (field = strchr(field, ' ')); field++) {
+            if (g_str_has_prefix(field, " rbytes="))
+                read_bytes += g_ascii_strtoull(field + 8, NULL, 10);
+            else if (g_str_has_prefix(field, " wbytes="))
+                write_bytes += g_ascii_strtoull(field + 8, NULL, 10);
+            else if (g_str_has_prefix(field, " rios="))
+                read_ops += g_ascii_strtoull(field + 6, NULL, 10);
+            else if (g_str_has_prefix(field, " wios="))
+                write_ops += g_ascii_strtoull(field + 6, NULL, 10);
+        }
+        json_object_set_new(json, "read_bytes", json_integer(read_bytes));
+        json_object_set_new(json, "write_bytes", json_integer(write_bytes));
+        json_object_set_new(json, "read_ops", json_integer(read_ops));
+        json_object_set_new(json, "write_ops", json_integer(write_ops));
+        // Write operations per second on the block devices is what wears the flash, so it is the
+        // number to compare between container log policies.
+        if (previous_sample)
+            json_object_set_new(json,
+                                "write_iops",
+                                json_real(1e6 * (write_ops - sampler->cgroup_write_ops) /
+                                          (now - previous_sample)));
+        sampler->cgroup_write_ops = write_ops;
+    }
+    return json;
+}
+
+static void add_sample(struct resource_sampler* sampler, json_t* sample) {
+    g_mutex_lock(&sampler->mutex);
+    g_queue_push_tail(&sampler->samples, sample);
+    while (g_queue_get_length(&sampler->samples) > sampler->retention)
+        json_decref(g_queue_pop_head(&sampler->samples));
+    g_mutex_unlock(&sampler->mutex);
+}
+
+static gboolean take_sample(void* sampler_void_ptr) {
+    struct resource_sampler* sampler = sampler_void_ptr;
+    const gint64 start = g_get_monotonic_time();
+
+    discover_processes(sampler);
+    json_t* processes = sample_processes(sampler, start);
+    g_autoptr(GDateTime) now = g_date_time_new_now_utc();
+    g_autofree char* time = g_date_time_format_iso8601(now);
+    json_t* sample = json_pack("{s:s, s:o}", "time", time, "processes", processes);
+    json_t* cgroup = sample_cgroup(sampler, start);
+    if (cgroup)
+        json_object_set_new(sample, "cgroup", cgroup);
+    add_sample(sampler, sample);
+
+    log_debug("Sampled %u processes in %" G_GINT64_FORMAT " us",
+              g_hash_table_size(sampler->tree),
+              g_get_monotonic_time() - start);
+    return G_SOURCE_CONTINUE;
+}
+
+static void stop_timer(struct resource_sampler* sampler) {
+    if (sampler->timer) {
+        g_source_destroy(sampler->timer);
+        g_clear_pointer(&sampler->timer, g_source_unref);
+    }
+}
+
+static void start_timer(struct resource_sampler* sampler) {
+    stop_timer(sampler);
+    if (!sampler->root || !sampler->interval_s)
+        return;
+    sampler->timer = g_timeout_source_new_seconds(sampler->interval_s);
+    g_source_set_callback(sampler->timer, take_sample, sampler, NULL);
+    g_source_attach(sampler->timer, NULL);
+}
+
+struct resource_sampler* resource_sampler_new(guint interval_s, guint retention) {
+    clock_ticks_per_second = sysconf(_SC_CLK_TCK);
+    page_size = sysconf(_SC_PAGESIZE);
+
+    struct resource_sampler* sampler = g_malloc0(sizeof(struct resource_sampler));
+    sampler->interval_s = interval_s;
+    sampler->retention = MAX(retention, 1);
+    sampler->tree = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    sampler->outside = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_mutex_init(&sampler->mutex);
+    g_queue_init(&sampler->samples);
+    return sampler;
+}
+
+void resource_sampler_free(struct resource_sampler* sampler) {
+    if (!sampler)
+        return;
+    resource_sampler_stop(sampler);
+    g_hash_table_destroy(sampler->tree);
+    g_hash_table_destroy(sampler->outside);
+    g_queue_clear_full(&sampler->samples, (GDestroyNotify)json_decref);
+    g_mutex_clear(&sampler->mutex);
+    g_free(sampler);
+}
+
+void resource_sampler_configure(struct resource_sampler* sampler,
+                                guint interval_s,
+                                guint retention) {
+    g_mutex_lock(&sampler->mutex);
+    sampler->retention = MAX(retention, 1);
+    while (g_queue_get_length(&sampler->samples) > sampler->retention)
+        json_decref(g_queue_pop_head(&sampler->samples));
+    g_mutex_unlock(&sampler->mutex);
+
+    if (interval_s != sampler->interval_s) {
+        sampler->interval_s = interval_s;
+        start_timer(sampler);
+    }
+}
+
+void resource_sampler_start(struct resource_sampler* sampler, pid_t root) {
+    resource_sampler_stop(sampler);
+    sampler->root = root;
+    sampler->cgroup_dir = cgroup_of(root);
+    start_timer(sampler);
+}
+
+void resource_sampler_stop(struct resource_sampler* sampler) {
+    stop_timer(sampler);
+    sampler->root = 0;
+    g_hash_table_remove_all(sampler->tree);
+    g_hash_table_remove_all(sampler->outside);
+    g_clear_pointer(&sampler->cgroup_dir, g_free);
+    sampler->cgroup_sampled_at = 0;
+}
+
+json_t* resource_sampler_json(struct resource_sampler* sampler) {
+    json_t* samples = json_array();
+    g_mutex_lock(&sampler->mutex);
+    for (GList* sample = sampler->samples.head; sample; sample = sample->next)
+        json_array_append_new(samples, json_deep_copy(sample->data));
+    g_mutex_unlock(&sampler->mutex);
+    return samples;
+}
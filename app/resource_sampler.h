@@ -0,0 +1,29 @@
+#pragma once
+#include <glib.h>
+#include <jansson.h>
+#include <sys/types.h>
+
+// Periodically samples the CPU time, resident memory, I/O and context switches of every process
+// in the tree below a root process, such as rootlesskit, slirp4netns, dockerd, containerd and the
+// container shims, together with the statistics of the cgroup of the root process when cgroup v2
+// is available. Only processes that have appeared since the last sample are examined to see if
+// they belong to the tree, so a sample costs a few system calls per process. No files are kept
+// open between samples, so a large tree does not use up file descriptors. The last samples are
+// kept for the JSON report.
+
+struct resource_sampler* resource_sampler_new(guint interval_s, guint retention);
+void resource_sampler_free(struct resource_sampler* sampler);
+
+// Change the sampling interval and the number of samples that are kept. An interval of zero stops
+// sampling. Takes effect at once, also while sampling.
+void resource_sampler_configure(struct resource_sampler* sampler,
+                                guint interval_s,
+                                guint retention);
+
+// Start sampling the tree below root, or restart if sampling is already running. Samples that
+// were taken of a previous tree are kept.
+void resource_sampler_start(struct resource_sampler* sampler, pid_t root);
+void resource_sampler_stop(struct resource_sampler* sampler);
+
+// Return the kept samples as JSON, oldest first. May be called from any thread.
+json_t* resource_sampler_json(struct resource_sampler* sampler);
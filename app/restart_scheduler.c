@@ -0,0 +1,96 @@
+#include "restart_scheduler.h"
+#include "log.h"
+
+struct restart_source {
+    GSource source;
+    struct restart_scheduler* scheduler;
+};
+
+struct restart_scheduler {
+    GSource* source;  // Dispatched when its ready time, the time of the restart, is reached
+    gint64 debounce_us;
+    gint64 max_latency_us;
+    restart_action_t action;
+    void* user_data;
+
+    GMutex mutex;  // Protects the members below
+    gint64 first_request_time;
+    GPtrArray* reasons;
+    struct restart_scheduler_stats stats;
+};
+
+static gboolean dispatch(GSource* source, GSourceFunc, gpointer) {
+    struct restart_scheduler* scheduler = ((struct restart_source*)source)->scheduler;
+
+    g_mutex_lock(&scheduler->mutex);
+    g_source_set_ready_time(source, -1);
+    g_ptr_array_add(scheduler->reasons, NULL);
+    g_autofree char* reasons = g_strjoinv(", ", (char**)scheduler->reasons->pdata);
+    const guint merged = scheduler->reasons->len - 1;
+    const gint64 latency_us = g_get_monotonic_time() - scheduler->first_request_time;
+    g_ptr_array_set_size(scheduler->reasons, 0);
+    scheduler->stats.restarts++;
+    g_mutex_unlock(&scheduler->mutex);
+
+    log_info("Restarting dockerd %.1f s after first request, merging %u triggers: %s",
+             latency_us / 1e6,
+             merged,
+             reasons);
+    scheduler->action(reasons, scheduler->user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs source_funcs = {.dispatch = dispatch};
+
+struct restart_scheduler* restart_scheduler_new(guint debounce_ms,
+                                                guint max_latency_ms,
+                                                restart_action_t action,
+                                                void* user_data) {
+    struct restart_scheduler* scheduler = g_malloc0(sizeof(struct restart_scheduler));
+    scheduler->debounce_us = debounce_ms * G_TIME_SPAN_MILLISECOND;
+    scheduler->max_latency_us = max_latency_ms * G_TIME_SPAN_MILLISECOND;
+    scheduler->action = action;
+    scheduler->user_data = user_data;
+    scheduler->reasons = g_ptr_array_new_with_free_func(g_free);
+    g_mutex_init(&scheduler->mutex);
+
+    scheduler->source = g_source_new(&source_funcs, sizeof(struct restart_source));
+    ((struct restart_source*)scheduler->source)->scheduler = scheduler;
+    g_source_set_ready_time(scheduler->source, -1);
+    g_source_attach(scheduler->source, NULL);
+    return scheduler;
+}
+
+void restart_scheduler_free(struct restart_scheduler* scheduler) {
+    if (!scheduler)
+        return;
+    g_source_destroy(scheduler->source);
+    g_source_unref(scheduler->source);
+    g_ptr_array_unref(scheduler->reasons);
+    g_mutex_clear(&scheduler->mutex);
+    g_free(scheduler);
+}
+
+void restart_scheduler_request(struct restart_scheduler* scheduler, const char* reason) {
+    const gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&scheduler->mutex);
+    if (scheduler->reasons->len == 0)
+        scheduler->first_request_time = now;
+    g_ptr_array_add(scheduler->reasons, g_strdup(reason));
+    scheduler->stats.requests++;
+    // g_source_set_ready_time() is thread safe and wakes up the main loop if needed.
+    g_source_set_ready_time(scheduler->source,
+                            MIN(now + scheduler->debounce_us,
+                                scheduler->first_request_time + scheduler->max_latency_us));
+    g_mutex_unlock(&scheduler->mutex);
+
+    log_debug("Restart of dockerd requested: %s", reason);
+}
+
+void restart_scheduler_get_stats(struct restart_scheduler* scheduler,
+                                 struct restart_scheduler_stats* stats) {
+    g_mutex_lock(&scheduler->mutex);
+    *stats = scheduler->stats;
+    g_mutex_unlock(&scheduler->mutex);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <glib.h>
+
+// Merges restart requests from different sources into a single restart. Each request postpones the
+// restart until debounce_ms has passed without new requests, but never more than max_latency_ms
+// after the first pending request.
+
+// Called from the main loop with a comma-separated list of the reasons that were merged.
+typedef void (*restart_action_t)(const char* reasons, void* user_data);
+
+struct restart_scheduler;
+
+struct restart_scheduler_stats {
+    guint64 requests;  // Number of calls to restart_scheduler_request()
+    guint64 restarts;  // Number of times the action has been called
+};
+
+struct restart_scheduler* restart_scheduler_new(guint debounce_ms,
+                                                guint max_latency_ms,
+                                                restart_action_t action,
+                                                void* user_data);
+void restart_scheduler_free(struct restart_scheduler* scheduler);
+
+// Request a restart. May be called from any thread.
+void restart_scheduler_request(struct restart_scheduler* scheduler, const char* reason);
+
+void restart_scheduler_get_stats(struct restart_scheduler* scheduler,
+                                 struct restart_scheduler_stats* stats);
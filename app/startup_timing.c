@@ -0,0 +1,125 @@
+#include "startup_timing.h"
+#include "log.h"
+
+static const char* const phase_names[STARTUP_PHASE_COUNT] = {"parameters",
+                                                             "sd_card_wait",
+                                                             "data_root",
+                                                             "filesystem_check",
+                                                             "storage_probe",
+                                                             "daemon_config",
+                                                             "spawn",
+                                                             "dockerd_socket",
+                                                             "dockerd_init"};
+
+struct startup_cycle {
+    gint64 wall_time;   // Start time in seconds since the epoch, for correlation with logs
+    gint64 started_us;  // Monotonic start time
+    gint64 total_us;
+    gint64 phase_us[STARTUP_PHASE_COUNT];  // -1 if the phase was not run
+    const char* outcome;
+};
+
+struct startup_timing {
+    GMutex mutex;
+    struct startup_cycle* cycles;  // Ring buffer
+    guint history_length;
+    guint count;  // Number of cycles in the ring buffer, including one in progress
+    guint next;   // Index of the next cycle to begin
+    bool cycle_in_progress;
+};
+
+static struct startup_cycle* current_cycle(struct startup_timing* timing) {
+    return &timing->cycles[(timing->next + timing->history_length - 1) % timing->history_length];
+}
+
+struct startup_timing* startup_timing_new(guint history_length) {
+    struct startup_timing* timing = g_malloc0(sizeof(struct startup_timing));
+    timing->history_length = MAX(history_length, 1);
+    timing->cycles = g_new0(struct startup_cycle, timing->history_length);
+    g_mutex_init(&timing->mutex);
+    return timing;
+}
+
+void startup_timing_free(struct startup_timing* timing) {
+    if (!timing)
+        return;
+    g_free(timing->cycles);
+    g_mutex_clear(&timing->mutex);
+    g_free(timing);
+}
+
+void startup_timing_begin(struct startup_timing* timing) {
+    g_mutex_lock(&timing->mutex);
+    if (!timing->cycle_in_progress) {
+        struct startup_cycle* cycle = &timing->cycles[timing->next];
+        *cycle = (struct startup_cycle){.wall_time = g_get_real_time() / G_USEC_PER_SEC,
+                                        .started_us = g_get_monotonic_time()};
+        for (int i = 0; i < STARTUP_PHASE_COUNT; ++i)
+            cycle->phase_us[i] = -1;
+        timing->next = (timing->next + 1) % timing->history_length;
+        timing->count = MIN(timing->count + 1, timing->history_length);
+        timing->cycle_in_progress = true;
+    }
+    g_mutex_unlock(&timing->mutex);
+}
+
+void startup_timing_record(struct startup_timing* timing,
+                           enum startup_phase phase,
+                           gint64 start_us) {
+    const gint64 duration_us = g_get_monotonic_time() - start_us;
+    g_mutex_lock(&timing->mutex);
+    if (timing->cycle_in_progress)
+        current_cycle(timing)->phase_us[phase] = duration_us;
+    g_mutex_unlock(&timing->mutex);
+    log_debug("Startup phase %s took %" G_GINT64_FORMAT " ms",
+              phase_names[phase],
+              duration_us / 1000);
+}
+
+void startup_timing_end(struct startup_timing* timing, const char* outcome) {
+    g_mutex_lock(&timing->mutex);
+    if (!timing->cycle_in_progress) {
+        g_mutex_unlock(&timing->mutex);
+        return;
+    }
+    struct startup_cycle* cycle = current_cycle(timing);
+    cycle->total_us = g_get_monotonic_time() - cycle->started_us;
+    cycle->outcome = outcome;
+    timing->cycle_in_progress = false;
+    const gint64 total_us = cycle->total_us;
+    g_mutex_unlock(&timing->mutex);
+
+    log_info("Startup of dockerd ended with outcome %s after %" G_GINT64_FORMAT " ms",
+             outcome,
+             total_us / 1000);
+}
+
+static json_t* cycle_json(const struct startup_cycle* cycle) {
+    json_t* phases = json_object();
+    for (int i = 0; i < STARTUP_PHASE_COUNT; ++i)
+        if (cycle->phase_us[i] >= 0)
+            json_object_set_new(phases, phase_names[i], json_real(cycle->phase_us[i] / 1e3));
+
+    g_autoptr(GDateTime) started_at = g_date_time_new_from_unix_utc(cycle->wall_time);
+    g_autofree char* started_at_str = g_date_time_format_iso8601(started_at);
+    json_t* json = json_pack("{s:s, s:o}", "started_at", started_at_str, "phases_ms", phases);
+    if (cycle->outcome) {
+        json_object_set_new(json, "outcome", json_string(cycle->outcome));
+        json_object_set_new(json, "total_ms", json_real(cycle->total_us / 1e3));
+    } else {
+        json_object_set_new(json, "outcome", json_string("in progress"));
+    }
+    return json;
+}
+
+json_t* startup_timing_json(struct startup_timing* timing) {
+    json_t* cycles = json_array();
+    g_mutex_lock(&timing->mutex);
+    const guint oldest = (timing->next + timing->history_length - timing->count) %
+                         timing->history_length;
+    for (guint i = 0; i < timing->count; ++i)
+        json_array_append_new(cycles,
+                              cycle_json(&timing->cycles[(oldest + i) % timing->history_length]));
+    g_mutex_unlock(&timing->mutex);
+    return cycles;
+}
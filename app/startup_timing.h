@@ -0,0 +1,37 @@
+#pragma once
+#include <glib.h>
+#include <jansson.h>
+
+// Records how long each phase of starting dockerd takes, for the last few start cycles. A cycle
+// starts when the application starts or when dockerd is about to be started, and ends when dockerd
+// is usable or the start has failed. Phases that are not run in a cycle are not reported.
+
+enum startup_phase {
+    STARTUP_PHASE_PARAMETERS,        // Reading the parameters, in the first cycle only
+    STARTUP_PHASE_SD_CARD_WAIT,      // Waiting for the SD card to become available
+    STARTUP_PHASE_DATA_ROOT,         // Creating the data root directory on the SD card
+    STARTUP_PHASE_FILESYSTEM_CHECK,  // Finding the file system of the SD card
+    STARTUP_PHASE_STORAGE_PROBE,     // Choosing the storage driver, probing the drivers if needed
+    STARTUP_PHASE_DAEMON_CONFIG,     // Writing the dockerd configuration file
+    STARTUP_PHASE_SPAWN,             // Spawning rootlesskit
+    STARTUP_PHASE_DOCKERD_SOCKET,    // From spawn until dockerd accepts connections
+    STARTUP_PHASE_DOCKERD_INIT,      // From then until dockerd answers requests
+    STARTUP_PHASE_COUNT,
+};
+
+struct startup_timing* startup_timing_new(guint history_length);
+void startup_timing_free(struct startup_timing* timing);
+
+// Begin a new cycle, unless one is already in progress.
+void startup_timing_begin(struct startup_timing* timing);
+
+// Record that phase ran from the monotonic time start_us until now.
+void startup_timing_record(struct startup_timing* timing,
+                           enum startup_phase phase,
+                           gint64 start_us);
+
+// End the cycle in progress, if any. outcome must be a string literal.
+void startup_timing_end(struct startup_timing* timing, const char* outcome);
+
+// Return the recorded cycles, oldest first, as a JSON array. May be called from any thread.
+json_t* startup_timing_json(struct startup_timing* timing);
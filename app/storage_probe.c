@@ -0,0 +1,546 @@
+#define _GNU_SOURCE  // syncfs()
+#include "storage_probe.h"
+#include "log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#define PROBE_DIRECTORY  ".storage-probe"
+#define DECISION_FILE    ".storage-driver.json"
+#define DECISION_VERSION 2  // Decisions made by an earlier version of decide() are made again
+
+// The probe image has a base layer of BASE_DIRS * FILES_PER_DIR files and a top layer of TOP_FILES
+// files, all of FILE_SIZE bytes. Extracting the top layer and creating a container of the image
+// are measured.
+#define BASE_DIRS     8
+#define FILES_PER_DIR 16
+#define TOP_FILES     32
+#define FILE_SIZE     (32 * 1024)
+#define COPY_BUFFER   (64 * 1024)
+
+// The measurements are small and noisy, so every driver is measured PROBE_ROUNDS times, and a
+// driver is only chosen over a more preferred one if it is MIN_SPEEDUP times as fast in every
+// round.
+#define PROBE_ROUNDS 3
+#define MIN_SPEEDUP  2.0
+
+// In order of preference.
+static const char* const drivers[] = {"overlay2", "fuse-overlayfs", "vfs", NULL};
+
+struct storage_probe {
+    storage_probe_done_t done;
+    void* user_data;
+
+    // Only used from the main loop
+    char* driver;
+    char* probing;            // Data root that is being probed, or NULL
+    char* probed;             // Data root that was probed last, or NULL
+    json_t* probed_decision;  // Of the last probe, NULL if it failed
+
+    GMutex mutex;  // Protects decision
+    json_t* decision;
+};
+
+static double elapsed_ms(gint64 start) {
+    return (g_get_monotonic_time() - start) / 1e3;
+}
+
+static bool sync_directory(const char* path) {
+    const int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    const bool success = syncfs(fd) == 0;
+    close(fd);
+    return success;
+}
+
+static bool write_file(const char* path) {
+    static char contents[FILE_SIZE];
+    memset(contents, 'x', sizeof(contents));
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    const bool success = write(fd, contents, sizeof(contents)) == sizeof(contents);
+    return close(fd) == 0 && success;
+}
+
+// Write a layer of num_dirs directories with files_per_dir files each below path.
+static bool write_layer(const char* path, guint num_dirs, guint files_per_dir) {
+    for (guint d = 0; d < num_dirs; ++d) {
+        g_autofree char* dir = g_strdup_printf("%s/dir%u", path, d);
+        if (g_mkdir_with_parents(dir, 0755) != 0)
+            return false;
+        for (guint f = 0; f < files_per_dir; ++f) {
+            g_autofree char* file = g_strdup_printf("%s/file%u", dir, f);
+            if (!write_file(file))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool copy_file(const char* source, const char* destination) {
+    char buffer[COPY_BUFFER];
+    const int in = open(source, O_RDONLY | O_CLOEXEC);
+    const int out = open(destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool success = in >= 0 && out >= 0;
+    ssize_t length;
+    while (success && (length = read(in, buffer, sizeof(buffer))) != 0)
+        success = length > 0 && write(out, buffer, length) == length;
+    if (in >= 0)
+        close(in);
+    if (out >= 0 && close(out) != 0)
+        success = false;
+    return success;
+}
+
+// Copy the directories and regular files below source, the way vfs copies a layer.
+static bool copy_tree(const char* source, const char* destination) {
+    DIR* dir = opendir(source);
+    if (!dir || mkdir(destination, 0755) != 0) {
+        if (dir)
+            closedir(dir);
+        return false;
+    }
+    bool success = true;
+    struct dirent* entry;
+    while (success && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        g_autofree char* from = g_build_filename(source, entry->d_name, NULL);
+        g_autofree char* to = g_build_filename(destination, entry->d_name, NULL);
+        success = entry->d_type == DT_DIR ? copy_tree(from, to) : copy_file(from, to);
+    }
+    closedir(dir);
+    return success;
+}
+
+static int remove_entry(const char* path, const struct stat*, int, struct FTW*) {
+    remove(path);
+    return 0;
+}
+
+static void remove_tree(const char* path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void set_failure(json_t* result, const char* step, int error) {
+    json_object_set_new(result, "supported", json_false());
+    g_autofree char* message = g_strdup_printf("%s: %s", step, strerror(error));
+    json_object_set_new(result, "error", json_string(message));
+}
+
+// Mount the layers with overlayfs, in the kernel or with fuse-overlayfs.
+static bool mount_overlay(const char* options, const char* merged, bool fuse) {
+    if (!fuse)
+        return mount("overlay", merged, "overlay", 0, options) == 0;
+
+    const char* argv[] = {"fuse-overlayfs", "-o", options, merged, NULL};
+    const GSpawnFlags flags =
+        G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL;
+    gint wait_status;
+    GError* error = NULL;
+    // fuse-overlayfs daemonizes when the file system is mounted.
+    if (!g_spawn_sync(NULL,
+                      (char**)argv,
+                      NULL,
+                      flags,
+                      NULL,
+                      NULL,
+                      NULL,
+                      NULL,
+                      &wait_status,
+                      &error) ||
+        !g_spawn_check_wait_status(wait_status, &error)) {
+        errno = error->domain == G_SPAWN_ERROR ? ENOENT : EPERM;
+        g_clear_error(&error);
+        return false;
+    }
+    return true;
+}
+
+static void measure_overlay(const char* directory, const char* base, bool fuse, json_t* result) {
+    g_autofree char* top = g_build_filename(directory, "top", NULL);
+    g_autofree char* upper = g_build_filename(directory, "upper", NULL);
+    g_autofree char* work = g_build_filename(directory, "work", NULL);
+    g_autofree char* merged = g_build_filename(directory, "merged", NULL);
+    g_autofree char* init_file = g_build_filename(merged, "init", NULL);
+
+    // A layer is extracted into a directory of its own.
+    gint64 start = g_get_monotonic_time();
+    if (!write_layer(top, 1, TOP_FILES) || !sync_directory(directory)) {
+        set_failure(result, "extract", errno);
+        return;
+    }
+    json_object_set_new(result, "extract_ms", json_real(elapsed_ms(start)));
+
+    // A container is a writable layer on top of a mount of the image layers.
+    start = g_get_monotonic_time();
+    if (mkdir(upper, 0755) != 0 || mkdir(work, 0755) != 0 || mkdir(merged, 0755) != 0) {
+        set_failure(result, "create", errno);
+        return;
+    }
+    // Unprivileged overlay mounts must store their attributes as user xattrs.
+    g_autofree char* options = g_strdup_printf("lowerdir=%s:%s,upperdir=%s,workdir=%s%s",
+                                               top,
+                                               base,
+                                               upper,
+                                               work,
+                                               fuse ? "" : ",userxattr");
+    if (!mount_overlay(options, merged, fuse)) {
+        set_failure(result, "mount", errno);
+        return;
+    }
+    const bool written = write_file(init_file) && sync_directory(directory);
+    const int write_error = errno;
+    umount2(merged, MNT_DETACH);
+    if (!written) {
+        set_failure(result, "create", write_error);
+        return;
+    }
+    json_object_set_new(result, "create_ms", json_real(elapsed_ms(start)));
+    json_object_set_new(result, "supported", json_true());
+}
+
+static void measure_vfs(const char* directory, const char* base, json_t* result) {
+    g_autofree char* top = g_build_filename(directory, "top", NULL);
+    g_autofree char* container = g_build_filename(directory, "container", NULL);
+    g_autofree char* init_file = g_build_filename(container, "init", NULL);
+
+    // A layer is extracted into a copy of its parent.
+    gint64 start = g_get_monotonic_time();
+    if (!copy_tree(base, top) || !write_layer(top, 1, TOP_FILES) || !sync_directory(directory)) {
+        set_failure(result, "extract", errno);
+        return;
+    }
+    json_object_set_new(result, "extract_ms", json_real(elapsed_ms(start)));
+
+    // A container is a copy of the image.
+    start = g_get_monotonic_time();
+    if (!copy_tree(top, container) || !write_file(init_file) || !sync_directory(directory)) {
+        set_failure(result, "create", errno);
+        return;
+    }
+    json_object_set_new(result, "create_ms", json_real(elapsed_ms(start)));
+    json_object_set_new(result, "supported", json_true());
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    const double difference = *(const double*)a - *(const double*)b;
+    return (difference > 0) - (difference < 0);
+}
+
+static double median(json_t* values) {
+    const size_t count = json_array_size(values);
+    double sorted[PROBE_ROUNDS];
+    for (size_t i = 0; i < count; ++i)
+        sorted[i] = json_number_value(json_array_get(values, i));
+    qsort(sorted, count, sizeof(double), compare_doubles);
+    return count ? sorted[count / 2] : 0;
+}
+
+// Measure the driver PROBE_ROUNDS times, each time in a new directory, and report the median times
+// and the total time of each round. The driver is unsupported if any round fails.
+static json_t* measure_driver(const char* probe_dir, const char* base, const char* driver) {
+    json_t* result = json_object();
+    json_t* extract = json_array();
+    json_t* create = json_array();
+    json_t* total = json_array();
+    for (guint round = 0; round < PROBE_ROUNDS; ++round) {
+        g_autofree char* driver_dir = g_strdup_printf("%s/%s-%u", probe_dir, driver, round);
+        if (mkdir(driver_dir, 0755) != 0)
+            set_failure(result, "mkdir", errno);
+        else if (strcmp(driver, "vfs") == 0)
+            measure_vfs(driver_dir, base, result);
+        else
+            measure_overlay(driver_dir, base, strcmp(driver, "fuse-overlayfs") == 0, result);
+        remove_tree(driver_dir);
+        if (!json_is_true(json_object_get(result, "supported")))
+            break;
+        const double extract_ms = json_number_value(json_object_get(result, "extract_ms"));
+        const double create_ms = json_number_value(json_object_get(result, "create_ms"));
+        json_array_append_new(extract, json_real(extract_ms));
+        json_array_append_new(create, json_real(create_ms));
+        json_array_append_new(total, json_real(extract_ms + create_ms));
+    }
+    if (json_is_true(json_object_get(result, "supported"))) {
+        json_object_set_new(result, "extract_ms", json_real(median(extract)));
+        json_object_set_new(result, "create_ms", json_real(median(create)));
+        json_object_set(result, "rounds_ms", total);
+    }
+    json_decref(extract);
+    json_decref(create);
+    json_decref(total);
+    return result;
+}
+
+json_t* storage_probe_measure(const char* directory) {
+    g_autofree char* probe_dir = g_build_filename(directory, PROBE_DIRECTORY, NULL);
+    g_autofree char* base = g_build_filename(probe_dir, "base", NULL);
+    remove_tree(probe_dir);  // Left behind if an earlier probe was killed
+    if (g_mkdir_with_parents(probe_dir, 0700) != 0 ||
+        !write_layer(base, BASE_DIRS, FILES_PER_DIR) || !sync_directory(probe_dir)) {
+        log_error("Failed to write the probe image in %s: %s", probe_dir, strerror(errno));
+        remove_tree(probe_dir);
+        return NULL;
+    }
+
+    json_t* results = json_object();
+    for (const char* const* driver = drivers; *driver; ++driver)
+        json_object_set_new(results, *driver, measure_driver(probe_dir, base, *driver));
+    remove_tree(probe_dir);
+    return json_pack("{s:o}", "drivers", results);
+}
+
+static char* kernel_release(void) {
+    struct utsname name;
+    return g_strdup(uname(&name) == 0 ? name.release : "");
+}
+
+// Return the driver that dockerd has already stored data for in data_root, if any.
+static const char* existing_driver(const char* data_root) {
+    for (const char* const* driver = drivers; *driver; ++driver) {
+        g_autofree char* path = g_build_filename(data_root, *driver, NULL);
+        GDir* dir = g_dir_open(path, 0, NULL);
+        if (!dir)
+            continue;
+        const bool has_data = g_dir_read_name(dir) != NULL;
+        g_dir_close(dir);
+        if (has_data)
+            return *driver;
+    }
+    return NULL;
+}
+
+// Run dockerdwrapper --probe-storage in a user namespace, where the root user may mount file
+// systems, and return the measurements.
+static json_t* run_probe(const char* data_root) {
+    g_autofree char* self = g_file_read_link("/proc/self/exe", NULL);
+    if (!self)
+        return NULL;
+    const char* argv[] =
+        {"rootlesskit", "--subid-source=static", self, "--probe-storage", data_root, NULL};
+    g_autofree char* output = NULL;
+    g_autofree char* errors = NULL;
+    gint wait_status;
+    GError* error = NULL;
+    if (!g_spawn_sync(NULL,
+                      (char**)argv,
+                      NULL,
+                      G_SPAWN_SEARCH_PATH,
+                      NULL,
+                      NULL,
+                      &output,
+                      &errors,
+                      &wait_status,
+                      &error) ||
+        !g_spawn_check_wait_status(wait_status, &error)) {
+        log_error("Failed to probe the storage drivers: %s %s",
+                  error->message,
+                  errors ? errors : "");
+        g_clear_error(&error);
+        return NULL;
+    }
+    json_error_t json_error;
+    json_t* results = json_loads(output, 0, &json_error);
+    if (!results)
+        log_error("Failed to parse the result of the storage probe: %s", json_error.text);
+    return results;
+}
+
+// Return whether candidate was MIN_SPEEDUP times as fast as chosen in every round.
+static bool clearly_faster(json_t* candidate, json_t* chosen) {
+    json_t* candidate_ms = json_object_get(candidate, "rounds_ms");
+    json_t* chosen_ms = json_object_get(chosen, "rounds_ms");
+    const size_t rounds = json_array_size(candidate_ms);
+    if (rounds == 0 || rounds != json_array_size(chosen_ms))
+        return false;
+    for (size_t i = 0; i < rounds; ++i)
+        if (json_number_value(json_array_get(candidate_ms, i)) * MIN_SPEEDUP >=
+            json_number_value(json_array_get(chosen_ms, i)))
+            return false;
+    return true;
+}
+
+static json_t* decide(json_t* results, const char* existing) {
+    json_t* measured = json_object_get(results, "drivers");
+    const char* chosen = NULL;
+    const char* reason = "preferred supported";
+    for (const char* const* driver = drivers; *driver; ++driver) {
+        json_t* result = json_object_get(measured, *driver);
+        if (!json_is_true(json_object_get(result, "supported")))
+            continue;
+        if (!chosen) {
+            chosen = *driver;
+        } else if (clearly_faster(result, json_object_get(measured, chosen))) {
+            chosen = *driver;
+            reason = "clearly faster";
+        }
+    }
+    if (existing) {
+        chosen = existing;
+        reason = "existing data";
+    }
+    if (!chosen)
+        return NULL;
+
+    g_autofree char* kernel = kernel_release();
+    return json_pack("{s:i, s:s, s:s, s:s, s:I, s:O}",
+                     "version",
+                     DECISION_VERSION,
+                     "driver",
+                     chosen,
+                     "reason",
+                     reason,
+                     "kernel",
+                     kernel,
+                     "probed_at",
+                     (json_int_t)(g_get_real_time() / G_USEC_PER_SEC),
+                     "drivers",
+                     measured);
+}
+
+// Return the stored decision for data_root if it is still valid.
+static json_t* read_decision(const char* path, const char* existing) {
+    json_t* decision = json_load_file(path, 0, NULL);
+    const char* driver = json_string_value(json_object_get(decision, "driver"));
+    g_autofree char* kernel = kernel_release();
+    const bool current =
+        json_integer_value(json_object_get(decision, "version")) == DECISION_VERSION &&
+        g_strcmp0(json_string_value(json_object_get(decision, "kernel")), kernel) == 0;
+    if (driver && (g_strcmp0(driver, existing) == 0 || current))
+        return decision;
+    json_decref(decision);
+    return NULL;
+}
+
+static void log_decision(json_t* decision) {
+    GString* text = g_string_new(NULL);
+    const char* name;
+    json_t* result;
+    json_object_foreach(json_object_get(decision, "drivers"), name, result) {
+        if (json_is_true(json_object_get(result, "supported")))
+            g_string_append_printf(text,
+                                   ", %s: extract %.0f ms, create %.0f ms",
+                                   name,
+                                   json_number_value(json_object_get(result, "extract_ms")),
+                                   json_number_value(json_object_get(result, "create_ms")));
+        else
+            g_string_append_printf(text,
+                                   ", %s: %s",
+                                   name,
+                                   json_string_value(json_object_get(result, "error")));
+    }
+    log_info("Using storage driver %s (%s)%s",
+             json_string_value(json_object_get(decision, "driver")),
+             json_string_value(json_object_get(decision, "reason")),
+             text->str);
+    g_string_free(text, true);
+}
+
+struct probe_job {
+    char* data_root;
+    const char* existing;
+};
+
+static void free_probe_job(void* job_void_ptr) {
+    struct probe_job* job = job_void_ptr;
+    g_free(job->data_root);
+    g_free(job);
+}
+
+// Only uses the job, so that the probe may be freed while this runs.
+static void probe_thread(GTask* task, gpointer, gpointer job_void_ptr, GCancellable*) {
+    struct probe_job* job = job_void_ptr;
+    json_t* results = run_probe(job->data_root);
+    json_t* decision = results ? decide(results, job->existing) : NULL;
+    json_decref(results);
+    g_autofree char* path = g_build_filename(job->data_root, DECISION_FILE, NULL);
+    if (decision && json_dump_file(decision, path, JSON_INDENT(4)) != 0)
+        log_warning("Failed to store the storage driver decision in %s", path);
+    g_task_return_pointer(task, decision, (GDestroyNotify)json_decref);
+}
+
+static void probe_done(GObject*, GAsyncResult* result, gpointer probe_void_ptr) {
+    struct storage_probe* probe = probe_void_ptr;
+    json_decref(probe->probed_decision);
+    probe->probed_decision = g_task_propagate_pointer(G_TASK(result), NULL);
+    g_free(probe->probed);
+    probe->probed = g_steal_pointer(&probe->probing);
+    if (probe->probed_decision)
+        log_decision(probe->probed_decision);
+    else
+        log_warning("No storage driver could be chosen, dockerd chooses by itself");
+    probe->done(probe->user_data);
+}
+
+static void start_probe(struct storage_probe* probe, const char* data_root, const char* existing) {
+    log_info("Probing the storage drivers in %s", data_root);
+    probe->probing = g_strdup(data_root);
+    struct probe_job* job = g_new0(struct probe_job, 1);
+    job->data_root = g_strdup(data_root);
+    job->existing = existing;
+    GTask* task = g_task_new(NULL, NULL, probe_done, probe);
+    g_task_set_task_data(task, job, free_probe_job);
+    g_task_run_in_thread(task, probe_thread);
+    g_object_unref(task);
+}
+
+struct storage_probe* storage_probe_new(storage_probe_done_t done, void* user_data) {
+    struct storage_probe* probe = g_new0(struct storage_probe, 1);
+    probe->done = done;
+    probe->user_data = user_data;
+    g_mutex_init(&probe->mutex);
+    return probe;
+}
+
+void storage_probe_free(struct storage_probe* probe) {
+    if (!probe)
+        return;
+    json_decref(probe->decision);
+    json_decref(probe->probed_decision);
+    g_free(probe->driver);
+    g_free(probe->probing);
+    g_free(probe->probed);
+    g_mutex_clear(&probe->mutex);
+    g_free(probe);
+}
+
+bool storage_probe_select(struct storage_probe* probe, const char* data_root, const char** driver) {
+    g_autofree char* path = g_build_filename(data_root, DECISION_FILE, NULL);
+    const char* existing = existing_driver(data_root);
+    json_t* decision = read_decision(path, existing);
+    if (!decision && g_strcmp0(probe->probed, data_root) == 0) {
+        // The decision could not be stored, or the probe failed and dockerd chooses by itself.
+        decision = json_incref(probe->probed_decision);
+    } else if (!decision) {
+        if (!probe->probing)
+            start_probe(probe, data_root, existing);
+        return false;
+    }
+
+    g_free(probe->driver);
+    probe->driver = g_strdup(json_string_value(json_object_get(decision, "driver")));
+    g_mutex_lock(&probe->mutex);
+    json_decref(probe->decision);
+    probe->decision = decision;
+    g_mutex_unlock(&probe->mutex);
+    *driver = probe->driver;
+    return true;
+}
+
+json_t* storage_probe_json(struct storage_probe* probe) {
+    g_mutex_lock(&probe->mutex);
+    json_t* json = probe->decision ? json_deep_copy(probe->decision) : json_object();
+    g_mutex_unlock(&probe->mutex);
+    return json;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <glib.h>
+#include <jansson.h>
+#include <stdbool.h>
+
+// Chooses the storage driver of dockerd for a data root. Rootless dockerd falls back to vfs when it
+// cannot use overlay2, and vfs copies every layer in full, both when images are pulled and when
+// containers are created, which is slow and wears SD cards. The probe measures extracting a layer
+// and creating a container with overlay2, fuse-overlayfs and vfs on the data root, and the fastest
+// supported driver is chosen, in order of preference, unless a less preferred driver is clearly
+// faster in repeated measurements. The decision is stored in the data root and reused until the
+// kernel changes. A driver that already has data in the data root is kept, or the images would be
+// lost.
+
+// Called from the main loop when a probe that storage_probe_select() started has finished.
+typedef void (*storage_probe_done_t)(void* user_data);
+
+struct storage_probe* storage_probe_new(storage_probe_done_t done, void* user_data);
+void storage_probe_free(struct storage_probe* probe);
+
+// Set *driver to the storage driver to use for data_root, or to NULL to let dockerd choose if the
+// probe failed, and return true. The string is valid until the next call. If the drivers must be
+// probed first, start probing in the background, unless a probe is running, and return false.
+// The probe runs in a user namespace of rootlesskit and takes a few seconds.
+bool storage_probe_select(struct storage_probe* probe, const char* data_root, const char** driver);
+
+// Return the last decision, with the measurements of each driver, as JSON. May be called from any
+// thread.
+json_t* storage_probe_json(struct storage_probe* probe);
+
+// Measure the drivers in directory and return the results as JSON. Must run as root in a user and
+// mount namespace, which dockerdwrapper --probe-storage does when started by rootlesskit.
+json_t* storage_probe_measure(const char* directory);
@@ -0,0 +1,131 @@
+#include "supervisor.h"
+#include "log.h"
+
+struct supervisor {
+    struct supervisor_policy policy;
+    supervisor_restart_t restart;
+    void* user_data;
+
+    GMutex mutex;    // Protects the members below
+    GSource* timer;  // Pending restart, or NULL
+    gint64 started_at;
+    gint64* restart_times;  // Ring buffer with the times of the last restarts, zero if unused
+    guint next_restart;     // Index of the oldest restart in restart_times
+    struct supervisor_stats stats;
+};
+
+static gboolean restart_after_backoff(void* supervisor_void_ptr) {
+    struct supervisor* supervisor = supervisor_void_ptr;
+
+    g_mutex_lock(&supervisor->mutex);
+    // supervisor_reset() may have cancelled the timer from another thread just before dispatch.
+    const bool cancelled = supervisor->timer != g_main_current_source();
+    if (!cancelled)
+        g_clear_pointer(&supervisor->timer, g_source_unref);
+    g_mutex_unlock(&supervisor->mutex);
+
+    if (!cancelled)
+        supervisor->restart(supervisor->user_data);
+    return G_SOURCE_REMOVE;
+}
+
+// Double the delay for each consecutive failure and pick a random delay in the upper half, so
+// that devices that failed at the same time do not restart in lockstep.
+static guint backoff_ms(const struct supervisor_policy* policy, guint consecutive_failures) {
+    const guint doublings = MIN(consecutive_failures - 1, 16);
+    const guint64 backoff = MIN((guint64)policy->initial_backoff_ms << doublings,
+                                (guint64)policy->max_backoff_ms);
+    return backoff / 2 + g_random_int_range(0, backoff / 2 + 1);
+}
+
+struct supervisor* supervisor_new(const struct supervisor_policy* policy,
+                                  supervisor_restart_t restart,
+                                  void* user_data) {
+    struct supervisor* supervisor = g_malloc0(sizeof(struct supervisor));
+    supervisor->policy = *policy;
+    supervisor->restart = restart;
+    supervisor->user_data = user_data;
+    supervisor->restart_times = g_new0(gint64, MAX(policy->budget, 1));
+    g_mutex_init(&supervisor->mutex);
+    return supervisor;
+}
+
+void supervisor_free(struct supervisor* supervisor) {
+    if (!supervisor)
+        return;
+    if (supervisor->timer) {
+        g_source_destroy(supervisor->timer);
+        g_source_unref(supervisor->timer);
+    }
+    g_free(supervisor->restart_times);
+    g_mutex_clear(&supervisor->mutex);
+    g_free(supervisor);
+}
+
+void supervisor_started(struct supervisor* supervisor) {
+    g_mutex_lock(&supervisor->mutex);
+    supervisor->started_at = g_get_monotonic_time();
+    supervisor->stats.starts++;
+    g_mutex_unlock(&supervisor->mutex);
+}
+
+bool supervisor_exited(struct supervisor* supervisor) {
+    const struct supervisor_policy* policy = &supervisor->policy;
+    struct supervisor_stats* stats = &supervisor->stats;
+    const gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&supervisor->mutex);
+    stats->unexpected_exits++;
+    if (now - supervisor->started_at >= policy->stable_after_s * G_USEC_PER_SEC)
+        stats->consecutive_failures = 0;
+    stats->consecutive_failures++;
+    const guint consecutive_failures = stats->consecutive_failures;
+
+    // The budget is exhausted if the oldest of the last 'budget' restarts is within the window.
+    const gint64 oldest = supervisor->restart_times[supervisor->next_restart];
+    if (policy->budget == 0 || (oldest && now - oldest < policy->window_s * G_USEC_PER_SEC)) {
+        stats->circuit_open = true;
+        stats->circuit_opens++;
+        g_mutex_unlock(&supervisor->mutex);
+        log_error("dockerd exited unexpectedly %u times in a row and has used its budget of %u "
+                  "restarts per %u s. It will not be restarted until the configuration changes.",
+                  consecutive_failures,
+                  policy->budget,
+                  policy->window_s);
+        return false;
+    }
+    supervisor->restart_times[supervisor->next_restart] = now;
+    supervisor->next_restart = (supervisor->next_restart + 1) % policy->budget;
+
+    const guint delay_ms = backoff_ms(policy, consecutive_failures);
+    stats->restarts++;
+    stats->last_backoff_ms = delay_ms;
+    supervisor->timer = g_timeout_source_new(delay_ms);
+    g_source_set_callback(supervisor->timer, restart_after_backoff, supervisor, NULL);
+    g_source_attach(supervisor->timer, NULL);
+    g_mutex_unlock(&supervisor->mutex);
+
+    log_warning("dockerd exited unexpectedly %u times in a row, restarting it in %u ms",
+                consecutive_failures,
+                delay_ms);
+    return true;
+}
+
+void supervisor_reset(struct supervisor* supervisor) {
+    g_mutex_lock(&supervisor->mutex);
+    if (supervisor->timer) {
+        g_source_destroy(supervisor->timer);
+        g_clear_pointer(&supervisor->timer, g_source_unref);
+    }
+    memset(supervisor->restart_times, 0, MAX(supervisor->policy.budget, 1) * sizeof(gint64));
+    supervisor->next_restart = 0;
+    supervisor->stats.consecutive_failures = 0;
+    supervisor->stats.circuit_open = false;
+    g_mutex_unlock(&supervisor->mutex);
+}
+
+void supervisor_get_stats(struct supervisor* supervisor, struct supervisor_stats* stats) {
+    g_mutex_lock(&supervisor->mutex);
+    *stats = supervisor->stats;
+    g_mutex_unlock(&supervisor->mutex);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <glib.h>
+#include <stdbool.h>
+
+// Restarts dockerd when it exits without having been asked to, with an exponentially growing
+// delay between restarts. If dockerd keeps exiting, so that more than a budget of restarts would
+// be made within a time window, the circuit opens: no more restarts are made until
+// supervisor_reset() has been called.
+
+// Called from the main loop when the backoff delay has passed.
+typedef void (*supervisor_restart_t)(void* user_data);
+
+struct supervisor_policy {
+    guint initial_backoff_ms;  // Delay before the first restart after a stable run
+    guint max_backoff_ms;      // The delay is doubled per restart, up to this limit
+    guint budget;              // Number of restarts allowed within window_s
+    guint window_s;
+    guint stable_after_s;  // dockerd exiting after running this long restarts the backoff
+};
+
+struct supervisor_stats {
+    guint64 starts;              // Number of calls to supervisor_started()
+    guint64 unexpected_exits;    // Number of calls to supervisor_exited()
+    guint64 restarts;            // Number of restarts scheduled after unexpected exits
+    guint64 circuit_opens;       // Number of times the restart budget was exhausted
+    guint consecutive_failures;  // Unexpected exits since the last stable run or reset
+    guint last_backoff_ms;
+    bool circuit_open;
+};
+
+struct supervisor* supervisor_new(const struct supervisor_policy* policy,
+                                  supervisor_restart_t restart,
+                                  void* user_data);
+void supervisor_free(struct supervisor* supervisor);
+
+// Tell the supervisor that dockerd has been started.
+void supervisor_started(struct supervisor* supervisor);
+
+// Tell the supervisor that dockerd has exited without having been asked to. Return true if a
+// restart has been scheduled, or false if the restart budget is exhausted.
+bool supervisor_exited(struct supervisor* supervisor);
+
+// Close the circuit, forget earlier failures and cancel any scheduled restart. Used when the
+// configuration has changed, since that may have resolved the problem. May be called from any
+// thread.
+void supervisor_reset(struct supervisor* supervisor);
+
+// May be called from any thread.
+void supervisor_get_stats(struct supervisor* supervisor, struct supervisor_stats* stats);
@@ -58,20 +58,11 @@ const char* tls_file_description(const char* filename) {
     return NULL;
 }
 
-const char* tls_file_dockerd_args(void) {
-    static char args[512];  // Too small buffer will cause truncated options, nothing more.
-    const char* end = args + sizeof(args);
-    char* ptr = args;
-
-    for (size_t i = 0; i < NUM_TLS_CERTS; ++i)
-        ptr += g_snprintf(ptr,
-                          end - ptr,
-                          "%s %s/%s ",
-                          tls_certs[i].dockerd_option,
-                          TLS_CERT_PATH,
-                          tls_certs[i].filename);
-    ptr[-1] = '\0';  // Remove space after last item.
-    return args;
+void tls_file_dockerd_args(GPtrArray* args) {
+    for (size_t i = 0; i < NUM_TLS_CERTS; ++i) {
+        g_ptr_array_add(args, g_strdup(tls_certs[i].dockerd_option));
+        g_ptr_array_add(args, g_strdup_printf("%s/%s", TLS_CERT_PATH, tls_certs[i].filename));
+    }
 }
 
 static bool read_bytes_from(FILE* fp, int whence, char* buffer, int num_bytes) {
@@ -122,3 +113,13 @@ bool tls_file_has_correct_format(const char* filename, const char* path_to_file)
     fclose(fp);
     return correct;
 }
+
+static bool starts_like(const char* data, size_t len, const char* header) {
+    return memcmp(data, header, MIN(len, strlen(header))) == 0;
+}
+
+bool tls_file_starts_correctly(const char* filename, const char* data, size_t len) {
+    return is_key_file(filename) ? (starts_like(data, len, BEGIN(PRIVATE_KEY)) ||
+                                    starts_like(data, len, BEGIN(RSA_PRIVATE_KEY)))
+                                 : starts_like(data, len, BEGIN(CERTIFICATE));
+}
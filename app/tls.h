@@ -1,8 +1,14 @@
 #pragma once
+#include <glib.h>
 #include <stdbool.h>
 
 bool tls_missing_certs(void);
 void tls_log_missing_cert_warnings(void);
 const char* tls_file_description(const char* filename);
-const char* tls_file_dockerd_args(void);
+void tls_file_dockerd_args(GPtrArray* args);
 bool tls_file_has_correct_format(const char* filename, const char* path_to_file);
+
+// Return whether the first len bytes of an upload of filename can start a file of the correct
+// format, so that an upload can be rejected before it is stored. The footer is only checked by
+// tls_file_has_correct_format(), on the whole file.
+bool tls_file_starts_correctly(const char* filename, const char* data, size_t len);
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Count the write operations that container logs cause on the device of the Docker data root, for
+# the json-file driver that dockerd uses by default and for each ContainerLogPolicy of the
+# application. The options of each policy are given to the container with --log-driver and
+# --log-opt, as daemon_config.c sets them for dockerd, so dockerd does not have to be reconfigured.
+# A container logs LINES_PER_S lines per second for DURATION_S seconds under each policy, and the
+# writes completed on the device, from /proc/diskstats, are printed after a sync. Other writes to
+# the device are counted too, so run it on an otherwise idle host, or repeat it. Needs Docker and
+# the IMAGE, by default busybox. Run with
+# $ make -C bench container-logs
+set -eu
+
+IMAGE=${IMAGE:-busybox}
+DURATION_S=${DURATION_S:-60}
+LINES_PER_S=${LINES_PER_S:-100}
+LOCAL='--log-driver=local --log-opt=max-size=10m --log-opt=max-file=3 --log-opt=compress=false'
+RING_BUFFER='--log-opt=mode=non-blocking --log-opt=max-buffer-size=1m'
+
+root=$(docker info -f '{{.DockerRootDir}}')
+device=$(basename "$(findmnt -n -o SOURCE -T "$root")")
+if ! grep -q " $device " /proc/diskstats; then
+    echo "The data root $root is not on a block device in /proc/diskstats" >&2
+    exit 1
+fi
+
+writes() {
+    sync
+    awk -v device="$device" '$3 == device { print $8 }' /proc/diskstats
+}
+
+measure() {
+    policy=$1
+    shift
+    # shellcheck disable=SC2068 # The options are split on purpose
+    id=$(docker run -d $@ "$IMAGE" sh -c \
+        "while :; do i=0; while [ \$i -lt $LINES_PER_S ]; do echo \"line \$i of a container log\";
+        i=\$((i + 1)); done; sleep 1; done")
+    before=$(writes)
+    sleep "$DURATION_S"
+    after=$(writes)
+    docker rm -f "$id" >/dev/null
+    printf '%-12s %8d %8.1f\n' "$policy" $((after - before)) \
+        "$(echo "$after $before $DURATION_S" | awk '{ print ($1 - $2) / $3 }')"
+}
+
+echo "$LINES_PER_S lines/s for $DURATION_S s, writes on $device"
+printf '%-12s %8s %8s\n' policy writes writes/s
+measure json-file --log-driver=json-file
+measure local "$LOCAL"
+measure non-blocking "$LOCAL" "$RING_BUFFER"
+measure syslog --log-driver=syslog --log-opt=tag='{{.Name}}' "$RING_BUFFER"
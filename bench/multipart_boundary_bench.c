@@ -0,0 +1,139 @@
+// Compare the throughput of the multipart parser that fcgi_write_file_from_stream() used to have,
+// which compared the boundary at every byte offset of 2 KiB reads, with the streaming matcher in
+// multipart_boundary.c at different read sizes. The upload is simulated by reading from memory.
+#include "multipart_boundary.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAYLOAD_SIZE (32 * 1024 * 1024)
+#define ROUNDS       3
+#define BOUNDARY     "------------------------d74496d66958873e"
+#define MIN_OF(a, b) ((a) < (b) ? (a) : (b))
+
+struct stream {
+    const char* data;
+    size_t len;
+    size_t pos;
+};
+
+static size_t stream_read(struct stream* stream, char* buffer, size_t len) {
+    const size_t n = stream->len - stream->pos < len ? stream->len - stream->pos : len;
+    memcpy(buffer, stream->data + stream->pos, n);
+    stream->pos += n;
+    return n;
+}
+
+// The post boundary search of the old parser, without the pre boundary handling. Returns the
+// number of payload bytes, or SIZE_MAX if no boundary was found.
+static size_t old_parser(struct stream* stream) {
+    enum { buffer_len = 2048 };
+    char buffer[buffer_len];
+    const char* boundary_text = BOUNDARY;
+    const size_t boundary_len = strlen(boundary_text);
+    size_t base = 0;  // Stream offset of buffer[0]
+    char* p_payload = buffer;
+    for (int loop = 1;; loop++) {
+        const size_t available_len = buffer_len - (p_payload - buffer);
+        const size_t bytes_read = stream_read(stream, p_payload, available_len);
+        char* pchar;
+        for (pchar = buffer; pchar < buffer + bytes_read - ((loop == 1) ? boundary_len : 0);
+             pchar++) {
+            if (memcmp(pchar, boundary_text, boundary_len) == 0)
+                return base + (pchar - buffer) - strlen("\r\n--");
+        }
+        if (bytes_read != available_len)
+            return SIZE_MAX;
+        base += pchar - buffer;
+        p_payload = buffer + boundary_len;
+        memcpy(buffer, pchar, boundary_len);
+    }
+}
+
+// The loop of fcgi_write_file_from_stream() with the same semantics as old_parser().
+static size_t new_parser(struct stream* stream, size_t buffer_size) {
+    struct multipart_boundary boundary;
+    multipart_boundary_init(&boundary, BOUNDARY);
+    char* buffer = malloc(buffer_size);
+    size_t used = 0;
+    size_t payload = SIZE_MAX;
+    size_t written = 0;
+    while (1) {
+        const size_t to_read = buffer_size - used;
+        const size_t bytes_read = stream_read(stream, buffer + used, to_read);
+        used += bytes_read;
+        size_t match = 0;
+        size_t safe_len = 0;
+        if (multipart_boundary_find(&boundary, buffer, used, &match, &safe_len)) {
+            payload = written + match;
+            break;
+        }
+        written += safe_len;
+        used -= safe_len;
+        memmove(buffer, buffer + safe_len, used);
+        if (bytes_read < to_read)
+            break;
+    }
+    free(buffer);
+    multipart_boundary_free(&boundary);
+    return payload;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Random data with a sprinkle of CR LF, like a text or tar file, followed by the post boundary.
+static char* make_body(size_t* len) {
+    const char* trailer = "\r\n--" BOUNDARY "--\r\n";
+    *len = PAYLOAD_SIZE + strlen(trailer);
+    char* body = malloc(*len);
+    srand(1);
+    for (size_t i = 0; i < PAYLOAD_SIZE; i++)
+        body[i] = (i % 64 == 62) ? '\r' : (i % 64 == 63) ? '\n' : 'A' + rand() % 26;
+    memcpy(body + PAYLOAD_SIZE, trailer, strlen(trailer));
+    return body;
+}
+
+static void report(const char* name, size_t payload, double seconds) {
+    printf("%-28s %8.1f MB/s%s\n",
+           name,
+           PAYLOAD_SIZE / seconds / 1e6,
+           payload == PAYLOAD_SIZE ? "" : "  (WRONG PAYLOAD SIZE)");
+}
+
+int main(void) {
+    size_t len;
+    char* body = make_body(&len);
+
+    double best = 1e9;
+    size_t payload = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        struct stream stream = {body, len, 0};
+        const double start = now();
+        payload = old_parser(&stream);
+        best = MIN_OF(best, now() - start);
+    }
+    report("old parser, 2 KiB reads", payload, best);
+
+    const size_t buffer_sizes[] = {2048, 16 * 1024, 64 * 1024, 256 * 1024};
+    for (size_t b = 0; b < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); b++) {
+        best = 1e9;
+        for (int i = 0; i < ROUNDS; i++) {
+            struct stream stream = {body, len, 0};
+            const double start = now();
+            payload = new_parser(&stream, buffer_sizes[b]);
+            best = MIN_OF(best, now() - start);
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "new parser, %zu KiB reads", buffer_sizes[b] / 1024);
+        report(name, payload, best);
+    }
+
+    free(body);
+    return 0;
+}
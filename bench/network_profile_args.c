@@ -0,0 +1,19 @@
+// Print the rootlesskit options of a network profile in ../app/network_profile.c, so that
+// network_profile_bench.sh runs rootlesskit with the same options as the application.
+#include "network_profile.h"
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <profile>\n", argv[0]);
+        return 1;
+    }
+    const struct network_profile* profile = network_profile_find(argv[1]);
+    if (strcmp(profile->name, argv[1]) != 0) {
+        fprintf(stderr, "Unknown network profile %s\n", argv[1]);
+        return 1;
+    }
+    printf("%s\n", profile->rootlesskit_args);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Compare the TCP throughput of the network profiles with iperf3, under the rootlesskit command
+# line of the application. Egress is measured from inside the namespace to an iperf3 server on a
+# non-loopback address of the host, and ingress from the host to an iperf3 server behind a
+# published port. Needs rootlesskit, slirp4netns, iperf3 and entries for the user in /etc/subuid
+# and /etc/subgid. Run with
+# $ make -C bench network
+set -eu
+
+PROFILES="compatible performance"
+PORT=5201
+PUBLISHED_PORT=5202
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-10}
+HOST_IP=${HOST_IP:-$(hostname -I | cut -d' ' -f1)}
+
+bits_per_second() {
+    sed -n 's/.*"bits_per_second":[[:space:]]*\([0-9.e+]*\).*/\1/p' | tail -n 1 |
+        awk '{ printf "%.0f Mbit/s", $1 / 1e6 }'
+}
+
+iperf3 -s -p "$PORT" -D --pidfile /tmp/network_profile_bench.pid
+trap 'kill "$(cat /tmp/network_profile_bench.pid)"' EXIT
+sleep 1
+
+for profile in $PROFILES; do
+    args=$(./network_profile_args "$profile")
+    # shellcheck disable=SC2086 # The options are split on purpose
+    egress=$(rootlesskit $args --copy-up=/etc --copy-up=/run --propagation=rslave \
+        iperf3 -c "$HOST_IP" -p "$PORT" -t "$SECONDS_PER_RUN" -J | bits_per_second)
+
+    # shellcheck disable=SC2086
+    rootlesskit $args --copy-up=/etc --copy-up=/run --propagation=rslave \
+        -p "0.0.0.0:$PUBLISHED_PORT:$PUBLISHED_PORT/tcp" \
+        iperf3 -s -p "$PUBLISHED_PORT" -1 >/dev/null &
+    sleep 2
+    ingress=$(iperf3 -c "$HOST_IP" -p "$PUBLISHED_PORT" -t "$SECONDS_PER_RUN" -J | bits_per_second)
+    wait
+
+    printf "%-12s egress %14s  ingress %14s\n" "$profile" "$egress" "$ingress"
+done
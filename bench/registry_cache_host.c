@@ -0,0 +1,157 @@
+// Run the registry cache of ../app/registry_cache.c on this host, in the network namespace of the
+// host, as a cache of a stand-in upstream registry. An image is pulled through the cache twice, to
+// show the misses of the first pull and the hits of the second, then the cache is shrunk to show
+// the eviction, and the image is pulled once more. The statistics are printed after every step.
+// The test fails unless the second pull hits the cache, the shrinking evicts blobs and the third
+// pull misses. registry_cache_test.sh starts the upstream and pushes the image to it. Run with
+// $ make -C bench registry-cache
+#include "docker_api.h"
+#include "log.h"
+#include "registry_cache.h"
+#include <stdio.h>
+#include <unistd.h>
+
+#define PORT               5000
+#define MAX_SIZE_MIB       1024
+#define START_TIMEOUT_MS   5000
+#define EVICT_TIMEOUT_MS   5000
+#define POLL_INTERVAL_MS   50
+#define REQUEST_TIMEOUT_MS 30000
+#define STORE_DELAY_MS     1000  // The registry stores pulled blobs in the background
+
+static char* get(const char* path, int* status_code) {
+    int fd = docker_api_connect_loopback(PORT, REQUEST_TIMEOUT_MS);
+    if (fd == -1)
+        return NULL;
+    char* body = NULL;
+    if (docker_api_send_request(fd, "GET", path, NULL, false))
+        body = docker_api_read_response(fd, status_code);
+    close(fd);
+    return body;
+}
+
+static bool wait_for_registry(void) {
+    for (int waited_ms = 0; waited_ms < START_TIMEOUT_MS; waited_ms += POLL_INTERVAL_MS) {
+        int fd = docker_api_connect_loopback(PORT, POLL_INTERVAL_MS);
+        if (fd != -1) {
+            close(fd);
+            return true;
+        }
+        g_usleep(POLL_INTERVAL_MS * 1000);
+    }
+    return false;
+}
+
+static bool get_blob(const char* repository, json_t* descriptor) {
+    const char* digest = json_string_value(json_object_get(descriptor, "digest"));
+    g_autofree char* path = g_strdup_printf("/v2/%s/blobs/%s", repository, digest);
+    int status_code = 0;
+    g_autofree char* body = get(path, &status_code);
+    if (status_code != 200) {
+        fprintf(stderr, "GET %s failed with status %d\n", path, status_code);
+        return false;
+    }
+    return true;
+}
+
+// Pull the manifest and all blobs of the image, as dockerd would.
+static bool pull(const char* repository, const char* manifest_digest) {
+    g_autofree char* path = g_strdup_printf("/v2/%s/manifests/%s", repository, manifest_digest);
+    int status_code = 0;
+    g_autofree char* body = get(path, &status_code);
+    json_t* manifest = body && status_code == 200 ? json_loads(body, 0, NULL) : NULL;
+    if (!manifest) {
+        fprintf(stderr, "GET %s failed with status %d\n", path, status_code);
+        return false;
+    }
+    bool success = get_blob(repository, json_object_get(manifest, "config"));
+    size_t i;
+    json_t* layer;
+    json_array_foreach(json_object_get(manifest, "layers"), i, layer) {
+        success = success && get_blob(repository, layer);
+    }
+    json_decref(manifest);
+    g_usleep(STORE_DELAY_MS * 1000);
+    return success;
+}
+
+// Print the statistics, and return them for the checks. Free with json_decref().
+static json_t* print_statistics(struct registry_cache* cache, const char* step) {
+    json_t* json = registry_cache_json(cache);
+    g_autofree char* text = json_dumps(json, JSON_INDENT(2) | JSON_SORT_KEYS);
+    printf("%s:\n%s\n", step, text);
+    return json;
+}
+
+static json_int_t blob_statistic(json_t* statistics, const char* key) {
+    return json_integer_value(json_object_get(json_object_get(statistics, "blobs"), key));
+}
+
+static json_int_t evicted_blobs(struct registry_cache* cache) {
+    json_t* json = registry_cache_json(cache);
+    const json_int_t value = json_integer_value(json_object_get(json, "evicted_blobs"));
+    json_decref(json);
+    return value;
+}
+
+// The eviction runs in a thread and reports back through the main context.
+static void wait_for_eviction(struct registry_cache* cache) {
+    for (int waited_ms = 0; waited_ms < EVICT_TIMEOUT_MS && !evicted_blobs(cache);
+         waited_ms += POLL_INTERVAL_MS) {
+        while (g_main_context_iteration(NULL, false))
+            ;
+        g_usleep(POLL_INTERVAL_MS * 1000);
+    }
+}
+
+static bool check(bool condition, const char* failure) {
+    if (!condition)
+        fprintf(stderr, "%s\n", failure);
+    return condition;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 5) {
+        fprintf(stderr,
+                "Usage: %s <upstream URL> <cache directory> <repository> <manifest digest>\n",
+                argv[0]);
+        return 1;
+    }
+    const char* upstream = argv[1];
+    const char* directory = argv[2];
+    const char* repository = argv[3];
+    const char* manifest_digest = argv[4];
+
+    struct log_settings log_settings = {.destination = log_dest_stdout};
+    log_init(&log_settings);
+
+    struct registry_cache* cache = registry_cache_new();
+    registry_cache_start(cache, directory, upstream, PORT, MAX_SIZE_MIB, 0);
+    bool success = wait_for_registry();
+    if (!success)
+        fprintf(stderr, "The registry cache is not listening on port %d\n", PORT);
+
+    success = success && pull(repository, manifest_digest);
+    json_decref(print_statistics(cache, "First pull, from upstream"));
+    success = success && pull(repository, manifest_digest);
+    json_t* second = print_statistics(cache, "Second pull, from the cache");
+    success = success && check(blob_statistic(second, "hits") > 0,
+                               "The second pull was not served from the cache");
+
+    registry_cache_set_max_size(cache, 0);
+    wait_for_eviction(cache);
+    json_t* shrunk = print_statistics(cache, "After shrinking the cache");
+    success = success && check(json_integer_value(json_object_get(shrunk, "evicted_blobs")) > 0,
+                               "Shrinking the cache evicted no blobs");
+
+    success = success && pull(repository, manifest_digest);
+    json_t* third = print_statistics(cache, "Third pull, from upstream again");
+    success = success && check(blob_statistic(third, "misses") > blob_statistic(second, "misses"),
+                               "The third pull did not miss the cache");
+    json_decref(second);
+    json_decref(shrunk);
+    json_decref(third);
+
+    registry_cache_free(cache);
+    return success ? 0 : 1;
+}
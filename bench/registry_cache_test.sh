@@ -0,0 +1,75 @@
+#!/bin/sh
+# Try the registry cache on a single host. A stand-in upstream registry is started on
+# 127.0.0.1:5002, and an image with a random layer of LAYER_MIB MiB is pushed to it with curl, so
+# neither Docker nor a network connection is needed once the registry binary is present. Then
+# registry_cache_host pulls the image through the cache. The registry binary is downloaded if it is
+# not in PATH. Ports 5000 to 5002 must be free, and /var/run/user/<uid> must exist. Run with
+# $ make -C bench registry-cache
+set -eu
+
+REGISTRY_VERSION=${REGISTRY_VERSION:-2.8.3}
+UPSTREAM=127.0.0.1:5002
+REPOSITORY=bench/image
+LAYER_MIB=${LAYER_MIB:-16}
+WORK=$(mktemp -d)
+
+cleanup() {
+    [ -z "${upstream_pid:-}" ] || kill "$upstream_pid"
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if ! command -v registry >/dev/null; then
+    mkdir "$WORK/bin"
+    curl -sSL "https://github.com/distribution/distribution/releases/download/v${REGISTRY_VERSION}/registry_${REGISTRY_VERSION}_linux_amd64.tar.gz" |
+        tar -xz -C "$WORK/bin" registry
+    PATH="$WORK/bin:$PATH"
+fi
+
+cat >"$WORK/upstream.yml" <<EOF
+version: 0.1
+log:
+  level: warn
+  accesslog:
+    disabled: true
+storage:
+  filesystem:
+    rootdirectory: "$WORK/upstream"
+http:
+  addr: $UPSTREAM
+EOF
+registry serve "$WORK/upstream.yml" &
+upstream_pid=$!
+until curl -sf "http://$UPSTREAM/v2/" >/dev/null; do sleep 0.1; done
+
+digest() {
+    echo "sha256:$(sha256sum "$1" | cut -d' ' -f1)"
+}
+
+push_blob() {
+    location=$(curl -sSf -X POST -D - -o /dev/null "http://$UPSTREAM/v2/$REPOSITORY/blobs/uploads/" |
+        sed -n 's/^[Ll]ocation: *//p' | tr -d '\r')
+    case $location in
+    *\?*) separator='&' ;;
+    *) separator='?' ;;
+    esac
+    curl -sSf -X PUT -H 'Content-Type: application/octet-stream' --data-binary "@$1" \
+        "$location${separator}digest=$(digest "$1")"
+}
+
+head -c $((LAYER_MIB * 1024 * 1024)) /dev/urandom >"$WORK/layer"
+echo '{"architecture":"arm64","os":"linux","rootfs":{"type":"layers","diff_ids":[]}}' \
+    >"$WORK/config"
+push_blob "$WORK/layer"
+push_blob "$WORK/config"
+cat >"$WORK/manifest" <<EOF
+{"schemaVersion":2,"mediaType":"application/vnd.docker.distribution.manifest.v2+json",
+"config":{"mediaType":"application/vnd.docker.container.image.v1+json",
+"size":$(wc -c <"$WORK/config"),"digest":"$(digest "$WORK/config")"},
+"layers":[{"mediaType":"application/vnd.docker.image.rootfs.diff.tar.gzip",
+"size":$(wc -c <"$WORK/layer"),"digest":"$(digest "$WORK/layer")"}]}
+EOF
+curl -sSf -X PUT -H 'Content-Type: application/vnd.docker.distribution.manifest.v2+json' \
+    --data-binary "@$WORK/manifest" "http://$UPSTREAM/v2/$REPOSITORY/manifests/latest"
+
+./registry_cache_host "http://$UPSTREAM" "$WORK/cache" "$REPOSITORY" "$(digest "$WORK/manifest")"